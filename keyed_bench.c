@@ -0,0 +1,254 @@
+// Benchmark for keyed execution on the application's worker pool: throughput
+// of tasks ordered per key through mailboxes, against the same tasks run
+// unordered and serialized with one global lock.
+// Build: g++ -O2 -pthread -o keyed_bench keyed_bench.c
+// Usage: keyed_bench [--threads=N] [--duration=MS] [--work=N] [--no-pin]
+
+#define THREADS_NO_MAIN
+#include "threads.c"
+
+#define BENCH_DEFAULT_THREADS 4
+#define BENCH_DEFAULT_DURATION_MS 500
+#define BENCH_DEFAULT_WORK 200      // Inner iterations per task
+#define BENCH_QUEUE_CAPACITY 1024
+
+static const int bench_keys[] = {1, 4, 16, 256, 4096};
+
+// Ways of running the same tasks
+enum {
+    VARIANT_UNORDERED = 0,
+    VARIANT_GLOBAL_LOCK,  // Every task holds one lock: ordered, but nothing runs in parallel
+    VARIANT_KEYED
+};
+
+// Command line configuration
+typedef struct {
+    int threads;
+    int duration_ms;
+    int work;
+    int pin;
+} BenchConfig;
+
+// State shared by the tasks of one measurement
+typedef struct {
+    int variant;
+    int work;
+    pthread_mutex_t global_lock;
+    std::atomic<long> completed;
+} BenchCase;
+
+// Monotonic time in nanoseconds
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Task body: a little floating point work, under the global lock if asked
+static Task* bench_task_run(AppContext* ctx, Task* task) {
+    BenchCase* bench = (BenchCase*)task->arg;
+    volatile double value = 0.0;
+    (void)ctx;
+
+    if (bench->variant == VARIANT_GLOBAL_LOCK) {
+        pthread_mutex_lock(&bench->global_lock);
+    }
+    for (int k = 0; k < bench->work; k++) {
+        value = value + sin(task->task_id * 0.001 + k);
+    }
+    if (bench->variant == VARIANT_GLOBAL_LOCK) {
+        pthread_mutex_unlock(&bench->global_lock);
+    }
+    bench->completed.fetch_add(1, std::memory_order_release);
+    return NULL;
+}
+
+// Tasks per second of one variant: submit for the configured duration, then
+// wait for the pool to finish what was submitted
+static double bench_measure(const BenchConfig* config, AppContext* ctx, int variant, int keys,
+                            long* submitted) {
+    BenchCase bench;
+    bench.variant = variant;
+    bench.work = config->work;
+    bench.completed.store(0, std::memory_order_relaxed);
+    pthread_mutex_init(&bench.global_lock, NULL);
+
+    uint64_t start = bench_now_ns();
+    uint64_t deadline = start + (uint64_t)config->duration_ms * 1000000ull;
+    long count = 0;
+    do {
+        Task* task = task_alloc(ctx, 0);
+        if (!task) {
+            perror("Failed to allocate benchmark task");
+            exit(EXIT_FAILURE);
+        }
+        task->task_id = (int)count;
+        task->priority = DEFAULT_MAX_PRIORITY;
+        task->run = bench_task_run;
+        task->arg = &bench;
+        gettimeofday(&task->start_time, NULL);
+
+        int result;
+        if (variant == VARIANT_KEYED) {
+            task->key = (int)(count % keys);
+            result = keyed_submit(ctx, task);
+        } else {
+            result = queue_enqueue(ctx->task_queue, task);
+        }
+        if (result != 0) {
+            fprintf(stderr, "Failed to submit benchmark task\n");
+            exit(EXIT_FAILURE);
+        }
+        count++;
+    } while (bench_now_ns() < deadline);
+
+    while (bench.completed.load(std::memory_order_acquire) < count) {
+        usleep(100);
+    }
+    double elapsed = (bench_now_ns() - start) / 1e9;
+    pthread_mutex_destroy(&bench.global_lock);
+
+    *submitted = count;
+    return count / elapsed;
+}
+
+// Print command line help
+static void bench_usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --threads=N     Pool workers (default: %d)\n", BENCH_DEFAULT_THREADS);
+    printf("  --duration=MS   Time each variant submits tasks for (default: %d)\n",
+           BENCH_DEFAULT_DURATION_MS);
+    printf("  --work=N        Inner iterations per task (default: %d)\n", BENCH_DEFAULT_WORK);
+    printf("  --no-pin        Let the scheduler place threads\n");
+    printf("  --help          Show this help\n");
+}
+
+// Parse command line options
+static void bench_parse_arguments(int argc, char* argv[], BenchConfig* config) {
+    static const struct option options[] = {
+        {"threads",  required_argument, NULL, 't'},
+        {"duration", required_argument, NULL, 'd'},
+        {"work",     required_argument, NULL, 'w'},
+        {"no-pin",   no_argument,       NULL, 'n'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    memset(config, 0, sizeof(BenchConfig));
+    config->threads = BENCH_DEFAULT_THREADS;
+    config->duration_ms = BENCH_DEFAULT_DURATION_MS;
+    config->work = BENCH_DEFAULT_WORK;
+    config->pin = 1;
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                config->threads = atoi(optarg);
+                if (config->threads < 1 || config->threads > MAX_THREADS) {
+                    fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                config->duration_ms = atoi(optarg);
+                break;
+            case 'w':
+                config->work = atoi(optarg);
+                break;
+            case 'n':
+                config->pin = 0;
+                break;
+            case 'h':
+                bench_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                bench_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (config->duration_ms < 1 || config->work < 1) {
+        fprintf(stderr, "Duration and work must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    CpuTopology topology;
+    ThreadPlacement placement;
+    AppConfig app;
+    AppContext ctx;
+    int cpu_order[MAX_CPUS];
+    long submitted;
+
+    bench_parse_arguments(argc, argv, &config);
+    log_direct_stream = stderr;  // Worker start and stop messages stay out of the table
+    topology_discover(&topology);
+    int num_cpus = topology_order(&topology, AFFINITY_COMPACT, cpu_order);
+
+    // A pool with workers only, and a mailbox for the largest key count
+    memset(&app, 0, sizeof(app));
+    app.num_threads = config.threads;
+    app.queue_capacity = BENCH_QUEUE_CAPACITY;
+    app.work_divisor = 1;
+    app.history_size = 1;
+    app.num_keys = bench_keys[sizeof(bench_keys) / sizeof(bench_keys[0]) - 1];
+    memset(&placement, 0, sizeof(placement));
+    for (int i = 0; i < config.threads; i++) {
+        placement.worker_cpus[i] = config.pin && num_cpus > 0 ? cpu_order[i % num_cpus] : -1;
+    }
+    placement.monitor_cpu = -1;
+    initialize_app_context(&ctx, config.threads, &app, &topology, &placement);
+    if (start_workers(&ctx, &topology, &placement) != 0) {
+        perror("Failed to create worker thread");
+        return EXIT_FAILURE;
+    }
+
+    printf("========================================\n");
+    printf("       KEYED EXECUTION BENCHMARK\n");
+    printf("========================================\n");
+    printf("- CPUs: %d, threads pinned: %s\n", topology.num_cpus, config.pin ? "yes" : "no");
+    printf("- Pool: %d workers, keys handed on in runs of up to %d tasks\n", config.threads,
+           KEY_MAILBOX_BATCH);
+    printf("- Work: %d iterations per task, %d ms per variant\n", config.work,
+           config.duration_ms);
+
+    double unordered = bench_measure(&config, &ctx, VARIANT_UNORDERED, 0, &submitted);
+    printf("- Unordered: %.0f tasks/second\n", unordered);
+    double global = bench_measure(&config, &ctx, VARIANT_GLOBAL_LOCK, 0, &submitted);
+    printf("- Global lock: %.0f tasks/second\n", global);
+    printf("========================================\n");
+    printf("%-7s %-14s %-14s %-14s %-9s %s\n", "Keys", "Keyed tasks/s", "vs unordered",
+           "vs global lock", "Inline %", "Order");
+    printf("========================================\n");
+
+    int status = EXIT_SUCCESS;
+    for (size_t k = 0; k < sizeof(bench_keys) / sizeof(bench_keys[0]); k++) {
+        KeyTotals before, after;
+        key_totals(&ctx, &before);
+        double keyed = bench_measure(&config, &ctx, VARIANT_KEYED, bench_keys[k], &submitted);
+        key_totals(&ctx, &after);
+
+        long violations = after.violations - before.violations;
+        char versus_unordered[16], versus_global[16];
+        snprintf(versus_unordered, sizeof(versus_unordered), "%+.1f%%",
+                 100.0 * (keyed - unordered) / unordered);
+        snprintf(versus_global, sizeof(versus_global), "%.2fx", keyed / global);
+        printf("%-7d %-14.0f %-14s %-14s %-9.1f %s\n", bench_keys[k], keyed, versus_unordered,
+               versus_global, 100.0 * (after.inlined - before.inlined) / submitted,
+               violations == 0 ? "ok" : "VIOLATED");
+        fflush(stdout);
+        if (violations != 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+    printf("========================================\n");
+
+    // Reuse the application's shutdown path to release the workers
+    shutdown_requested = 1;
+    stop_workers(&ctx);
+    shutdown_requested = 0;
+    cleanup_app_context(&ctx);
+    return status;
+}
@@ -0,0 +1,305 @@
+// Benchmark for parallel_for on the application's worker pool against
+// spawning fresh threads for every call, over a range of loop sizes.
+// Build: g++ -O2 -pthread -o parallel_bench parallel_bench.c
+// Usage: parallel_bench [--threads=N] [--duration=MS] [--grain=N] [--work=N] [--no-pin]
+
+#define THREADS_NO_MAIN
+#include "threads.c"
+
+#define BENCH_DEFAULT_THREADS 4
+#define BENCH_DEFAULT_DURATION_MS 500
+#define BENCH_DEFAULT_WORK 16       // Inner iterations per element
+#define BENCH_QUEUE_CAPACITY 1024
+#define BENCH_NESTED_BLOCKS 32      // Outer loop of the nested case
+
+static const long bench_sizes[] = {1000, 10000, 100000, 1000000};
+
+// Command line configuration
+typedef struct {
+    int threads;
+    int duration_ms;
+    long grain;  // 0 = parallel_for's default
+    int work;
+    int pin;
+} BenchConfig;
+
+// The loop body's data
+typedef struct {
+    double* out;
+    int work;
+} BenchLoop;
+
+// One slice of a spawned-thread call
+typedef struct {
+    BenchLoop* loop;
+    long begin;
+    long end;
+} BenchSlice;
+
+// Outer iteration of the nested case: a parallel_for inside a parallel_for
+typedef struct {
+    AppContext* ctx;
+    BenchLoop* loop;
+    long size;
+    long grain;
+} BenchNested;
+
+// Monotonic time in nanoseconds
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Loop body: a little floating point work per element
+static void bench_body(void* arg, long begin, long end) {
+    BenchLoop* loop = (BenchLoop*)arg;
+    for (long i = begin; i < end; i++) {
+        double value = 0.0;
+        for (int k = 0; k < loop->work; k++) {
+            value += sin(i * 0.001 + k);
+        }
+        loop->out[i] = value;
+    }
+}
+
+static void* bench_slice_thread(void* arg) {
+    BenchSlice* slice = (BenchSlice*)arg;
+    bench_body(slice->loop, slice->begin, slice->end);
+    return NULL;
+}
+
+// Baseline the pool replaces: one thread per slice, created and joined per call
+static void bench_spawn_for(const BenchConfig* config, const int* cpu_order, int num_cpus,
+                            BenchLoop* loop, long size) {
+    pthread_t threads[MAX_THREADS];
+    BenchSlice slices[MAX_THREADS + 1];
+    int parts = config->threads + 1;  // The caller takes a slice, as it does in parallel_for
+
+    for (int i = 0; i < parts; i++) {
+        slices[i].loop = loop;
+        slices[i].begin = size * i / parts;
+        slices[i].end = size * (i + 1) / parts;
+    }
+    for (int i = 0; i < config->threads; i++) {
+        int cpu = config->pin && num_cpus > 0 ? cpu_order[i % num_cpus] : -1;
+        if (create_thread_on_cpu(&threads[i], cpu, bench_slice_thread, &slices[i + 1]) != 0) {
+            perror("Failed to create benchmark thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench_body(loop, slices[0].begin, slices[0].end);
+    for (int i = 0; i < config->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Outer body of the nested case; each block runs its own parallel_for
+static void bench_nested_body(void* arg, long begin, long end) {
+    BenchNested* nested = (BenchNested*)arg;
+    for (long block = begin; block < end; block++) {
+        long first = nested->size * block / BENCH_NESTED_BLOCKS;
+        long last = nested->size * (block + 1) / BENCH_NESTED_BLOCKS;
+        parallel_for(nested->ctx, first, last, nested->grain, bench_body, nested->loop);
+    }
+}
+
+// Sum of the output, to check every variant computed the same thing
+static double bench_checksum(const double* out, long size) {
+    double sum = 0.0;
+    for (long i = 0; i < size; i++) {
+        sum += out[i];
+    }
+    return sum;
+}
+
+// Microseconds per call of one variant, repeated for the configured duration
+static double bench_measure(const BenchConfig* config, AppContext* ctx, const int* cpu_order,
+                            int num_cpus, BenchLoop* loop, long size, char variant,
+                            double* chunks) {
+    uint64_t deadline = bench_now_ns() + (uint64_t)config->duration_ms * 1000000ull;
+    uint64_t start = bench_now_ns();
+    long calls = 0;
+    long total_chunks = 0;
+    BenchNested nested = {ctx, loop, size, config->grain};
+
+    memset(loop->out, 0, size * sizeof(double));
+    do {
+        switch (variant) {
+            case 's':
+                bench_body(loop, 0, size);
+                break;
+            case 'p':
+                total_chunks += parallel_for(ctx, 0, size, config->grain, bench_body, loop);
+                break;
+            case 'n':
+                parallel_for(ctx, 0, BENCH_NESTED_BLOCKS, 1, bench_nested_body, &nested);
+                break;
+            default:
+                bench_spawn_for(config, cpu_order, num_cpus, loop, size);
+                break;
+        }
+        calls++;
+    } while (bench_now_ns() < deadline);
+
+    if (chunks) {
+        *chunks = (double)total_chunks / calls;
+    }
+    return (bench_now_ns() - start) / 1e3 / calls;
+}
+
+// Run every variant at one size and print its result row
+static int bench_run(const BenchConfig* config, AppContext* ctx, const int* cpu_order,
+                     int num_cpus, long size) {
+    BenchLoop loop = {NULL, config->work};
+    double chunks;
+
+    loop.out = (double*)malloc(size * sizeof(double));
+    if (!loop.out) {
+        perror("Failed to allocate benchmark output");
+        return -1;
+    }
+
+    double serial = bench_measure(config, ctx, cpu_order, num_cpus, &loop, size, 's', NULL);
+    double expected = bench_checksum(loop.out, size);
+    double pool = bench_measure(config, ctx, cpu_order, num_cpus, &loop, size, 'p', &chunks);
+    int valid = bench_checksum(loop.out, size) == expected;
+    double nested = bench_measure(config, ctx, cpu_order, num_cpus, &loop, size, 'n', NULL);
+    valid &= bench_checksum(loop.out, size) == expected;
+    double spawn = bench_measure(config, ctx, cpu_order, num_cpus, &loop, size, 't', NULL);
+    valid &= bench_checksum(loop.out, size) == expected;
+
+    printf("%-9ld %-12.1f %-12.1f %-12.1f %-12.1f %-8.2f %-8.2f %-8.1f %s\n", size, serial, pool,
+           nested, spawn, serial / pool, serial / spawn, chunks, valid ? "ok" : "MISMATCH");
+    fflush(stdout);
+
+    free(loop.out);
+    return valid ? 0 : -1;
+}
+
+// Print command line help
+static void bench_usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --threads=N     Pool workers, and threads spawned per call (default: %d)\n",
+           BENCH_DEFAULT_THREADS);
+    printf("  --duration=MS   Time each variant is repeated for (default: %d)\n",
+           BENCH_DEFAULT_DURATION_MS);
+    printf("  --grain=N       Smallest range parallel_for splits (default: about 8 per worker)\n");
+    printf("  --work=N        Inner iterations per element (default: %d)\n", BENCH_DEFAULT_WORK);
+    printf("  --no-pin        Let the scheduler place threads\n");
+    printf("  --help          Show this help\n");
+}
+
+// Parse command line options
+static void bench_parse_arguments(int argc, char* argv[], BenchConfig* config) {
+    static const struct option options[] = {
+        {"threads",  required_argument, NULL, 't'},
+        {"duration", required_argument, NULL, 'd'},
+        {"grain",    required_argument, NULL, 'g'},
+        {"work",     required_argument, NULL, 'w'},
+        {"no-pin",   no_argument,       NULL, 'n'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    memset(config, 0, sizeof(BenchConfig));
+    config->threads = BENCH_DEFAULT_THREADS;
+    config->duration_ms = BENCH_DEFAULT_DURATION_MS;
+    config->work = BENCH_DEFAULT_WORK;
+    config->pin = 1;
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                config->threads = atoi(optarg);
+                if (config->threads < 1 || config->threads > MAX_THREADS) {
+                    fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                config->duration_ms = atoi(optarg);
+                break;
+            case 'g':
+                config->grain = atol(optarg);
+                break;
+            case 'w':
+                config->work = atoi(optarg);
+                break;
+            case 'n':
+                config->pin = 0;
+                break;
+            case 'h':
+                bench_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                bench_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (config->duration_ms < 1 || config->grain < 0 || config->work < 1) {
+        fprintf(stderr, "Duration and work must be positive and grain non-negative\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    CpuTopology topology;
+    ThreadPlacement placement;
+    AppConfig app;
+    AppContext ctx;
+    int cpu_order[MAX_CPUS];
+
+    bench_parse_arguments(argc, argv, &config);
+    log_direct_stream = stderr;  // Worker start and stop messages stay out of the table
+    topology_discover(&topology);
+    int num_cpus = topology_order(&topology, AFFINITY_COMPACT, cpu_order);
+
+    // A pool with workers only: no producers, stress or monitor threads
+    memset(&app, 0, sizeof(app));
+    app.num_threads = config.threads;
+    app.queue_capacity = BENCH_QUEUE_CAPACITY;
+    app.work_divisor = 1;
+    app.history_size = 1;
+    memset(&placement, 0, sizeof(placement));
+    for (int i = 0; i < config.threads; i++) {
+        placement.worker_cpus[i] = config.pin && num_cpus > 0 ? cpu_order[i % num_cpus] : -1;
+    }
+    placement.monitor_cpu = -1;
+    initialize_app_context(&ctx, config.threads, &app, &topology, &placement);
+    if (start_workers(&ctx, &topology, &placement) != 0) {
+        perror("Failed to create worker thread");
+        return EXIT_FAILURE;
+    }
+
+    printf("========================================\n");
+    printf("       PARALLEL FOR BENCHMARK\n");
+    printf("========================================\n");
+    printf("- CPUs: %d, threads pinned: %s\n", topology.num_cpus, config.pin ? "yes" : "no");
+    printf("- Pool: %d workers plus the caller; spawn: %d threads plus the caller per call\n",
+           config.threads, config.threads);
+    printf("- Work: %d iterations per element, %d ms per variant\n", config.work,
+           config.duration_ms);
+    printf("- Nested: %d outer blocks, each a parallel_for of its own\n", BENCH_NESTED_BLOCKS);
+    printf("========================================\n");
+    printf("%-9s %-12s %-12s %-12s %-12s %-8s %-8s %-8s %s\n", "Size", "Serial us",
+           "Pool us", "Nested us", "Spawn us", "Pool x", "Spawn x", "Chunks", "Check");
+    printf("========================================\n");
+
+    int status = EXIT_SUCCESS;
+    for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        if (bench_run(&config, &ctx, cpu_order, num_cpus, bench_sizes[s]) != 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+    printf("========================================\n");
+
+    // Reuse the application's shutdown path to release the workers
+    shutdown_requested = 1;
+    stop_workers(&ctx);
+    shutdown_requested = 0;
+    cleanup_app_context(&ctx);
+    return status;
+}
@@ -0,0 +1,442 @@
+// Microbenchmark for ThreadSafeQueue: enqueue/dequeue throughput and per-op
+// latency across producer/consumer topologies and queue regimes, without the
+// simulate_work noise of the full application.
+// Build: g++ -O2 -pthread -o queue_bench queue_bench.c
+// Usage: queue_bench [--threads=N] [--duration=MS] [--warmup=MS] [--capacity=N]
+//                    [--backend=NAME] [--topology=NAME] [--regime=NAME] [--no-pin]
+
+#define THREADS_NO_MAIN
+#include "threads.c"
+
+#define BENCH_DEFAULT_THREADS 4
+#define BENCH_DEFAULT_DURATION_MS 1000
+#define BENCH_DEFAULT_WARMUP_MS 200
+#define BENCH_DEFAULT_CAPACITY 1024
+#define BENCH_SAMPLE_MASK 15        // Time one op in 16 to keep clock reads off the fast path
+#define BENCH_REGIME_DELAY_NS 2000  // Spin on the slow side to hold the queue empty or full
+#define BENCH_LINEAR_BUCKETS 16     // Exact buckets for 0-15 ns
+#define BENCH_SUB_BUCKETS 8
+#define BENCH_BUCKETS (BENCH_LINEAR_BUCKETS + 40 * BENCH_SUB_BUCKETS)
+
+// Benchmark phases, advanced by the main thread
+enum {
+    PHASE_WARMUP = 0,
+    PHASE_MEASURE,
+    PHASE_DONE
+};
+
+// Log-linear histogram of operation latencies in nanoseconds
+typedef struct {
+    long buckets[BENCH_BUCKETS];
+    long count;
+} OpHistogram;
+
+// Queue implementation under test
+typedef struct {
+    const char* name;
+    int node_local;  // Allocated and first-touched on NUMA node 0
+} BenchBackend;
+
+// Producer and consumer counts; 0 means --threads
+typedef struct {
+    const char* name;
+    int producers;
+    int consumers;
+} BenchTopology;
+
+// Spin delays that keep the queue in a given state
+typedef struct {
+    const char* name;
+    long producer_delay_ns;  // Slow producers keep the queue empty
+    long consumer_delay_ns;  // Slow consumers keep the queue full
+} BenchRegime;
+
+// One run of a backend/topology/regime combination
+typedef struct {
+    ThreadSafeQueue* queue;
+    std::atomic<int> phase;
+    long producer_delay_ns;
+    long consumer_delay_ns;
+} BenchCase;
+
+// Per-thread results, cache-line aligned so threads never share a line
+typedef struct alignas(64) {
+    BenchCase* bench;
+    int consumer;
+    long ops;
+    OpHistogram latency;
+} BenchThread;
+
+// Command line configuration
+typedef struct {
+    int threads;
+    int duration_ms;
+    int warmup_ms;
+    int capacity;
+    int pin;
+    const char* backend;
+    const char* topology;
+    const char* regime;
+} BenchConfig;
+
+static const BenchBackend backends[] = {
+    {"heap", 0},
+    {"node", 1},
+};
+
+static const BenchTopology topologies[] = {
+    {"1P1C", 1, 1},
+    {"1PnC", 1, 0},
+    {"nP1C", 0, 1},
+    {"nPnC", 0, 0},
+};
+
+static const BenchRegime regimes[] = {
+    {"steady", 0, 0},
+    {"empty", BENCH_REGIME_DELAY_NS, 0},
+    {"full", 0, BENCH_REGIME_DELAY_NS},
+};
+
+// Monotonic time in nanoseconds
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Busy-wait; sleeping would measure the scheduler instead of the queue
+static void bench_spin(long ns) {
+    if (ns <= 0) {
+        return;
+    }
+    uint64_t deadline = bench_now_ns() + ns;
+    while (bench_now_ns() < deadline) {
+    }
+}
+
+// Map a latency to its histogram bucket
+static int op_bucket(uint64_t ns) {
+    if (ns < BENCH_LINEAR_BUCKETS) {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (int)((ns >> (exponent - 3)) & (BENCH_SUB_BUCKETS - 1));
+    int bucket = BENCH_LINEAR_BUCKETS + (exponent - 4) * BENCH_SUB_BUCKETS + sub;
+    return bucket < BENCH_BUCKETS ? bucket : BENCH_BUCKETS - 1;
+}
+
+// Upper bound of a histogram bucket in nanoseconds
+static double op_bucket_upper(int bucket) {
+    if (bucket < BENCH_LINEAR_BUCKETS) {
+        return bucket + 1;
+    }
+    int exponent = 4 + (bucket - BENCH_LINEAR_BUCKETS) / BENCH_SUB_BUCKETS;
+    int sub = (bucket - BENCH_LINEAR_BUCKETS) % BENCH_SUB_BUCKETS;
+    return (double)((uint64_t)(BENCH_SUB_BUCKETS + sub + 1) << (exponent - 3));
+}
+
+// Latency at or below which the given percentage of samples fall
+static double op_percentile(const OpHistogram* hist, double percentile) {
+    if (hist->count == 0) {
+        return 0.0;
+    }
+    long target = (long)ceil(hist->count * percentile / 100.0);
+    long seen = 0;
+    for (int i = 0; i < BENCH_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target && seen > 0) {
+            return op_bucket_upper(i);
+        }
+    }
+    return op_bucket_upper(BENCH_BUCKETS - 1);
+}
+
+// Enqueue as fast as the regime allows
+static void* bench_producer(void* arg) {
+    BenchThread* self = (BenchThread*)arg;
+    BenchCase* bench = self->bench;
+    long n = 0;
+
+    for (;;) {
+        int phase = bench->phase.load(std::memory_order_relaxed);
+        if (phase == PHASE_DONE) {
+            break;
+        }
+
+        int sample = phase == PHASE_MEASURE && (n++ & BENCH_SAMPLE_MASK) == 0;
+        uint64_t start = sample ? bench_now_ns() : 0;
+        if (queue_enqueue(bench->queue, self) == -1) {
+            break;
+        }
+        if (phase == PHASE_MEASURE) {
+            self->ops++;
+            if (sample) {
+                self->latency.buckets[op_bucket(bench_now_ns() - start)]++;
+                self->latency.count++;
+            }
+        }
+        bench_spin(bench->producer_delay_ns);
+    }
+    return NULL;
+}
+
+// Dequeue as fast as the regime allows
+static void* bench_consumer(void* arg) {
+    BenchThread* self = (BenchThread*)arg;
+    BenchCase* bench = self->bench;
+    long n = 0;
+
+    for (;;) {
+        int phase = bench->phase.load(std::memory_order_relaxed);
+        if (phase == PHASE_DONE) {
+            break;
+        }
+
+        int sample = phase == PHASE_MEASURE && (n++ & BENCH_SAMPLE_MASK) == 0;
+        uint64_t start = sample ? bench_now_ns() : 0;
+        if (!queue_dequeue(bench->queue)) {
+            break;
+        }
+        if (phase == PHASE_MEASURE) {
+            self->ops++;
+            if (sample) {
+                self->latency.buckets[op_bucket(bench_now_ns() - start)]++;
+                self->latency.count++;
+            }
+        }
+        bench_spin(bench->consumer_delay_ns);
+    }
+    return NULL;
+}
+
+// Run one combination and print its result row
+static int bench_run(const BenchConfig* config, const CpuTopology* topo, const int* cpu_order,
+                     int num_cpus, const BenchBackend* backend, const BenchTopology* shape,
+                     const BenchRegime* regime) {
+    int producers = shape->producers ? shape->producers : config->threads;
+    int consumers = shape->consumers ? shape->consumers : config->threads;
+    int total = producers + consumers;
+    pthread_t threads[2 * MAX_THREADS];
+    BenchCase bench;
+
+    BenchThread* results = (BenchThread*)aligned_alloc(alignof(BenchThread),
+                                                       total * sizeof(BenchThread));
+    if (!results) {
+        perror("Failed to allocate benchmark threads");
+        return -1;
+    }
+    memset(results, 0, total * sizeof(BenchThread));
+
+    bench.queue = backend->node_local ?
+                  queue_create_on_node(config->capacity, 0, &topo->node_cpus[0]) :
+                  queue_create(config->capacity);
+    if (!bench.queue) {
+        free(results);
+        return -1;
+    }
+    bench.phase.store(PHASE_WARMUP, std::memory_order_relaxed);
+    bench.producer_delay_ns = regime->producer_delay_ns;
+    bench.consumer_delay_ns = regime->consumer_delay_ns;
+
+    // Producers and consumers alternate over the CPUs so both sides get
+    // the closest siblings
+    for (int i = 0; i < total; i++) {
+        int consumer = i % 2 == 1 ? i / 2 < consumers : i / 2 >= producers;
+        int cpu = config->pin && num_cpus > 0 ? cpu_order[i % num_cpus] : -1;
+        results[i].bench = &bench;
+        results[i].consumer = consumer;
+        if (create_thread_on_cpu(&threads[i], cpu, consumer ? bench_consumer : bench_producer,
+                                 &results[i]) != 0) {
+            perror("Failed to create benchmark thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    usleep(config->warmup_ms * 1000);
+    uint64_t start = bench_now_ns();
+    bench.phase.store(PHASE_MEASURE, std::memory_order_relaxed);
+    usleep(config->duration_ms * 1000);
+    bench.phase.store(PHASE_DONE, std::memory_order_relaxed);
+    uint64_t end = bench_now_ns();
+
+    // Reuse the application's shutdown path to release blocked threads
+    shutdown_requested = 1;
+    queue_wake_all(bench.queue);
+    for (int i = 0; i < total; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    shutdown_requested = 0;
+
+    OpHistogram enqueue_latency, dequeue_latency;
+    long enqueues = 0;
+    long dequeues = 0;
+    memset(&enqueue_latency, 0, sizeof(enqueue_latency));
+    memset(&dequeue_latency, 0, sizeof(dequeue_latency));
+    for (int i = 0; i < total; i++) {
+        OpHistogram* hist = results[i].consumer ? &dequeue_latency : &enqueue_latency;
+        for (int b = 0; b < BENCH_BUCKETS; b++) {
+            hist->buckets[b] += results[i].latency.buckets[b];
+        }
+        hist->count += results[i].latency.count;
+        if (results[i].consumer) {
+            dequeues += results[i].ops;
+        } else {
+            enqueues += results[i].ops;
+        }
+    }
+
+    double seconds = (end - start) / 1e9;
+    double contended = 0.0;
+#if LOCK_PROFILING
+    if (bench.queue->lock.acquisitions > 0) {
+        contended = 100.0 * bench.queue->lock.contended / bench.queue->lock.acquisitions;
+    }
+#endif
+    printf("%-6s %-6s %-7s %-3d %-3d %-12.0f %-12.0f %-9.0f %-9.0f %-9.0f %-9.0f %-6.1f\n",
+           backend->name, shape->name, regime->name, producers, consumers,
+           enqueues / seconds, dequeues / seconds,
+           op_percentile(&enqueue_latency, 50.0), op_percentile(&enqueue_latency, 99.0),
+           op_percentile(&dequeue_latency, 50.0), op_percentile(&dequeue_latency, 99.0),
+           contended);
+    fflush(stdout);
+
+    queue_destroy(bench.queue);
+    free(results);
+    return 0;
+}
+
+// Print command line help
+static void bench_usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --threads=N     Threads on the \"n\" side of 1PnC/nP1C/nPnC (default: %d)\n",
+           BENCH_DEFAULT_THREADS);
+    printf("  --duration=MS   Measured time per case (default: %d)\n", BENCH_DEFAULT_DURATION_MS);
+    printf("  --warmup=MS     Unmeasured time before each case (default: %d)\n",
+           BENCH_DEFAULT_WARMUP_MS);
+    printf("  --capacity=N    Queue slots (default: %d)\n", BENCH_DEFAULT_CAPACITY);
+    printf("  --backend=NAME  Only run heap or node\n");
+    printf("  --topology=NAME Only run 1P1C, 1PnC, nP1C or nPnC\n");
+    printf("  --regime=NAME   Only run steady, empty or full\n");
+    printf("  --no-pin        Let the scheduler place threads\n");
+    printf("  --help          Show this help\n");
+}
+
+// Parse command line options
+static void bench_parse_arguments(int argc, char* argv[], BenchConfig* config) {
+    static const struct option options[] = {
+        {"threads",  required_argument, NULL, 't'},
+        {"duration", required_argument, NULL, 'd'},
+        {"warmup",   required_argument, NULL, 'w'},
+        {"capacity", required_argument, NULL, 'q'},
+        {"backend",  required_argument, NULL, 'b'},
+        {"topology", required_argument, NULL, 'o'},
+        {"regime",   required_argument, NULL, 'r'},
+        {"no-pin",   no_argument,       NULL, 'n'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    memset(config, 0, sizeof(BenchConfig));
+    config->threads = BENCH_DEFAULT_THREADS;
+    config->duration_ms = BENCH_DEFAULT_DURATION_MS;
+    config->warmup_ms = BENCH_DEFAULT_WARMUP_MS;
+    config->capacity = BENCH_DEFAULT_CAPACITY;
+    config->pin = 1;
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                config->threads = atoi(optarg);
+                if (config->threads < 1 || config->threads > MAX_THREADS) {
+                    fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                config->duration_ms = atoi(optarg);
+                break;
+            case 'w':
+                config->warmup_ms = atoi(optarg);
+                break;
+            case 'q':
+                config->capacity = atoi(optarg);
+                if (config->capacity < 1) {
+                    fprintf(stderr, "Queue capacity must be positive\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                config->backend = optarg;
+                break;
+            case 'o':
+                config->topology = optarg;
+                break;
+            case 'r':
+                config->regime = optarg;
+                break;
+            case 'n':
+                config->pin = 0;
+                break;
+            case 'h':
+                bench_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                bench_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (config->duration_ms < 1 || config->warmup_ms < 0) {
+        fprintf(stderr, "Duration must be positive and warmup non-negative\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    CpuTopology topology;
+    int cpu_order[MAX_CPUS];
+
+    bench_parse_arguments(argc, argv, &config);
+    topology_discover(&topology);
+    int num_cpus = topology_order(&topology, AFFINITY_COMPACT, cpu_order);
+
+    printf("========================================\n");
+    printf("       QUEUE MICROBENCHMARK\n");
+    printf("========================================\n");
+    printf("- CPUs: %d, threads pinned: %s\n", topology.num_cpus, config.pin ? "yes" : "no");
+    printf("- Duration: %d ms after %d ms warmup, capacity %d\n",
+           config.duration_ms, config.warmup_ms, config.capacity);
+    printf("- Latency: one op in %d timed, in nanoseconds\n", BENCH_SAMPLE_MASK + 1);
+    printf("========================================\n");
+    printf("%-6s %-6s %-7s %-3s %-3s %-12s %-12s %-9s %-9s %-9s %-9s %-6s\n",
+           "Queue", "Shape", "Regime", "P", "C", "Enq/s", "Deq/s",
+           "Enq p50", "Enq p99", "Deq p50", "Deq p99", "Cont%");
+    printf("========================================\n");
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        if (config.backend && strcmp(config.backend, backends[b].name) != 0) {
+            continue;
+        }
+        if (backends[b].node_local && topology.num_nodes < 1) {
+            continue;
+        }
+        for (size_t t = 0; t < sizeof(topologies) / sizeof(topologies[0]); t++) {
+            if (config.topology && strcmp(config.topology, topologies[t].name) != 0) {
+                continue;
+            }
+            for (size_t r = 0; r < sizeof(regimes) / sizeof(regimes[0]); r++) {
+                if (config.regime && strcmp(config.regime, regimes[r].name) != 0) {
+                    continue;
+                }
+                if (bench_run(&config, &topology, cpu_order, num_cpus, &backends[b],
+                              &topologies[t], &regimes[r]) != 0) {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    printf("========================================\n");
+    return EXIT_SUCCESS;
+}
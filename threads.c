@@ -8,97 +8,1098 @@
 #include <sys/time.h>
 #include <stdint.h>
 #include <signal.h>
+#include <math.h>
+#include <sched.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <atomic>
 
+#include "valiant_stats.h"
+
+// Valgrind client requests when the headers are installed (as in the valiant
+// container); otherwise they compile to nothing
+#if defined(__has_include)
+#if __has_include(<valgrind/valgrind.h>)
+#include <valgrind/valgrind.h>
+#endif
+#if __has_include(<valgrind/callgrind.h>)
+#include <valgrind/callgrind.h>
+#endif
+#endif
+#ifndef RUNNING_ON_VALGRIND
+#define RUNNING_ON_VALGRIND 0
+#endif
+#ifndef CALLGRIND_START_INSTRUMENTATION
+#define CALLGRIND_START_INSTRUMENTATION
+#define CALLGRIND_STOP_INSTRUMENTATION
+#endif
+
+// Happens-before annotations for the lock-free paths, so helgrind and DRD
+// can check them without suppressions. Build with -DVALIANT_INSTRUMENTED=1
+// (add -DVALIANT_DRD=1 when running under DRD); otherwise they are no-ops.
+#ifndef VALIANT_INSTRUMENTED
+#define VALIANT_INSTRUMENTED 0
+#endif
+#if VALIANT_INSTRUMENTED && defined(__has_include)
+#if defined(VALIANT_DRD) && __has_include(<valgrind/drd.h>)
+#include <valgrind/drd.h>
+#elif __has_include(<valgrind/helgrind.h>)
+#include <valgrind/helgrind.h>
+#endif
+#endif
+#ifndef ANNOTATE_HAPPENS_BEFORE
+#define ANNOTATE_HAPPENS_BEFORE(obj) do { } while (0)
+#define ANNOTATE_HAPPENS_AFTER(obj) do { } while (0)
+#endif
+#ifndef ANNOTATE_BENIGN_RACE_SIZED
+#define ANNOTATE_BENIGN_RACE_SIZED(addr, size, desc) do { } while (0)
+#endif
+
 #define MAX_THREADS 32
+#define MAX_PRODUCERS 16
+#define MAX_STAGES 8
+#define MAX_DAG_NODES (1 << 20)
+#define MAX_DAG_FANIN 16
+#define FUTURE_INLINE_BYTES 48  // Future values up to this size are stored without allocating
+#define MAX_REQUEST_FANOUT 16
+#define MAX_KEYS 65536
+#define KEY_MAILBOX_BATCH 32  // Tasks of one key run back to back before the key requeues
 #define MAX_QUEUE_SIZE 1000
 #define DEFAULT_NUM_THREADS 8
 #define DEFAULT_NUM_TASKS 10000
 #define DEFAULT_TEST_DURATION 10  // seconds
+#define DEFAULT_STRESS_TASKS 500  // Extra tasks per stress round
+#define DEFAULT_BURST_PERIOD_MS 5000   // Time between stress bursts
+#define DEFAULT_BURST_DURATION_MS 1000 // Length of square, ramp and sine bursts
+#define BURST_AMPLITUDE_DEFAULT -1     // Burst amplitude not given: use the stress task count
+#define BURST_TICK_US 20000            // Burst pacing and recovery sampling period
+#define BURST_REFERENCE_MS 1000        // Longest quiet window before a burst used as the reference
+#define BURST_MAX_RECORDS 256          // Bursts remembered per run for the final report
+#define BURST_DEPTH_SLACK 0.10         // Depth within 10% (+2 tasks) of the reference is recovered
+#define BURST_DEPTH_MIN_SLACK 2
+#define BURST_LATENCY_SLACK 0.25       // p99 within 25% of the reference is recovered
+#define DEFAULT_MIN_PRIORITY 1
+#define DEFAULT_MAX_PRIORITY 10
+#define VALGRIND_TASK_DIVISOR 50  // Workload reduction when running under valgrind
+#define VALGRIND_WORK_DIVISOR 10  // Per-task work reduction under valgrind
+#define MAX_CPUS CPU_SETSIZE
+#define SYSFS_CPU_DIR "/sys/devices/system/cpu"
+#define SYSFS_NODE_DIR "/sys/devices/system/node"
+#define MAX_NUMA_NODES 64
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define MIN_QUEUE_SIZE 16
+#define QUEUE_MEMORY_FRACTION 64  // Queue slots and pooled tasks may use 1/64 of the memory limit
+#define LATENCY_LINEAR_BUCKETS 16  // Exact buckets for 0-15 microseconds
+#define LATENCY_SUB_BUCKETS 8      // Buckets per power of two above that (12.5% resolution)
+#define LATENCY_BUCKETS (LATENCY_LINEAR_BUCKETS + 24 * LATENCY_SUB_BUCKETS)  // Up to ~268 s
+#define MONITOR_SAMPLES_PER_INTERVAL 10  // Queue depth samples per monitor report
+#define DEFAULT_HISTORY_SIZE 300         // Monitor intervals kept for the exit dump
+#define NUMA_STEAL_WAIT_US 1000  // Local queue wait before re-checking remote nodes
+#define METRICS_SCHEMA_VERSION 1  // Bump when metrics records change incompatibly
+#define PROMETHEUS_POLL_MS 200    // How often the exporter re-checks for shutdown
+#define TRACE_MAX_THREADS (MAX_THREADS + MAX_PRODUCERS + 8)  // Workers, producers and helpers
+#define TRACE_RING_EVENTS 65536  // Per thread; the oldest events are overwritten
+
+#define LOG_RING_BYTES 65536  // Per thread log ring, a power of two
+#define LOG_MESSAGE_MAX 1024  // Longer messages are truncated
+#define LOG_MAX_RINGS (MAX_THREADS + MAX_PRODUCERS + 8)
+#define LOG_IDLE_US 2000      // Writer sleep when every ring is empty
+#define LOG_BATCH_IOVECS 64   // Records gathered into one writev
+
+#define RUN_POLL_US 10000                 // Main thread completion check
+#define BASELINE_FORMAT_VERSION 1         // Bump when the baseline file layout changes
+#define BASELINE_MAX_RUNS 64
+#define BASELINE_MIN_RUNS 5               // Fewer runs per side only reveal large shifts
+#define BASELINE_LINE_MAX 8192
+#define BASELINE_ALPHA 0.05               // Significance level of the regression test
+#define DEFAULT_REGRESSION_THRESHOLD 5.0  // Median change in percent tolerated as noise
+#define TRIAL_CONFIDENCE 0.95             // Coverage of the reported median intervals
+#define EXIT_REGRESSION 2                 // Exit status when a comparison finds a regression
+
+// Lock contention profiling; build with -DLOCK_PROFILING=0 to compile it out
+#ifndef LOCK_PROFILING
+#define LOCK_PROFILING 1
+#endif
 
 // Atomic flag for graceful shutdown
 volatile sig_atomic_t shutdown_requested = 0;
 
+// Set by SIGINT/SIGTERM; unlike shutdown_requested it also stops repeated runs
+volatile sig_atomic_t interrupted = 0;
+
+// Mutex that records how contended it is. The counters are only updated
+// while the mutex is held, so they need no synchronisation of their own.
+typedef struct {
+    pthread_mutex_t mutex;
+#if LOCK_PROFILING
+    char name[24];
+    long acquisitions;
+    long contended;            // Acquisitions that had to wait
+    double wait_time;          // Seconds spent waiting to acquire
+    double max_hold_time;      // Longest single hold in seconds
+    struct timespec acquired_at;
+#endif
+} ProfiledMutex;
+
 // Thread-safe queue structure
 typedef struct {
     void** items;
     int head;
     int tail;
-    int count;
+    std::atomic<int> count;  // Written under lock, readable without it
     int capacity;
-    pthread_mutex_t lock;
+    int node;  // NUMA node backing this queue, -1 for the heap
+    ProfiledMutex lock;
     pthread_cond_t not_empty;
     pthread_cond_t not_full;
 } ThreadSafeQueue;
 
+struct TaskPool;
+struct AppContext;
+
 // Task structure
-typedef struct {
+typedef struct Task {
     int task_id;
     int priority;
     struct timeval start_time;
     struct timeval end_time;
+    struct TaskPool* pool;  // Owning pool, NULL if allocated from the heap
+    // Work to do instead of the configured workload, NULL for the default.
+    // It may return a task that became ready, which the same worker runs next.
+    struct Task* (*run)(struct AppContext* ctx, struct Task* task);
+    // Called instead of run when the task is dropped at shutdown, NULL if
+    // nothing needs releasing
+    void (*discard)(struct AppContext* ctx, struct Task* task);
+    void* arg;  // For run and discard
+    int internal;             // Pool plumbing: timed as busy, not counted as a completed task
+    int key;                  // Tasks sharing a key run in submission order, -1 = unordered
+    long key_sequence;        // Position in its key's order
+    struct Task* key_next;    // Next task waiting in the same key's mailbox
 } Task;
 
-// Worker thread statistics
+// Per-node pool of preallocated tasks
+typedef struct TaskPool {
+    Task* tasks;
+    Task** free_list;
+    int free_count;
+    int capacity;
+    int node;
+    ProfiledMutex lock;
+} TaskPool;
+
+// Log-linear histogram of latencies in microseconds
 typedef struct {
+    long buckets[LATENCY_BUCKETS];
+    long count;
+    double sum;  // Seconds
+    double max;  // Seconds
+} LatencyHistogram;
+
+// Worker thread statistics, written only by the owning worker
+typedef struct alignas(64) {
     int thread_id;
     long tasks_completed;
     long tasks_failed;
     double total_processing_time;
     double max_processing_time;
     double min_processing_time;
+    long local_dequeues;   // Tasks taken from the worker's own node queue
+    long remote_dequeues;  // Tasks stolen from another node's queue
+    double busy_cpu_time;  // Thread CPU time spent inside tasks
+    long tasks_forwarded;     // Passed on to the next pipeline stage
+    double downstream_blocked;  // Seconds waiting for room in the next stage's queue
+    LatencyHistogram latency;  // Enqueue to completion
 } WorkerStats;
 
-// Shared application state
+// CPU time and scheduling of one thread over its lifetime; written only by
+// that thread, read after it has been joined
+typedef struct {
+    struct timeval started;
+    double wall_time;
+    double cpu_time;
+    long voluntary_switches;    // Blocked and gave up the CPU
+    long involuntary_switches;  // Preempted
+    int recorded;
+} ThreadUsage;
+
+// Sequence counter guarding one worker's WorkerStats; odd while it is
+// being updated. Readers retry instead of making the worker wait.
+typedef struct alignas(64) {
+    std::atomic<unsigned> sequence;
+} StatsSeqlock;
+
+// Counters sampled per worker with perf_event_open
+typedef enum {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_COUNTER_COUNT
+} PerfCounter;
+
+// A worker's counter descriptors, opened by the worker for itself
+typedef struct {
+    int fds[PERF_COUNTER_COUNT];  // -1 where the counter could not be opened
+    int error;                    // errno of the first counter that failed to open
+    std::atomic<int> ready;       // Set once fds is filled in
+} WorkerPerf;
+
+// Counter values at one point in time
+typedef struct {
+    double values[PERF_COUNTER_COUNT];  // Scaled up when the kernel multiplexed counters
+    unsigned available;                 // Bit per counter that could be read
+} PerfSample;
+
+// Thread placement policies
+typedef enum {
+    AFFINITY_NONE = 0,   // Let the scheduler decide
+    AFFINITY_COMPACT,    // Fill SMT siblings, then cores, then packages
+    AFFINITY_SCATTER,    // Spread across packages and cores, SMT siblings last
+    AFFINITY_CORE,       // One thread per physical core
+    AFFINITY_LIST        // Explicit CPU list from the command line
+} AffinityPolicy;
+
+// Machine-readable metrics output
+typedef enum {
+    METRICS_NONE = 0,
+    METRICS_JSONL,  // One JSON object per line
+    METRICS_CSV     // Header row, then one row per record
+} MetricsFormat;
+
+// Logical CPU as described by sysfs
+typedef struct {
+    int cpu;
+    int package_id;
+    int core_id;
+    int core_rank;   // Index of the core within its package
+    int smt_index;   // Index of the CPU among its core's SMT siblings
+    int node;        // Index into CpuTopology::node_ids
+} CpuInfo;
+
+// Online CPUs this process is allowed to run on
+typedef struct {
+    CpuInfo cpus[MAX_CPUS];
+    int num_cpus;
+    int num_cores;
+    int num_packages;
+    int num_nodes;
+    int node_ids[MAX_NUMA_NODES];       // sysfs node number for each node index
+    cpu_set_t node_cpus[MAX_NUMA_NODES];
+} CpuTopology;
+
+// CPU chosen for each thread role (-1 = unpinned)
+typedef struct {
+    int worker_cpus[MAX_THREADS];
+    int worker_nodes[MAX_THREADS];  // NUMA node index each worker serves
+    int producer_cpus[MAX_PRODUCERS];
+    int monitor_cpu;
+} ThreadPlacement;
+
+// Resource limits imposed on this process, e.g. by docker run
+typedef struct {
+    int cgroup_version;       // 1 or 2, 0 if no cgroup hierarchy was found
+    double cpu_quota;         // CPUs granted by the CFS quota, 0 if unlimited
+    long long memory_limit;   // Bytes, 0 if unlimited
+    int online_cpus;          // What sysconf reports
+    int allowed_cpus;         // CPUs in the affinity mask (cpuset)
+    int effective_cpus;       // CPUs we can actually keep busy
+} ResourceLimits;
+
+// What one producer generates
+typedef struct {
+    double rate;       // Tasks per second, 0 = the default throttle
+    int min_priority;  // Priorities are drawn uniformly from this range
+    int max_priority;
+} ProducerSpec;
+
+// Work a pipeline stage does per task
+typedef enum {
+    WORK_PRIORITY = 0,  // simulate_work: cost falls with priority, occasional I/O
+    WORK_CPU,           // Fixed thread CPU time
+    WORK_IO             // Fixed sleep, standing in for a blocking call
+} StageWork;
+
+// One stage of the pipeline and the workers that serve its queue
+typedef struct {
+    char name[16];
+    int workers;
+    StageWork work;
+    int work_us;  // CPU or sleep time per task for WORK_CPU and WORK_IO
+} StageSpec;
+
+// Shapes of the load the stress thread adds
+typedef enum {
+    BURST_NONE = 0,
+    BURST_SPIKE,   // Every task at once
+    BURST_SQUARE,  // Constant rate for the duration
+    BURST_RAMP,    // Rate rising linearly over the duration
+    BURST_SINE     // Rate following half a sine wave over the duration
+} BurstShape;
+
+// Load added by the stress thread once per period
+typedef struct {
+    BurstShape shape;
+    int amplitude;    // Tasks per burst, BURST_AMPLITUDE_DEFAULT = the stress task default
+    int period_ms;    // From one burst start to the next
+    int duration_ms;  // Length of each burst; spikes ignore it
+    int min_priority;
+    int max_priority;
+} BurstProfile;
+
+// Generated dependency graphs
+typedef enum {
+    DAG_NONE = 0,
+    DAG_LAYERED,  // Build-like: layers of targets depending on earlier ones
+    DAG_TREE      // Query-plan-like: leaves scanned, then reduced to one root
+} DagShape;
+
+// Graph run by the DAG executor instead of the producers' tasks
+typedef struct {
+    DagShape shape;
+    int layers;  // Layered: layers; tree: depth below the root
+    int width;   // Layered: nodes per layer
+    int fanin;   // Layered: dependencies per node; tree: children per node
+    unsigned seed;
+} DagSpec;
+
+// Command line configuration
+typedef struct {
+    int num_threads;     // 0 = derive from resource limits
+    int queue_capacity;  // 0 = derive from resource limits
+    AffinityPolicy affinity;
+    int cpu_list[MAX_CPUS];
+    int cpu_list_len;
+    int numa;  // One queue and task pool per NUMA node
+    int history_size;          // Monitor intervals kept in memory
+    const char* history_file;  // CSV dump of the interval history, NULL for stdout
+    MetricsFormat metrics_format;
+    const char* metrics_out;   // Path, "fd:N" or "-" for stdout
+    const char* prometheus;    // "unix:PATH" or a loopback TCP port, NULL if disabled
+    char shm_name[64];         // Shared-memory stats segment, empty if disabled
+    int perf;                  // Per-worker hardware counters
+    int num_tasks;             // Tasks the producers generate together, 0 = default
+    int num_producers;         // Producer threads, 0 = one per --producer, at least one
+    int num_producer_specs;    // Producers configured with --producer
+    ProducerSpec producers[MAX_PRODUCERS];
+    int stress_tasks;          // Default tasks per stress burst
+    BurstProfile burst;        // Stress load
+    int request_fanout;        // Requests answered from this many futures, 0 = plain tasks
+    int num_keys;              // Keys tasks are ordered by, 0 = unordered
+    int num_stages;            // Pipeline stages, 0 = every worker serves one queue
+    StageSpec stages[MAX_STAGES];
+    DagSpec dag;               // Replaces the producers unless DAG_NONE
+    int work_divisor;          // Divides the work done per task
+    int valgrind;              // Running under valgrind, workload scaled down
+    const char* trace_file;    // Chrome trace output, NULL if tracing is off
+    int trace_sample;          // Trace one task lifecycle in this many
+    int runs;                  // Times the whole run is repeated, 0 = default
+    const char* baseline_out;  // Save the runs as a baseline here, NULL if not
+    const char* baseline_in;   // Compare the runs against this baseline, NULL if not
+    double regression_threshold;  // Percent change of a median ignored as noise
+    int warmup_ms;             // Start of each run left out of its figures
+    int reuse_context;         // Keep queues, pools and stats memory across runs
+} AppConfig;
+
+// Events recorded in trace mode
+typedef enum {
+    TRACE_ENQUEUE = 0,
+    TRACE_DEQUEUE,
+    TRACE_WORK_BEGIN,
+    TRACE_WORK_END,
+    TRACE_WAIT_NOT_FULL_BEGIN,
+    TRACE_WAIT_NOT_FULL_END,
+    TRACE_WAIT_NOT_EMPTY_BEGIN,
+    TRACE_WAIT_NOT_EMPTY_END
+} TraceEventType;
+
+typedef struct {
+    uint64_t timestamp_ns;  // Since the trace origin
+    int32_t type;
+    int32_t task_id;
+} TraceEvent;
+
+// One thread's events; only that thread writes, the dump runs after joins
+typedef struct {
+    TraceEvent* events;
+    long written;  // Total recorded, including overwritten ones
+    char name[24];
+} TraceRing;
+
+// Every thread's trace ring
+typedef struct TraceLog {
+    TraceRing rings[TRACE_MAX_THREADS];
+    std::atomic<int> num_rings;
+    int sample_every;  // Trace the lifecycle of one task in this many
+    struct timespec origin;
+} TraceLog;
+
+// One thread's log messages: a single-producer, single-consumer byte ring of
+// [uint32 length][text] records
+typedef struct {
+    char* data;
+    std::atomic<size_t> head;   // Advanced by the owning thread
+    std::atomic<size_t> tail;   // Advanced by the writer thread
+    std::atomic<long> dropped;  // Messages lost because the ring was full
+    std::atomic<int> ready;     // Set once the owner has initialised the ring
+} LogRing;
+
+// Background writer draining every thread's ring to a file descriptor
+typedef struct AsyncLogger {
+    LogRing rings[LOG_MAX_RINGS];
+    std::atomic<int> num_rings;
+    std::atomic<int> stop;
+    pthread_t thread;
+    int fd;
+} AsyncLogger;
+
+// How the system absorbed one burst. Recovery times run from the end of the
+// burst to the last sample that was still outside the reference, -1 if the
+// next burst or the end of the run came first.
+typedef struct {
+    double started;           // Seconds since the run started
+    int tasks;
+    double reference_depth;   // Average queue depth in the window before the burst
+    int peak_depth;
+    double depth_recovery;    // Seconds
+    double reference_p99;     // Latency p99 in the window before the burst
+    double peak_p99;          // Worst p99 of any sampling window afterwards
+    double latency_recovery;  // Seconds
+} BurstRecord;
+
+// One task of the DAG. Node IDs are a topological order: every dependency
+// has a lower ID than its dependents.
+typedef struct {
+    int priority;            // Sets the work done, as for producer tasks
+    int num_deps;
+    std::atomic<int> pending;  // Dependencies not finished yet; 0 = runnable
+    int first_successor;     // Range in Dag::successors
+    int num_successors;
+    double started;          // Seconds since the DAG was seeded, written by the
+    double finished;         // worker that ran the node, read after the joins
+} DagNode;
+
+// State of the DAG executor for one run
+typedef struct Dag {
+    DagNode* nodes;
+    int num_nodes;
+    int* successors;
+    int num_edges;
+    std::atomic<int> remaining;  // Nodes not finished yet
+    std::atomic<long> inlined;   // Ready successors run by the worker that released them
+    std::atomic<long> queued;    // Ready successors handed to the shared queue
+    struct timespec seeded;
+    double makespan;  // Seconds from seeding to the last node finishing
+} Dag;
+
+// Work forked into a TaskGroup. Callers embed it at the start of their own
+// struct; fn runs on whichever thread picks the job up and frees the wrapper.
+typedef struct ForkJob {
+    void (*fn)(struct AppContext* ctx, struct ForkJob* job);
+    struct TaskGroup* group;
+    struct ForkJob* next;  // In AppContext::fork_jobs until started
+} ForkJob;
+
+// Jobs forked together and joined together
+typedef struct TaskGroup {
+    std::atomic<int> pending;  // Forked jobs not finished yet
+} TaskGroup;
+
+// One parallel_for call, shared by all of its chunks
+typedef struct {
+    TaskGroup group;
+    void (*fn)(void* arg, long begin, long end);
+    void* arg;
+    long grain;               // Ranges this small are never split
+    std::atomic<long> splits;
+} ParallelLoop;
+
+// Part of a parallel_for range forked to the pool
+typedef struct {
+    ForkJob job;  // First, so the ForkJob* handed back is the chunk
+    ParallelLoop* loop;
+    long begin;
+    long end;
+} ParallelChunk;
+
+// States of a future
+enum {
+    FUTURE_PENDING = 0,
+    FUTURE_READY,     // Holds a value
+    FUTURE_ABANDONED  // Will never hold one: its work was dropped at shutdown
+};
+
+struct Future;
+
+// Produces a future's value. input is the future it continues (NULL for
+// future_submit); fn should future_set output before returning, otherwise
+// output completes empty, or abandoned if input was.
+typedef void (*FutureFn)(struct AppContext* ctx, struct Future* input, void* arg,
+                         struct Future* output);
+
+// Work waiting for a future to complete
+typedef struct Continuation {
+    struct Continuation* next;
+    FutureFn fn;
+    void* arg;
+    struct Future* input;   // Referenced until fn has run
+    struct Future* output;  // Referenced until fn has run, NULL for when_all's bookkeeping
+    int run_inline;         // Cheap enough to run on the thread completing the input
+} Continuation;
+
+// Result of work on the pool. Values of up to FUTURE_INLINE_BYTES are kept
+// in storage, so delivering them allocates nothing; larger ones get a heap
+// block. Reference counted: the submitter and the producing work each hold one.
+typedef struct Future {
+    struct AppContext* ctx;
+    std::atomic<Continuation*> continuations;  // future_list_closed once completed
+    std::atomic<int> state;
+    std::atomic<int> refs;
+    std::atomic<int> waiters;  // Threads in future_wait
+    size_t size;
+    void* data;                // storage or a heap block; valid once READY
+    struct timespec completed_at;
+    alignas(16) unsigned char storage[FUTURE_INLINE_BYTES];
+} Future;
+
+// Result delivery counters, updated by whichever thread completes a future
 typedef struct {
+    std::atomic<long> completed;
+    std::atomic<long> abandoned;
+    std::atomic<long> inline_values;     // Stored in the future itself
+    std::atomic<long> heap_values;
+    std::atomic<long> scheduled;         // Continuations run as pool tasks
+    std::atomic<long> fallbacks;         // Run by the completing thread, the queue being full
+    std::atomic<long> delivered;         // Continuations whose delivery was timed
+    std::atomic<long> delivery_ns;       // Input completed to continuation started, summed
+    std::atomic<long> max_delivery_ns;
+    std::atomic<long> requests;          // Requests answered in --requests mode
+} FutureStats;
+
+// Tasks of one key that are waiting for its running task to finish. Only one
+// task of a key is queued or running at a time; finishing it hands the next
+// one to the same worker, so a key's tasks never wait on each other while
+// holding a worker.
+typedef struct {
+    ProfiledMutex lock;
+    Task* head;        // Waiting tasks, oldest first
+    Task* tail;
+    int active;        // A task of this key is queued or running
+    int streak;        // Tasks run back to back since the key last went through the queue
+    int backlog;
+    int max_backlog;
+    long submitted;    // Sequence numbers handed out
+    long executed;     // Next sequence number expected to run
+    long violations;   // Tasks that ran out of order
+    long inlined;      // Handed to the worker that ran the previous task
+    long requeued;     // Sent back through the queue after a streak
+} KeyMailbox;
+
+// Mailbox counters summed over every key
+typedef struct {
+    long executed;
+    long inlined;
+    long requeued;
+    long violations;
+    long busiest;      // Tasks run by the key that ran the most
+    int used;          // Keys that ran at least one task
+    int max_backlog;
+} KeyTotals;
+
+// Tasks waiting in all mailboxes together. They hold no queue slot, so they
+// are capped at the queue capacity to give keyed submitters the same
+// backpressure the queue gives everyone else.
+typedef struct {
+    std::atomic<int> tasks;
+    std::atomic<int> waiters;  // Submitters blocked on the cap
+    ProfiledMutex lock;        // Only taken to wait for room or to wake a waiter
+    pthread_cond_t not_full;
+} KeyBacklog;
+
+// One producer thread: its share of the task IDs and what it measured.
+// Written only by the producer, read after it has been joined.
+typedef struct alignas(64) {
+    struct AppContext* ctx;
+    int index;
+    ProducerSpec spec;
+    int first_task_id;    // This producer generates [first_task_id, end_task_id)
+    int end_task_id;
+    long enqueued;
+    double blocked_time;  // Seconds inside queue_enqueue: lock waits and full queues
+    double max_blocked;   // Longest single enqueue in seconds
+    ThreadUsage usage;
+} Producer;
+
+// Shared application state
+typedef struct AppContext {
+    const AppConfig* config;
     ThreadSafeQueue* task_queue;
+    ThreadSafeQueue** node_queues;  // One per node in NUMA mode, else just task_queue
+    TaskPool** node_pools;          // NULL unless NUMA mode
+    int num_nodes;
+    int num_threads;
+    int worker_nodes[MAX_THREADS];
+    ThreadSafeQueue* stage_queues[MAX_STAGES];  // Stage 0 is task_queue
+    int num_stages;                             // 0 outside pipeline mode
+    int worker_stages[MAX_THREADS];
+    struct Dag* dag;  // NULL unless --dag
+    ForkJob* fork_jobs;       // Forked jobs no thread has started, newest first
+    ProfiledMutex fork_lock;  // Guards fork_jobs
+    pthread_cond_t fork_cond; // Joiners wait here for jobs or for their group to finish
+    FutureStats* futures;               // Allocated, as the context is cleared with memset
+    ProfiledMutex request_lock;         // Guards request_latency
+    KeyMailbox* mailboxes;              // One per key, NULL when tasks are unordered
+    KeyBacklog* key_backlog;            // Allocated with the mailboxes
+    int num_keys;
+    LatencyHistogram request_latency;   // Submission to response in --requests mode
     WorkerStats* worker_stats;
+    StatsSeqlock* worker_seqlocks;
+    WorkerPerf* worker_perf;  // NULL unless --perf
     pthread_t* worker_threads;
-    pthread_mutex_t stats_lock;
-    pthread_mutex_t shutdown_lock;
+    ThreadUsage worker_usage[MAX_THREADS];
+    Producer producers[MAX_PRODUCERS];
+    int num_producers;
+    ThreadUsage monitor_usage;
+    ThreadUsage stress_usage;
+    BurstRecord* bursts;  // Written by the stress thread, read after it has been joined
+    int num_bursts;
+    ThreadUsage exporter_usage;
+    ProfiledMutex stats_lock;
+    ProfiledMutex shutdown_lock;
     pthread_cond_t shutdown_cond;
     int active_workers;
-    int total_tasks_completed;
-    int total_tasks_failed;
+    struct IntervalHistory* history;
+    FILE* metrics;  // NULL unless a metrics format was requested
+    int prometheus_fd;  // Listening socket, -1 if the exporter is disabled
+    ValiantShmStats* shm;  // Shared-memory stats segment, NULL if disabled
+    TraceLog* trace;       // NULL unless --trace
+    AsyncLogger* logger;   // Thread output goes through here while running
     struct timeval start_time;
     struct timeval end_time;
 } AppContext;
 
+// Point-in-time copy of all statistics, taken without blocking workers
+typedef struct {
+    struct timeval taken_at;
+    WorkerStats workers[MAX_THREADS];
+    long total_completed;
+    long total_failed;
+    long local_dequeues;
+    long remote_dequeues;
+    double total_processing_time;
+    LatencyHistogram latency;  // Merged across workers
+    int queue_depth;
+    int queue_capacity;
+    int mailbox_depth;  // Keyed tasks waiting in mailboxes rather than queues
+} StatsSnapshot;
+
+// Queue depth samples taken by the monitor during one interval
+typedef struct {
+    int min;
+    int max;
+    long sum;
+    int samples;
+} QueueDepthWindow;
+
+// What happened during one monitor interval
+typedef struct {
+    double elapsed;   // Seconds since start at the end of the interval
+    double duration;  // Length of the interval in seconds
+    long completed;
+    long failed;
+    double throughput;
+    double latency_p50;
+    double latency_p90;
+    double latency_p99;
+    double latency_max;
+    int queue_min;
+    double queue_avg;
+    int queue_max;
+} IntervalStats;
+
+// Ring buffer of the most recent monitor intervals
+typedef struct IntervalHistory {
+    IntervalStats* records;
+    int capacity;
+    int count;
+    int next;
+} IntervalHistory;
+
+// Headline figures of one run, as kept in a baseline file
+typedef struct {
+    double duration;    // Seconds until every task completed or the time limit hit
+    long completed;
+    long failed;
+    double throughput;  // Completed tasks per second
+    LatencyHistogram latency;
+} RunResult;
+
+// A saved configuration and the runs measured with it
+typedef struct {
+    AppConfig config;    // Only the workload fields are filled in
+    int effective_cpus;  // CPUs the recording machine could keep busy
+    int num_runs;
+    RunResult runs[BASELINE_MAX_RUNS];
+} Baseline;
+
+// Figures compared and summarised across runs
+typedef enum {
+    RUN_THROUGHPUT = 0,
+    RUN_LATENCY_P50,
+    RUN_LATENCY_P90,
+    RUN_LATENCY_P99,
+    RUN_METRIC_COUNT
+} RunMetric;
+
+// Sample tagged with the group it came from, for rank tests
+typedef struct {
+    double value;
+    int in_b;
+} RankedSample;
+
+// Calling thread's trace ring, NULL when it is not tracing
+thread_local TraceRing* trace_current = NULL;
+
+// Calling thread's log ring, NULL to print directly
+thread_local LogRing* log_current = NULL;
+
+// Where messages printed directly go, NULL for stdout; programs embedding the
+// pool send them to stderr to keep their own output clean
+FILE* log_direct_stream = NULL;
+
 // Function prototypes
+int profiled_mutex_init(ProfiledMutex* mutex, const char* name);
+void profiled_mutex_reset(ProfiledMutex* mutex);
+void profiled_mutex_destroy(ProfiledMutex* mutex);
+void profiled_mutex_lock(ProfiledMutex* mutex);
+void profiled_mutex_unlock(ProfiledMutex* mutex);
+void profiled_cond_wait(pthread_cond_t* cond, ProfiledMutex* mutex);
+int profiled_cond_timedwait(pthread_cond_t* cond, ProfiledMutex* mutex,
+                            const struct timespec* deadline);
+void print_lock_statistics(AppContext* ctx);
+AsyncLogger* logger_create(int fd);
+int logger_start(AsyncLogger* logger, int cpu);
+void logger_register(AsyncLogger* logger);
+long logger_stop(AsyncLogger* logger);
+void logger_destroy(AsyncLogger* logger);
+void* logger_thread(void* arg);
+void log_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
 ThreadSafeQueue* queue_create(int capacity);
+ThreadSafeQueue* queue_create_on_node(int capacity, int node, const cpu_set_t* node_cpus);
 void queue_destroy(ThreadSafeQueue* queue);
 int queue_enqueue(ThreadSafeQueue* queue, void* item);
 void* queue_dequeue(ThreadSafeQueue* queue);
+void* queue_try_dequeue(ThreadSafeQueue* queue);
+int queue_try_enqueue(ThreadSafeQueue* queue, void* item);
+void* queue_dequeue_timed(ThreadSafeQueue* queue, long timeout_us);
 int queue_is_empty(ThreadSafeQueue* queue);
 int queue_is_full(ThreadSafeQueue* queue);
+int queue_depth(ThreadSafeQueue* queue);
 void queue_clear(ThreadSafeQueue* queue);
+void queue_wake_all(ThreadSafeQueue* queue);
+
+void* node_alloc(size_t size, const cpu_set_t* node_cpus);
+void node_free(void* ptr, size_t size);
+TaskPool* task_pool_create(int capacity, int node, const cpu_set_t* node_cpus);
+void task_pool_destroy(TaskPool* pool);
+Task* task_alloc(AppContext* ctx, int node);
+void task_free(Task* task);
+Task* dequeue_task(AppContext* ctx, int node, int* stolen);
+int all_queues_empty(AppContext* ctx);
+int total_queue_depth(AppContext* ctx);
 
 void* worker_thread(void* arg);
 void* task_generator_thread(void* arg);
+void producer_task_range(const AppConfig* config, int producer, int* first, int* end);
+int parse_producer_spec(const char* text, ProducerSpec* spec);
+void format_producer_spec(const ProducerSpec* spec, char* buffer, size_t size);
+void print_producer_statistics(AppContext* ctx);
 void* monitor_thread(void* arg);
 void* stress_test_thread(void* arg);
+void burst_profile_default(BurstProfile* profile);
+int parse_burst_profile(const char* text, BurstProfile* profile);
+void format_burst_profile(const BurstProfile* profile, char* buffer, size_t size);
+void print_burst_statistics(AppContext* ctx);
+int dag_node_count(const DagSpec* spec);
+Dag* dag_create(const DagSpec* spec);
+void dag_reset(Dag* dag);
+void dag_destroy(Dag* dag);
+void dag_seed(AppContext* ctx);
+Task* dag_run_node(AppContext* ctx, Task* task);
+int parse_dag_spec(const char* text, DagSpec* spec);
+void format_dag_spec(const DagSpec* spec, char* buffer, size_t size);
+void print_dag_statistics(AppContext* ctx);
+void task_group_init(TaskGroup* group);
+void task_group_spawn(AppContext* ctx, TaskGroup* group, ForkJob* job);
+void task_group_wait(AppContext* ctx, TaskGroup* group);
+long parallel_for(AppContext* ctx, long begin, long end, long grain,
+                  void (*fn)(void* arg, long begin, long end), void* arg);
+int start_workers(AppContext* ctx, const CpuTopology* topology, const ThreadPlacement* placement);
+void stop_workers(AppContext* ctx);
+Future* future_submit(AppContext* ctx, FutureFn fn, void* arg);
+Future* future_then(Future* input, FutureFn fn, void* arg);
+Future* future_when_all(AppContext* ctx, Future** inputs, int count);
+int future_set(Future* future, const void* data, size_t size);
+void future_abandon(Future* future);
+int future_wait(Future* future);
+int future_ready(Future* future);
+const void* future_value(Future* future, size_t* size);
+void future_retain(Future* future);
+void future_release(Future* future);
+int request_submit(AppContext* ctx, int request_id, int priority);
+void print_future_statistics(AppContext* ctx, double total_time);
+int keyed_submit(AppContext* ctx, Task* task);
+Task* keyed_release(AppContext* ctx, Task* task);
+void key_totals(AppContext* ctx, KeyTotals* totals);
+void print_key_statistics(AppContext* ctx);
 
-void initialize_app_context(AppContext* ctx, int num_threads);
+void initialize_app_context(AppContext* ctx, int num_threads, const AppConfig* config,
+                            const CpuTopology* topo, const ThreadPlacement* placement);
+void reset_app_context(AppContext* ctx);
 void cleanup_app_context(AppContext* ctx);
 void print_statistics(AppContext* ctx);
+void stats_publish_begin(StatsSeqlock* seqlock);
+void stats_publish_end(StatsSeqlock* seqlock);
+void stats_read_worker(AppContext* ctx, int worker, WorkerStats* out);
+void stats_snapshot(AppContext* ctx, StatsSnapshot* snap);
+
+void histogram_record(LatencyHistogram* hist, double seconds);
+void histogram_merge(LatencyHistogram* dst, const LatencyHistogram* src);
+void histogram_subtract(LatencyHistogram* dst, const LatencyHistogram* prev);
+double histogram_percentile(const LatencyHistogram* hist, double percentile);
+void interval_compute(const StatsSnapshot* prev, const StatsSnapshot* curr,
+                      const QueueDepthWindow* window, double start_offset,
+                      IntervalStats* out);
+IntervalHistory* interval_history_create(int capacity);
+void interval_history_destroy(IntervalHistory* history);
+void interval_history_push(IntervalHistory* history, const IntervalStats* record);
+void interval_history_dump(const IntervalHistory* history, FILE* out);
+FILE* metrics_open(const char* target);
+void metrics_close(FILE* metrics);
+void metrics_write_header(AppContext* ctx);
+void metrics_write_record(AppContext* ctx, const char* type, const StatsSnapshot* snap,
+                          const IntervalStats* interval);
+void metrics_write_summary(AppContext* ctx);
+void run_result_capture(const StatsSnapshot* start, const StatsSnapshot* end, RunResult* out);
+int baseline_save(const char* path, const AppConfig* config, const ResourceLimits* limits,
+                  const RunResult* runs, int num_runs);
+Baseline* baseline_load(const char* path);
+void baseline_apply_config(const Baseline* baseline, AppConfig* config);
+double mann_whitney_p(const double* a, int na, const double* b, int nb);
+int baseline_compare(const Baseline* baseline, const char* path, const RunResult* runs,
+                     int num_runs, double threshold);
+double median_confidence_interval(const double* sorted, int count, double confidence,
+                                  double* low, double* high);
+void print_trial_summary(const AppConfig* config, const RunResult* runs, int num_runs);
+int prometheus_listen(const char* address);
+void prometheus_close(int fd, const char* address);
+void prometheus_format(AppContext* ctx, const StatsSnapshot* snap, FILE* out);
+void* prometheus_thread(void* arg);
+ValiantShmStats* shm_stats_create(AppContext* ctx, const char* name);
+void shm_stats_publish(AppContext* ctx, const StatsSnapshot* prev, const StatsSnapshot* curr,
+                       const IntervalStats* interval);
+void shm_stats_finish(AppContext* ctx);
+void shm_stats_destroy(ValiantShmStats* shm, const char* name);
+void perf_counters_open(WorkerPerf* perf);
+void perf_counters_read(WorkerPerf* perf, PerfSample* out);
+void perf_counters_close(WorkerPerf* perf);
+unsigned perf_snapshot(AppContext* ctx, PerfSample* samples);
+void perf_format(char* buffer, size_t size, const PerfSample* delta, long tasks, double seconds);
+double thread_cpu_time(void);
+void thread_usage_start(ThreadUsage* usage);
+void thread_usage_stop(ThreadUsage* usage);
+void print_thread_usage(AppContext* ctx, const StatsSnapshot* snap);
+TraceLog* trace_create(int sample_every);
+void trace_destroy(TraceLog* trace);
+void trace_register(AppContext* ctx, const char* name);
+void trace_record(TraceEventType type, int task_id);
+int trace_sampled(AppContext* ctx, int task_id);
+int trace_write_json(TraceLog* trace, const char* path);
 void signal_handler(int sig);
 
 double get_time_diff(struct timeval* start, struct timeval* end);
-void simulate_work(int task_id, int priority);
+double simulate_work(int task_id, int priority, int work_divisor);
+void task_discard(AppContext* ctx, Task* task);
+void stage_work(const StageSpec* stage, const Task* task, int work_divisor);
+int parse_stage_spec(const char* text, StageSpec* stage);
+void format_stage_spec(const StageSpec* stage, char* buffer, size_t size);
+void print_stage_statistics(AppContext* ctx, const StatsSnapshot* snap, double total_time);
 void generate_test_tasks(AppContext* ctx, int num_tasks);
 void run_performance_test(AppContext* ctx, int test_duration);
 
+int parse_cpu_list(const char* text, int* cpus, int max_cpus);
+void topology_discover(CpuTopology* topo);
+int topology_order(const CpuTopology* topo, AffinityPolicy policy, int* order);
+int assign_thread_placement(const CpuTopology* topo, const AppConfig* config,
+                            int num_threads, ThreadPlacement* placement);
+int create_thread_on_cpu(pthread_t* thread, int cpu, void* (*fn)(void*), void* arg);
+int create_thread_on_cpuset(pthread_t* thread, const cpu_set_t* cpus,
+                            void* (*fn)(void*), void* arg);
+void format_cpu_set(const cpu_set_t* cpus, char* buffer, size_t size);
+const char* affinity_policy_name(AffinityPolicy policy);
+int affinity_policy_parse(const char* name, AffinityPolicy* policy);
+void print_thread_placement(const CpuTopology* topo, const AppConfig* config,
+                            const ThreadPlacement* placement, int num_threads);
+void resource_limits_discover(ResourceLimits* limits);
+void apply_resource_defaults(const ResourceLimits* limits, AppConfig* config);
+void apply_valgrind_defaults(AppConfig* config);
+void print_resource_limits(const ResourceLimits* limits);
+void print_usage(const char* prog);
+void parse_arguments(int argc, char* argv[], AppConfig* config);
+int run_application(AppContext* ctx, const CpuTopology* topology,
+                    const ThreadPlacement* placement, RunResult* result);
+
+// Seconds between two monotonic timestamps
+static double timespec_diff(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+#if LOCK_PROFILING
+// Close the current hold; called with the mutex held, just before releasing it
+static void profiled_mutex_release(ProfiledMutex* mutex) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double held = timespec_diff(&mutex->acquired_at, &now);
+    if (held > mutex->max_hold_time) {
+        mutex->max_hold_time = held;
+    }
+}
+#endif
+
+// Initialize a profiled mutex; the name labels it in the final statistics
+int profiled_mutex_init(ProfiledMutex* mutex, const char* name) {
+#if LOCK_PROFILING
+    snprintf(mutex->name, sizeof(mutex->name), "%s", name);
+    mutex->acquisitions = 0;
+    mutex->contended = 0;
+    mutex->wait_time = 0.0;
+    mutex->max_hold_time = 0.0;
+#else
+    (void)name;
+#endif
+    return pthread_mutex_init(&mutex->mutex, NULL);
+}
+
+// Clear the contention counters; only while no other thread can lock it
+void profiled_mutex_reset(ProfiledMutex* mutex) {
+#if LOCK_PROFILING
+    mutex->acquisitions = 0;
+    mutex->contended = 0;
+    mutex->wait_time = 0.0;
+    mutex->max_hold_time = 0.0;
+#else
+    (void)mutex;
+#endif
+}
+
+// Destroy a profiled mutex
+void profiled_mutex_destroy(ProfiledMutex* mutex) {
+    pthread_mutex_destroy(&mutex->mutex);
+}
+
+// Lock, counting the acquisition and any time spent waiting for it
+void profiled_mutex_lock(ProfiledMutex* mutex) {
+#if LOCK_PROFILING
+    struct timespec start;
+    if (pthread_mutex_trylock(&mutex->mutex) == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &mutex->acquired_at);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_mutex_lock(&mutex->mutex);
+        clock_gettime(CLOCK_MONOTONIC, &mutex->acquired_at);
+        mutex->contended++;
+        mutex->wait_time += timespec_diff(&start, &mutex->acquired_at);
+    }
+    mutex->acquisitions++;
+#else
+    pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+
+// Unlock, recording how long the mutex was held
+void profiled_mutex_unlock(ProfiledMutex* mutex) {
+#if LOCK_PROFILING
+    profiled_mutex_release(mutex);
+#endif
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+// Wait on a condition; time asleep does not count as holding the mutex
+void profiled_cond_wait(pthread_cond_t* cond, ProfiledMutex* mutex) {
+#if LOCK_PROFILING
+    profiled_mutex_release(mutex);
+#endif
+    pthread_cond_wait(cond, &mutex->mutex);
+#if LOCK_PROFILING
+    clock_gettime(CLOCK_MONOTONIC, &mutex->acquired_at);
+#endif
+}
+
+// Timed condition wait, as profiled_cond_wait
+int profiled_cond_timedwait(pthread_cond_t* cond, ProfiledMutex* mutex,
+                            const struct timespec* deadline) {
+#if LOCK_PROFILING
+    profiled_mutex_release(mutex);
+#endif
+    int result = pthread_cond_timedwait(cond, &mutex->mutex, deadline);
+#if LOCK_PROFILING
+    clock_gettime(CLOCK_MONOTONIC, &mutex->acquired_at);
+#endif
+    return result;
+}
+
 // Create a thread-safe queue
 ThreadSafeQueue* queue_create(int capacity) {
-    ThreadSafeQueue* queue = (ThreadSafeQueue*)malloc(sizeof(ThreadSafeQueue));
+    return queue_create_on_node(capacity, -1, NULL);
+}
+
+// Release queue memory from whichever allocator provided it
+static void queue_free_storage(ThreadSafeQueue* queue) {
+    if (queue->node >= 0) {
+        node_free(queue->items, queue->capacity * sizeof(void*));
+        node_free(queue, sizeof(ThreadSafeQueue));
+    } else {
+        free(queue->items);
+        free(queue);
+    }
+}
+
+// Create a thread-safe queue, with its slots on a NUMA node when node >= 0
+ThreadSafeQueue* queue_create_on_node(int capacity, int node, const cpu_set_t* node_cpus) {
+    ThreadSafeQueue* queue;
+    if (node >= 0) {
+        queue = (ThreadSafeQueue*)node_alloc(sizeof(ThreadSafeQueue), node_cpus);
+    } else {
+        queue = (ThreadSafeQueue*)malloc(sizeof(ThreadSafeQueue));
+    }
     if (!queue) {
         perror("Failed to allocate queue");
         return NULL;
     }
 
-    queue->items = (void**)malloc(capacity * sizeof(void*));
+    if (node >= 0) {
+        queue->items = (void**)node_alloc(capacity * sizeof(void*), node_cpus);
+    } else {
+        queue->items = (void**)malloc(capacity * sizeof(void*));
+    }
     if (!queue->items) {
-        free(queue);
+        if (node >= 0) {
+            node_free(queue, sizeof(ThreadSafeQueue));
+        } else {
+            free(queue);
+        }
         perror("Failed to allocate queue items");
         return NULL;
     }
@@ -106,28 +1107,34 @@ ThreadSafeQueue* queue_create(int capacity) {
     queue->capacity = capacity;
     queue->head = 0;
     queue->tail = 0;
-    queue->count = 0;
+    queue->count.store(0, std::memory_order_relaxed);
+    queue->node = node;
+    ANNOTATE_BENIGN_RACE_SIZED(&queue->count, sizeof(queue->count),
+                               "queue depth read without the lock");
 
-    if (pthread_mutex_init(&queue->lock, NULL) != 0) {
-        free(queue->items);
-        free(queue);
+    char lock_name[24];
+    if (node >= 0) {
+        snprintf(lock_name, sizeof(lock_name), "queue[%d]", node);
+    } else {
+        snprintf(lock_name, sizeof(lock_name), "queue");
+    }
+    if (profiled_mutex_init(&queue->lock, lock_name) != 0) {
+        queue_free_storage(queue);
         perror("Failed to initialize mutex");
         return NULL;
     }
 
     if (pthread_cond_init(&queue->not_empty, NULL) != 0) {
-        pthread_mutex_destroy(&queue->lock);
-        free(queue->items);
-        free(queue);
+        profiled_mutex_destroy(&queue->lock);
+        queue_free_storage(queue);
         perror("Failed to initialize not_empty condition");
         return NULL;
     }
 
     if (pthread_cond_init(&queue->not_full, NULL) != 0) {
         pthread_cond_destroy(&queue->not_empty);
-        pthread_mutex_destroy(&queue->lock);
-        free(queue->items);
-        free(queue);
+        profiled_mutex_destroy(&queue->lock);
+        queue_free_storage(queue);
         perror("Failed to initialize not_full condition");
         return NULL;
     }
@@ -138,37 +1145,35 @@ ThreadSafeQueue* queue_create(int capacity) {
 // Destroy the queue and free resources
 void queue_destroy(ThreadSafeQueue* queue) {
     if (queue) {
-        pthread_mutex_lock(&queue->lock);
-        free(queue->items);
-        pthread_mutex_unlock(&queue->lock);
-        
         pthread_cond_destroy(&queue->not_empty);
         pthread_cond_destroy(&queue->not_full);
-        pthread_mutex_destroy(&queue->lock);
-        free(queue);
+        profiled_mutex_destroy(&queue->lock);
+        queue_free_storage(queue);
     }
 }
 
 // Enqueue an item (blocking if queue is full)
 int queue_enqueue(ThreadSafeQueue* queue, void* item) {
-    pthread_mutex_lock(&queue->lock);
+    profiled_mutex_lock(&queue->lock);
     
     // Wait until queue is not full
     while (queue_is_full(queue)) {
-        pthread_cond_wait(&queue->not_full, &queue->lock);
+        trace_record(TRACE_WAIT_NOT_FULL_BEGIN, -1);
+        profiled_cond_wait(&queue->not_full, &queue->lock);
+        trace_record(TRACE_WAIT_NOT_FULL_END, -1);
         if (shutdown_requested) {
-            pthread_mutex_unlock(&queue->lock);
+            profiled_mutex_unlock(&queue->lock);
             return -1;
         }
     }
 
     queue->items[queue->tail] = item;
     queue->tail = (queue->tail + 1) % queue->capacity;
-    queue->count++;
+    queue->count.fetch_add(1, std::memory_order_relaxed);
 
     // Signal that queue is not empty
     pthread_cond_signal(&queue->not_empty);
-    pthread_mutex_unlock(&queue->lock);
+    profiled_mutex_unlock(&queue->lock);
     
     return 0;
 }
@@ -177,37 +1182,116 @@ int queue_enqueue(ThreadSafeQueue* queue, void* item) {
 void* queue_dequeue(ThreadSafeQueue* queue) {
     void* item = NULL;
     
-    pthread_mutex_lock(&queue->lock);
+    profiled_mutex_lock(&queue->lock);
     
     // Wait until queue is not empty
     while (queue_is_empty(queue)) {
         if (shutdown_requested) {
-            pthread_mutex_unlock(&queue->lock);
+            profiled_mutex_unlock(&queue->lock);
             return NULL;
         }
-        pthread_cond_wait(&queue->not_empty, &queue->lock);
+        trace_record(TRACE_WAIT_NOT_EMPTY_BEGIN, -1);
+        profiled_cond_wait(&queue->not_empty, &queue->lock);
+        trace_record(TRACE_WAIT_NOT_EMPTY_END, -1);
     }
 
     item = queue->items[queue->head];
     queue->items[queue->head] = NULL;  // Clear the reference
     queue->head = (queue->head + 1) % queue->capacity;
-    queue->count--;
+    queue->count.fetch_sub(1, std::memory_order_relaxed);
 
     // Signal that queue is not full
     pthread_cond_signal(&queue->not_full);
-    pthread_mutex_unlock(&queue->lock);
+    profiled_mutex_unlock(&queue->lock);
     
     return item;
 }
 
+// Dequeue an item without blocking, NULL if the queue is empty
+void* queue_try_dequeue(ThreadSafeQueue* queue) {
+    void* item = NULL;
+
+    profiled_mutex_lock(&queue->lock);
+
+    if (!queue_is_empty(queue)) {
+        item = queue->items[queue->head];
+        queue->items[queue->head] = NULL;
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count.fetch_sub(1, std::memory_order_relaxed);
+        pthread_cond_signal(&queue->not_full);
+    }
+
+    profiled_mutex_unlock(&queue->lock);
+    return item;
+}
+
+// Enqueue an item without blocking; -1 if the queue is full
+int queue_try_enqueue(ThreadSafeQueue* queue, void* item) {
+    int result = -1;
+
+    profiled_mutex_lock(&queue->lock);
+
+    if (!queue_is_full(queue)) {
+        queue->items[queue->tail] = item;
+        queue->tail = (queue->tail + 1) % queue->capacity;
+        queue->count.fetch_add(1, std::memory_order_relaxed);
+        pthread_cond_signal(&queue->not_empty);
+        result = 0;
+    }
+
+    profiled_mutex_unlock(&queue->lock);
+    return result;
+}
+
+// Dequeue an item, waiting at most timeout_us for one to arrive
+void* queue_dequeue_timed(ThreadSafeQueue* queue, long timeout_us) {
+    void* item = NULL;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_us / 1000000;
+    deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    profiled_mutex_lock(&queue->lock);
+
+    while (queue_is_empty(queue) && !shutdown_requested) {
+        trace_record(TRACE_WAIT_NOT_EMPTY_BEGIN, -1);
+        int result = profiled_cond_timedwait(&queue->not_empty, &queue->lock, &deadline);
+        trace_record(TRACE_WAIT_NOT_EMPTY_END, -1);
+        if (result == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if (!queue_is_empty(queue)) {
+        item = queue->items[queue->head];
+        queue->items[queue->head] = NULL;
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count.fetch_sub(1, std::memory_order_relaxed);
+        pthread_cond_signal(&queue->not_full);
+    }
+
+    profiled_mutex_unlock(&queue->lock);
+    return item;
+}
+
 // Check if queue is empty
 int queue_is_empty(ThreadSafeQueue* queue) {
-    return queue->count == 0;
+    return queue->count.load(std::memory_order_relaxed) == 0;
 }
 
 // Check if queue is full
 int queue_is_full(ThreadSafeQueue* queue) {
-    return queue->count == queue->capacity;
+    return queue->count.load(std::memory_order_relaxed) == queue->capacity;
+}
+
+// Number of queued items; safe to call without the lock, may be momentarily stale
+int queue_depth(ThreadSafeQueue* queue) {
+    return queue->count.load(std::memory_order_relaxed);
 }
 
 // Clear the queue (not thread-safe, should be called with lock held)
@@ -217,19 +1301,228 @@ void queue_clear(ThreadSafeQueue* queue) {
     }
 }
 
+// Wake every thread blocked on the queue so it can observe shutdown
+void queue_wake_all(ThreadSafeQueue* queue) {
+    profiled_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    profiled_mutex_unlock(&queue->lock);
+}
+
+// Allocate zeroed memory first-touched from the CPUs of a NUMA node
+void* node_alloc(size_t size, const cpu_set_t* node_cpus) {
+    cpu_set_t saved;
+    pthread_t self = pthread_self();
+
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    // The kernel places anonymous pages on the node of the touching CPU
+    if (pthread_getaffinity_np(self, sizeof(saved), &saved) == 0 &&
+        pthread_setaffinity_np(self, sizeof(cpu_set_t), node_cpus) == 0) {
+        memset(ptr, 0, size);
+        pthread_setaffinity_np(self, sizeof(saved), &saved);
+    } else {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+// Free memory obtained from node_alloc
+void node_free(void* ptr, size_t size) {
+    if (ptr) {
+        munmap(ptr, size);
+    }
+}
+
+// Create a pool of tasks whose memory lives on the given node
+TaskPool* task_pool_create(int capacity, int node, const cpu_set_t* node_cpus) {
+    TaskPool* pool = (TaskPool*)node_alloc(sizeof(TaskPool), node_cpus);
+    if (!pool) {
+        perror("Failed to allocate task pool");
+        return NULL;
+    }
+
+    pool->tasks = (Task*)node_alloc(capacity * sizeof(Task), node_cpus);
+    pool->free_list = (Task**)node_alloc(capacity * sizeof(Task*), node_cpus);
+    if (!pool->tasks || !pool->free_list) {
+        node_free(pool->tasks, capacity * sizeof(Task));
+        node_free(pool->free_list, capacity * sizeof(Task*));
+        node_free(pool, sizeof(TaskPool));
+        perror("Failed to allocate pooled tasks");
+        return NULL;
+    }
+
+    char lock_name[24];
+    snprintf(lock_name, sizeof(lock_name), "pool[%d]", node);
+    if (profiled_mutex_init(&pool->lock, lock_name) != 0) {
+        node_free(pool->tasks, capacity * sizeof(Task));
+        node_free(pool->free_list, capacity * sizeof(Task*));
+        node_free(pool, sizeof(TaskPool));
+        perror("Failed to initialize task pool mutex");
+        return NULL;
+    }
+
+    pool->capacity = capacity;
+    pool->node = node;
+    for (int i = 0; i < capacity; i++) {
+        pool->tasks[i].pool = pool;
+        pool->free_list[i] = &pool->tasks[i];
+    }
+    pool->free_count = capacity;
+
+    return pool;
+}
+
+// Destroy a task pool; tasks still in flight become invalid
+void task_pool_destroy(TaskPool* pool) {
+    if (pool) {
+        profiled_mutex_destroy(&pool->lock);
+        node_free(pool->tasks, pool->capacity * sizeof(Task));
+        node_free(pool->free_list, pool->capacity * sizeof(Task*));
+        node_free(pool, sizeof(TaskPool));
+    }
+}
+
+// Allocate a task, from the node's pool when one exists
+Task* task_alloc(AppContext* ctx, int node) {
+    if (ctx->node_pools) {
+        TaskPool* pool = ctx->node_pools[node];
+        Task* task = NULL;
+
+        profiled_mutex_lock(&pool->lock);
+        if (pool->free_count > 0) {
+            task = pool->free_list[--pool->free_count];
+        }
+        profiled_mutex_unlock(&pool->lock);
+
+        if (task) {
+            task->run = NULL;
+            task->discard = NULL;
+            task->internal = 0;
+            task->key = -1;
+            return task;
+        }
+    }
+
+    // Heap fallback when the pool is exhausted or NUMA mode is off
+    Task* task = (Task*)malloc(sizeof(Task));
+    if (task) {
+        task->pool = NULL;
+        task->run = NULL;
+        task->discard = NULL;
+        task->internal = 0;
+        task->key = -1;
+    }
+    return task;
+}
+
+// Return a task to its pool, or to the heap
+void task_free(Task* task) {
+    if (!task) {
+        return;
+    }
+
+    TaskPool* pool = task->pool;
+    if (!pool) {
+        free(task);
+        return;
+    }
+
+    profiled_mutex_lock(&pool->lock);
+    pool->free_list[pool->free_count++] = task;
+    profiled_mutex_unlock(&pool->lock);
+}
+
+// Drop a task without running it, letting its owner release what it holds
+void task_discard(AppContext* ctx, Task* task) {
+    if (task && task->discard) {
+        task->discard(ctx, task);
+    }
+    task_free(task);
+}
+
+// Take the next task for a worker on the given node, stealing from other
+// nodes only when the local queue is empty
+Task* dequeue_task(AppContext* ctx, int node, int* stolen) {
+    *stolen = 0;
+
+    if (ctx->num_nodes == 1) {
+        return (Task*)queue_dequeue(ctx->task_queue);
+    }
+
+    ThreadSafeQueue* local = ctx->node_queues[node];
+    while (!shutdown_requested) {
+        Task* task = (Task*)queue_try_dequeue(local);
+        if (task) {
+            return task;
+        }
+
+        for (int i = 1; i < ctx->num_nodes; i++) {
+            ThreadSafeQueue* remote = ctx->node_queues[(node + i) % ctx->num_nodes];
+            task = (Task*)queue_try_dequeue(remote);
+            if (task) {
+                *stolen = 1;
+                return task;
+            }
+        }
+
+        // Nothing anywhere; wait on the local queue, but not indefinitely
+        task = (Task*)queue_dequeue_timed(local, NUMA_STEAL_WAIT_US);
+        if (task) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+// Check whether every task queue is empty
+int all_queues_empty(AppContext* ctx) {
+    for (int i = 0; i < ctx->num_nodes; i++) {
+        if (!queue_is_empty(ctx->node_queues[i])) {
+            return 0;
+        }
+    }
+    for (int s = 1; s < ctx->num_stages; s++) {
+        if (!queue_is_empty(ctx->stage_queues[s])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Sum of queued tasks across all queues
+int total_queue_depth(AppContext* ctx) {
+    int depth = 0;
+    for (int i = 0; i < ctx->num_nodes; i++) {
+        depth += queue_depth(ctx->node_queues[i]);
+    }
+    for (int s = 1; s < ctx->num_stages; s++) {
+        depth += queue_depth(ctx->stage_queues[s]);
+    }
+    return depth;
+}
+
 // Get time difference in seconds
 double get_time_diff(struct timeval* start, struct timeval* end) {
     return (end->tv_sec - start->tv_sec) + 
            (end->tv_usec - start->tv_usec) / 1000000.0;
 }
 
-// Simulate work with variable processing time based on priority
-void simulate_work(int task_id, int priority) {
+// Simulate work with variable processing time based on priority; returns
+// what the work computed
+double simulate_work(int task_id, int priority, int work_divisor) {
     // Higher priority = less work time
     double work_time = (10 - priority) * 0.001;  // 0.001 to 0.009 seconds
     
     // Add some random variation
     work_time += (rand() % 1000) / 1000000.0;
+    work_time /= work_divisor;
     
     // Simulate CPU-bound work
     volatile double result = 0.0;
@@ -242,53 +1535,162 @@ void simulate_work(int task_id, int priority) {
     if (task_id % 100 == 0) {
         usleep(1000);  // 1ms sleep
     }
+    return result;
 }
 
-// Worker thread function
-void* worker_thread(void* arg) {
-    AppContext* ctx = (AppContext*)arg;
-    int thread_id = -1;
+// Do one pipeline stage's work on a task
+void stage_work(const StageSpec* stage, const Task* task, int work_divisor) {
+    double seconds = stage->work_us / 1e6 / work_divisor;
     
-    // Find thread ID
-    pthread_mutex_lock(&ctx->stats_lock);
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (pthread_equal(ctx->worker_threads[i], pthread_self())) {
+    switch (stage->work) {
+        case WORK_CPU: {
+            // Spin on thread CPU time so preemption does not shorten the work
+            double until = thread_cpu_time() + seconds;
+            volatile double result = 0.0;
+            do {
+                for (int i = 0; i < 256; i++) {
+                    result += sin(i * 0.1) * cos(i * 0.2);
+                }
+            } while (thread_cpu_time() < until);
+            break;
+        }
+        case WORK_IO:
+            usleep((useconds_t)(seconds * 1e6));
+            break;
+        default:
+            simulate_work(task->task_id, task->priority, work_divisor);
+            break;
+    }
+}
+
+// Worker thread function
+void* worker_thread(void* arg) {
+    AppContext* ctx = (AppContext*)arg;
+    int thread_id = -1;
+    
+    // Find thread ID
+    profiled_mutex_lock(&ctx->stats_lock);
+    for (int i = 0; i < ctx->num_threads; i++) {
+        if (pthread_equal(ctx->worker_threads[i], pthread_self())) {
             thread_id = i;
             break;
         }
     }
-    pthread_mutex_unlock(&ctx->stats_lock);
+    profiled_mutex_unlock(&ctx->stats_lock);
     
     if (thread_id == -1) {
         fprintf(stderr, "Worker thread could not find its ID\n");
         return NULL;
     }
     
-    printf("Worker thread %d started\n", thread_id);
+    int node = ctx->worker_nodes[thread_id];
+    int stage = ctx->worker_stages[thread_id];
+    const StageSpec* spec = ctx->num_stages > 0 ? &ctx->config->stages[stage] : NULL;
+    ThreadSafeQueue* downstream = stage + 1 < ctx->num_stages ? ctx->stage_queues[stage + 1] : NULL;
+    thread_usage_start(&ctx->worker_usage[thread_id]);
+    if (ctx->logger) {
+        logger_register(ctx->logger);
+    }
+    if (ctx->trace) {
+        char name[24];
+        snprintf(name, sizeof(name), "worker %d", thread_id);
+        trace_register(ctx, name);
+    }
+    log_printf("Worker thread %d started\n", thread_id);
+    
+    // Counters follow the calling thread, so the worker opens its own
+    if (ctx->worker_perf) {
+        perf_counters_open(&ctx->worker_perf[thread_id]);
+    }
     
+    Task* next = NULL;  // Released by the previous task, run without queueing
+    long tasks_run = 0;
     while (!shutdown_requested) {
-        Task* task = (Task*)queue_dequeue(ctx->task_queue);
+        int stolen = 0;
+        int inlined = next != NULL;
+        Task* task = next;
+        next = NULL;
+        if (!task) {
+            task = stage > 0 ? (Task*)queue_dequeue(ctx->stage_queues[stage])
+                             : dequeue_task(ctx, node, &stolen);
+        }
         if (!task) {
             if (shutdown_requested) break;
             continue;
         }
         
+        // Internal tasks share one placeholder ID, so sampling them would trace every one
+        int traced = !task->internal && trace_sampled(ctx, task->task_id);
+        if (traced) {
+            trace_record(TRACE_DEQUEUE, task->task_id);
+            trace_record(TRACE_WORK_BEGIN, task->task_id);
+        }
+        
         struct timeval task_start, task_end;
         gettimeofday(&task_start, NULL);
+        double cpu_start = thread_cpu_time();
         
         // Simulate doing work
-        simulate_work(task->task_id, task->priority);
+        if (task->run) {
+            next = task->run(ctx, task);
+        } else if (spec) {
+            stage_work(spec, task, ctx->config->work_divisor);
+        } else {
+            simulate_work(task->task_id, task->priority, ctx->config->work_divisor);
+        }
         
+        double cpu_time = thread_cpu_time() - cpu_start;
         gettimeofday(&task_end, NULL);
+        if (traced) {
+            trace_record(TRACE_WORK_END, task->task_id);
+        }
         
         double processing_time = get_time_diff(&task_start, &task_end);
         
-        // Update statistics
-        pthread_mutex_lock(&ctx->stats_lock);
+        // Pass the key on. The worker runs only one successor itself, so when
+        // the run hook also returned one, the key's successor is queued,
+        // waiting for room as dag_run_node does for its extra successors
+        if (task->key >= 0) {
+            Task* successor = keyed_release(ctx, task);
+            if (successor && !next) {
+                next = successor;
+            } else if (successor && queue_try_enqueue(ctx->task_queue, successor) != 0 &&
+                       queue_enqueue(ctx->task_queue, successor) != 0) {
+                task_discard(ctx, successor);
+            }
+        }
+        
+        // Hand the task on; a full queue downstream blocks this stage, which
+        // in turn fills its own queue and so pushes back on the producers
+        double blocked = 0.0;
+        int forwarded = 0;
+        if (downstream) {
+            struct timespec wait_start, wait_end;
+            clock_gettime(CLOCK_MONOTONIC, &wait_start);
+            forwarded = queue_enqueue(downstream, task) == 0;
+            clock_gettime(CLOCK_MONOTONIC, &wait_end);
+            blocked = timespec_diff(&wait_start, &wait_end);
+        }
+        
+        // Publish statistics; readers never block this update
+        StatsSeqlock* seqlock = &ctx->worker_seqlocks[thread_id];
+        stats_publish_begin(seqlock);
         
         WorkerStats* stats = &ctx->worker_stats[thread_id];
-        stats->tasks_completed++;
+        if (downstream) {
+            stats->tasks_forwarded += forwarded;
+            stats->downstream_blocked += blocked;
+        } else if (!task->internal) {
+            stats->tasks_completed++;
+            histogram_record(&stats->latency, get_time_diff(&task->start_time, &task_end));
+        }
         stats->total_processing_time += processing_time;
+        stats->busy_cpu_time += cpu_time;
+        if (stolen) {
+            stats->remote_dequeues++;
+        } else if (!inlined) {
+            stats->local_dequeues++;
+        }
         
         if (processing_time > stats->max_processing_time) {
             stats->max_processing_time = processing_time;
@@ -297,359 +1699,5778 @@ void* worker_thread(void* arg) {
             stats->min_processing_time = processing_time;
         }
         
-        ctx->total_tasks_completed++;
-        
-        pthread_mutex_unlock(&ctx->stats_lock);
+        stats_publish_end(seqlock);
         
-        // Free the task
-        free(task);
+        // The last stage owns the task now; earlier ones only if shutdown stopped the hand-off
+        if (!forwarded) {
+            task_free(task);
+        }
         
-        // Occasionally yield to prevent thread starvation
-        if (ctx->total_tasks_completed % 1000 == 0) {
+        // Occasionally yield to prevent thread starvation; internal tasks count
+        // here even though they are not completed tasks
+        if (++tasks_run % 1000 == 0) {
             sched_yield();
         }
     }
     
-    printf("Worker thread %d shutting down\n", thread_id);
+    task_discard(ctx, next);
+    thread_usage_stop(&ctx->worker_usage[thread_id]);
+    log_printf("Worker thread %d shutting down\n", thread_id);
     return NULL;
 }
 
-// Task generator thread
+// Task producer thread; arg is its Producer
 void* task_generator_thread(void* arg) {
-    AppContext* ctx = (AppContext*)arg;
-    int task_id = 0;
+    Producer* producer = (Producer*)arg;
+    AppContext* ctx = producer->ctx;
+    const ProducerSpec* spec = &producer->spec;
+    int priorities = spec->max_priority - spec->min_priority + 1;
+    int task_id = producer->first_task_id;
+    long generated = 0;
     
-    printf("Task generator started\n");
+    // rand() takes a process-wide lock, which would add contention of its own
+    unsigned seed = (unsigned)time(NULL) ^ (unsigned)(producer->index * 2654435761u);
     
-    while (!shutdown_requested && task_id < DEFAULT_NUM_TASKS) {
-        // Create a new task
-        Task* task = (Task*)malloc(sizeof(Task));
-        if (!task) {
-            perror("Failed to allocate task");
-            break;
-        }
-        
-        task->task_id = task_id;
-        // Random priority between 1 and 10
-        task->priority = (rand() % 10) + 1;
-        gettimeofday(&task->start_time, NULL);
+    thread_usage_start(&producer->usage);
+    if (ctx->logger) {
+        logger_register(ctx->logger);
+    }
+    if (ctx->trace) {
+        char name[24];
+        snprintf(name, sizeof(name), "producer %d", producer->index);
+        trace_register(ctx, name);
+    }
+    log_printf("Producer %d started: tasks %d-%d\n", producer->index,
+               producer->first_task_id, producer->end_task_id - 1);
+    
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    
+    while (!shutdown_requested && task_id < producer->end_task_id) {
+        int priority = spec->min_priority + (int)(rand_r(&seed) % priorities);
+        struct timespec before, after;
         
-        // Enqueue the task
-        if (queue_enqueue(ctx->task_queue, task) == -1) {
-            free(task);
-            break;
+        if (ctx->config->request_fanout > 0) {
+            // Submitting a request enqueues its parts, so it is timed the same way
+            clock_gettime(CLOCK_MONOTONIC, &before);
+            int result = request_submit(ctx, task_id, priority);
+            clock_gettime(CLOCK_MONOTONIC, &after);
+            if (result == -1) {
+                break;
+            }
+        } else {
+            // Create a new task, spreading tasks across nodes in NUMA mode
+            int node = task_id % ctx->num_nodes;
+            Task* task = task_alloc(ctx, node);
+            if (!task) {
+                perror("Failed to allocate task");
+                break;
+            }
+            
+            task->task_id = task_id;
+            task->priority = priority;
+            if (ctx->num_keys > 0) {
+                task->key = (int)(rand_r(&seed) % ctx->num_keys);
+            }
+            gettimeofday(&task->start_time, NULL);
+            if (trace_sampled(ctx, task_id)) {
+                trace_record(TRACE_ENQUEUE, task_id);
+            }
+            
+            // Time spent in the enqueue is lock contention plus waiting for room
+            clock_gettime(CLOCK_MONOTONIC, &before);
+            int result = task->key >= 0 ? keyed_submit(ctx, task)
+                                        : queue_enqueue(ctx->node_queues[node], task);
+            clock_gettime(CLOCK_MONOTONIC, &after);
+            if (result == -1) {
+                task_free(task);
+                break;
+            }
         }
         
+        double blocked = timespec_diff(&before, &after);
+        producer->blocked_time += blocked;
+        if (blocked > producer->max_blocked) {
+            producer->max_blocked = blocked;
+        }
+        producer->enqueued++;
         task_id++;
+        generated++;
         
-        // Throttle task generation to prevent overwhelming the queue
-        if (task_id % 100 == 0) {
+        if (spec->rate > 0) {
+            // Absolute schedule, so time lost in a blocked enqueue is made up
+            double due = generated / spec->rate;
+            struct timespec deadline = started;
+            deadline.tv_sec += (time_t)due;
+            deadline.tv_nsec += (long)((due - (time_t)due) * 1e9);
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        } else if (generated % 100 == 0) {
+            // Throttle task generation to prevent overwhelming the queue
             usleep(1000);  // 1ms delay every 100 tasks
         }
     }
     
-    printf("Task generator completed. Generated %d tasks\n", task_id);
+    log_printf("Producer %d completed. Generated %ld tasks\n", producer->index, generated);
+    thread_usage_stop(&producer->usage);
     return NULL;
 }
 
+// Split the task IDs evenly between producers so every ID is unique
+void producer_task_range(const AppConfig* config, int producer, int* first, int* end) {
+    long num_tasks = config->num_tasks;
+    *first = (int)(num_tasks * producer / config->num_producers);
+    *end = (int)(num_tasks * (producer + 1) / config->num_producers);
+}
+
 // Monitor thread for real-time statistics
 void* monitor_thread(void* arg) {
     AppContext* ctx = (AppContext*)arg;
     int interval = 1;  // seconds
+    useconds_t sample_period = interval * 1000000 / MONITOR_SAMPLES_PER_INTERVAL;
+    
+    thread_usage_start(&ctx->monitor_usage);
+    if (ctx->logger) {
+        logger_register(ctx->logger);
+    }
+    
+    // Snapshots are large; keep them off the stack
+    StatsSnapshot* prev = (StatsSnapshot*)malloc(sizeof(StatsSnapshot));
+    StatsSnapshot* curr = (StatsSnapshot*)malloc(sizeof(StatsSnapshot));
+    if (!prev || !curr) {
+        perror("Failed to allocate monitor snapshots");
+        free(prev);
+        free(curr);
+        return NULL;
+    }
+    
+    PerfSample prev_perf[MAX_THREADS];
+    PerfSample curr_perf[MAX_THREADS];
     
-    printf("Monitor thread started\n");
+    log_printf("Monitor thread started\n");
+    stats_snapshot(ctx, prev);
+    if (ctx->worker_perf) {
+        perf_snapshot(ctx, prev_perf);
+    }
     
     while (!shutdown_requested) {
-        sleep(interval);
-        
-        pthread_mutex_lock(&ctx->stats_lock);
+        QueueDepthWindow window = {INT32_MAX, 0, 0, 0};
+        for (int i = 0; i < MONITOR_SAMPLES_PER_INTERVAL && !shutdown_requested; i++) {
+            usleep(sample_period);
+            int depth = total_queue_depth(ctx);
+            if (depth < window.min) window.min = depth;
+            if (depth > window.max) window.max = depth;
+            window.sum += depth;
+            window.samples++;
+        }
         
-        long total_completed = 0;
-        long total_failed = 0;
-        double total_time = 0.0;
+        // Copy everything out first, then format without holding anything
+        stats_snapshot(ctx, curr);
+        StatsSnapshot* snap = curr;
         
-        for (int i = 0; i < DEFAULT_NUM_THREADS; i++) {
-            total_completed += ctx->worker_stats[i].tasks_completed;
-            total_failed += ctx->worker_stats[i].tasks_failed;
-            total_time += ctx->worker_stats[i].total_processing_time;
+        double elapsed = get_time_diff(&ctx->start_time, &snap->taken_at);
+        IntervalStats current;
+        interval_compute(prev, curr, &window, get_time_diff(&ctx->start_time, &prev->taken_at),
+                         &current);
+        if (ctx->history) {
+            interval_history_push(ctx->history, &current);
+        }
+        if (ctx->metrics) {
+            metrics_write_record(ctx, "interval", snap, &current);
+        }
+        if (ctx->shm) {
+            shm_stats_publish(ctx, prev, curr, &current);
         }
-        
-        struct timeval current_time;
-        gettimeofday(&current_time, NULL);
-        double elapsed = get_time_diff(&ctx->start_time, &current_time);
         
         if (elapsed > 0) {
-            double throughput = total_completed / elapsed;
-            double avg_time = total_completed > 0 ? total_time / total_completed : 0.0;
+            double throughput = snap->total_completed / elapsed;
+            double avg_time = snap->total_completed > 0 ?
+                              snap->total_processing_time / snap->total_completed : 0.0;
             
-            printf("\n=== Monitor Report (Elapsed: %.2f seconds) ===\n", elapsed);
-            printf("Total Tasks Completed: %ld\n", total_completed);
-            printf("Total Tasks Failed: %ld\n", total_failed);
-            printf("Throughput: %.2f tasks/second\n", throughput);
-            printf("Average Processing Time: %.6f seconds\n", avg_time);
-            printf("Queue Size: %d/%d\n", ctx->task_queue->count, ctx->task_queue->capacity);
-            printf("Active Workers: %d\n", ctx->active_workers);
-            printf("========================================\n\n");
+            log_printf("\n=== Monitor Report (Elapsed: %.2f seconds) ===\n", elapsed);
+            log_printf("Interval: %.2f s, %ld tasks, %.2f tasks/second\n",
+                   current.duration, current.completed, current.throughput);
+            log_printf("Interval Latency p50/p90/p99/max: %.6f/%.6f/%.6f/%.6f seconds\n",
+                   current.latency_p50, current.latency_p90, current.latency_p99,
+                   current.latency_max);
+            log_printf("Interval Queue Depth min/avg/max: %d/%.1f/%d\n",
+                   current.queue_min, current.queue_avg, current.queue_max);
+            log_printf("Total Tasks Completed: %ld\n", snap->total_completed);
+            log_printf("Total Tasks Failed: %ld\n", snap->total_failed);
+            log_printf("Throughput: %.2f tasks/second\n", throughput);
+            log_printf("Average Processing Time: %.6f seconds\n", avg_time);
+            log_printf("Latency p50/p90/p99: %.6f/%.6f/%.6f seconds\n",
+                   histogram_percentile(&snap->latency, 50.0),
+                   histogram_percentile(&snap->latency, 90.0),
+                   histogram_percentile(&snap->latency, 99.0));
+            log_printf("Queue Size: %d/%d\n", snap->queue_depth, snap->queue_capacity);
+            if (ctx->key_backlog) {
+                log_printf("Waiting in Key Mailboxes: %d/%d\n", snap->mailbox_depth,
+                           ctx->task_queue->capacity);
+            }
+            if (ctx->num_nodes > 1) {
+                log_printf("Local/Remote Dequeues: %ld/%ld\n",
+                       snap->local_dequeues, snap->remote_dequeues);
+            }
+            log_printf("Active Workers: %d\n", ctx->active_workers);
+            if (ctx->worker_perf) {
+                PerfSample delta;
+                char line[256];
+                memset(&delta, 0, sizeof(delta));
+                delta.available = perf_snapshot(ctx, curr_perf);
+                for (int i = 0; i < ctx->num_threads; i++) {
+                    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+                        delta.values[c] += curr_perf[i].values[c] - prev_perf[i].values[c];
+                    }
+                }
+                memcpy(prev_perf, curr_perf, sizeof(prev_perf));
+                perf_format(line, sizeof(line), &delta, current.completed, current.duration);
+                log_printf("Interval Counters: %s\n", line);
+            }
+            log_printf("========================================\n\n");
         }
         
-        pthread_mutex_unlock(&ctx->stats_lock);
+        // The current snapshot becomes the next interval's baseline
+        StatsSnapshot* swap = prev;
+        prev = curr;
+        curr = swap;
         
-        if (total_completed >= DEFAULT_NUM_TASKS) {
-            printf("All tasks completed. Monitor shutting down.\n");
+        if (snap->total_completed >= ctx->config->num_tasks) {
+            log_printf("All tasks completed. Monitor shutting down.\n");
             break;
         }
     }
     
+    free(prev);
+    free(curr);
+    thread_usage_stop(&ctx->monitor_usage);
     return NULL;
 }
 
-// Stress test thread that creates additional load
+// Seconds since the run started
+static double run_elapsed(AppContext* ctx) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return get_time_diff(&ctx->start_time, &now);
+}
+
+// Fraction of a burst's tasks due once it is progress (0-1) of the way through
+static double burst_fraction(BurstShape shape, double progress) {
+    if (progress >= 1.0 || shape == BURST_SPIKE) {
+        return 1.0;
+    }
+    switch (shape) {
+        case BURST_RAMP: return progress * progress;
+        case BURST_SINE: return (1.0 - cos(M_PI * progress)) / 2.0;
+        default:         return progress;
+    }
+}
+
+// Sample queue depth and windowed latency until the next reference window
+// is due, recording when each settled back within slack of the reference
+static void burst_measure_recovery(AppContext* ctx, BurstRecord* record, StatsSnapshot* prev,
+                                   StatsSnapshot* curr, double deadline) {
+    double ended = run_elapsed(ctx);
+    double depth_limit = record->reference_depth * (1.0 + BURST_DEPTH_SLACK) +
+                         BURST_DEPTH_MIN_SLACK;
+    double latency_limit = record->reference_p99 * (1.0 + BURST_LATENCY_SLACK);
+    double depth_settled = ended;
+    double latency_settled = ended;
+    int depth_ok = 0;
+    int latency_ok = 0;
+
+    stats_snapshot(ctx, prev);
+    while (!shutdown_requested && run_elapsed(ctx) + BURST_TICK_US / 1e6 < deadline) {
+        usleep(BURST_TICK_US);
+        double now = run_elapsed(ctx);
+        int depth = total_queue_depth(ctx);
+        stats_snapshot(ctx, curr);
+
+        LatencyHistogram window = curr->latency;
+        histogram_subtract(&window, &prev->latency);
+        double p99 = histogram_percentile(&window, 99.0);
+        if (depth > record->peak_depth) {
+            record->peak_depth = depth;
+        }
+        if (p99 > record->peak_p99) {
+            record->peak_p99 = p99;
+        }
+
+        depth_ok = depth <= depth_limit;
+        if (!depth_ok) {
+            depth_settled = now;
+        }
+        // A window without completions counts once the queue has drained
+        latency_ok = window.count > 0 ? p99 <= latency_limit : depth_ok;
+        if (!latency_ok) {
+            latency_settled = now;
+        }
+
+        StatsSnapshot* swap = prev;
+        prev = curr;
+        curr = swap;
+    }
+
+    record->depth_recovery = depth_ok ? depth_settled - ended : -1.0;
+    record->latency_recovery = latency_ok ? latency_settled - ended : -1.0;
+}
+
+// Stress thread: adds bursts of load following the configured profile and
+// measures how long queue depth and latency take to recover from each
 void* stress_test_thread(void* arg) {
     AppContext* ctx = (AppContext*)arg;
-    int stress_level = 5;  // Number of additional tasks to enqueue rapidly
+    const BurstProfile* burst = &ctx->config->burst;
+    int next_id = ctx->config->num_tasks;  // Producers use the IDs below this
+    int priorities = burst->max_priority - burst->min_priority + 1;
+    unsigned seed = (unsigned)time(NULL) ^ 0x5bd1e995u;
+    char profile[96];
     
-    printf("Stress test thread started\n");
+    thread_usage_start(&ctx->stress_usage);
+    if (ctx->logger) {
+        logger_register(ctx->logger);
+    }
+    if (ctx->trace) {
+        trace_register(ctx, "stress");
+    }
+    format_burst_profile(burst, profile, sizeof(profile));
+    log_printf("Stress test thread started: %s\n", profile);
     
-    while (!shutdown_requested) {
-        sleep(5);  // Run stress test every 5 seconds
+    // Snapshots are large; keep them off the stack
+    StatsSnapshot* reference = (StatsSnapshot*)malloc(sizeof(StatsSnapshot));
+    StatsSnapshot* prev = (StatsSnapshot*)malloc(sizeof(StatsSnapshot));
+    StatsSnapshot* curr = (StatsSnapshot*)malloc(sizeof(StatsSnapshot));
+    if (!reference || !prev || !curr) {
+        perror("Failed to allocate stress snapshots");  // Run continues without bursts
+    }
+    
+    // The reference window takes at most half of the gap between bursts
+    double reference_window = (burst->period_ms - burst->duration_ms) / 2000.0;
+    if (reference_window > BURST_REFERENCE_MS / 1000.0) {
+        reference_window = BURST_REFERENCE_MS / 1000.0;
+    }
+    double next_start = burst->period_ms / 1000.0;
+    while (burst->shape != BURST_NONE && reference && prev && curr && !shutdown_requested) {
+        BurstRecord record;
+        memset(&record, 0, sizeof(record));
+        
+        // Idle until the reference window, then average the depth over it
+        while (!shutdown_requested && run_elapsed(ctx) < next_start - reference_window) {
+            usleep(BURST_TICK_US);
+        }
+        stats_snapshot(ctx, reference);
+        long depth_sum = total_queue_depth(ctx);
+        int depth_samples = 1;
+        while (!shutdown_requested && run_elapsed(ctx) < next_start) {
+            usleep(BURST_TICK_US);
+            depth_sum += total_queue_depth(ctx);
+            depth_samples++;
+        }
+        if (shutdown_requested) {
+            break;
+        }
+        stats_snapshot(ctx, prev);
+        LatencyHistogram window = prev->latency;
+        histogram_subtract(&window, &reference->latency);
+        record.reference_depth = (double)depth_sum / depth_samples;
+        record.reference_p99 = histogram_percentile(&window, 99.0);
+        record.started = run_elapsed(ctx);
         
-        printf("=== Starting Stress Test ===\n");
+        log_printf("=== Starting Stress Test (%d tasks) ===\n", burst->amplitude);
         
-        for (int i = 0; i < stress_level * 100; i++) {
-            if (shutdown_requested) break;
+        // Enqueue along the shape's cumulative curve
+        double duration = burst->duration_ms / 1000.0;
+        int sent = 0;
+        while (!shutdown_requested && sent < burst->amplitude) {
+            double progress = duration > 0 ? (run_elapsed(ctx) - record.started) / duration : 1.0;
+            int due = (int)ceil(burst->amplitude * burst_fraction(burst->shape, progress));
             
-            Task* task = (Task*)malloc(sizeof(Task));
-            if (!task) continue;
-            
-            task->task_id = DEFAULT_NUM_TASKS + i;
-            task->priority = 1;  // Lowest priority for stress tasks
-            gettimeofday(&task->start_time, NULL);
+            for (; sent < due && !shutdown_requested; sent++) {
+                int node = next_id % ctx->num_nodes;
+                Task* task = task_alloc(ctx, node);
+                if (!task) continue;
+                
+                task->task_id = next_id++;
+                task->priority = burst->min_priority + (int)(rand_r(&seed) % priorities);
+                gettimeofday(&task->start_time, NULL);
+                if (trace_sampled(ctx, task->task_id)) {
+                    trace_record(TRACE_ENQUEUE, task->task_id);
+                }
+                
+                if (queue_enqueue(ctx->node_queues[node], task) == -1) {
+                    task_free(task);
+                    break;
+                }
+            }
             
-            if (queue_enqueue(ctx->task_queue, task) == -1) {
-                free(task);
-                break;
+            int depth = total_queue_depth(ctx);
+            if (depth > record.peak_depth) {
+                record.peak_depth = depth;
+            }
+            if (sent < burst->amplitude) {
+                usleep(BURST_TICK_US);
             }
         }
+        record.tasks = sent;
+        
+        log_printf("=== Stress Test Completed ===\n");
         
-        printf("=== Stress Test Completed ===\n");
+        // Watch the recovery until the next burst's reference window; a
+        // burst that overran its period (a full queue blocks it) pushes the
+        // schedule back so recovery always gets a full quiet gap
+        next_start += burst->period_ms / 1000.0;
+        if (next_start < run_elapsed(ctx) + burst->period_ms / 1000.0 - duration) {
+            next_start = run_elapsed(ctx) + burst->period_ms / 1000.0 - duration;
+        }
+        burst_measure_recovery(ctx, &record, prev, curr, next_start - reference_window);
+        if (ctx->num_bursts < BURST_MAX_RECORDS) {
+            ctx->bursts[ctx->num_bursts++] = record;
+        }
+        log_printf("Burst recovery: depth %.3f s, latency %.3f s (-1 = not recovered)\n",
+                   record.depth_recovery, record.latency_recovery);
     }
     
+    free(reference);
+    free(prev);
+    free(curr);
+    thread_usage_stop(&ctx->stress_usage);
     return NULL;
 }
 
-// Initialize application context
-void initialize_app_context(AppContext* ctx, int num_threads) {
-    memset(ctx, 0, sizeof(AppContext));
+// Nodes in the graph a spec describes, or -1 if it exceeds MAX_DAG_NODES
+int dag_node_count(const DagSpec* spec) {
+    long count = 0;
     
-    ctx->task_queue = queue_create(MAX_QUEUE_SIZE);
-    if (!ctx->task_queue) {
-        exit(EXIT_FAILURE);
+    if (spec->shape == DAG_LAYERED) {
+        count = (long)spec->layers * spec->width;
+    } else if (spec->shape == DAG_TREE) {
+        // Level k below the root holds fanout^k nodes
+        long level = 1;
+        for (int k = 0; k <= spec->layers && count <= MAX_DAG_NODES; k++) {
+            count += level;
+            level *= spec->fanin;
+        }
     }
+    return count > MAX_DAG_NODES ? -1 : (int)count;
+}
+
+// Generate the graph. Dependencies are drawn with a fixed seed, so every run
+// of the same spec executes the same graph.
+Dag* dag_create(const DagSpec* spec) {
+    int num_nodes = dag_node_count(spec);
+    unsigned seed = spec->seed;
+    long level_sizes[64];  // Tree levels, root first
     
-    ctx->worker_stats = (WorkerStats*)calloc(num_threads, sizeof(WorkerStats));
-    if (!ctx->worker_stats) {
-        perror("Failed to allocate worker stats");
-        exit(EXIT_FAILURE);
+    if (num_nodes <= 0) {
+        fprintf(stderr, "DAG has no nodes or more than %d\n", MAX_DAG_NODES);
+        return NULL;
     }
-    
-    ctx->worker_threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
-    if (!ctx->worker_threads) {
-        perror("Failed to allocate worker threads");
-        exit(EXIT_FAILURE);
+    for (int k = 0, size = 1; spec->shape == DAG_TREE && k <= spec->layers; k++) {
+        level_sizes[k] = size;
+        size *= spec->fanin;
     }
     
-    if (pthread_mutex_init(&ctx->stats_lock, NULL) != 0) {
-        perror("Failed to initialize stats mutex");
-        exit(EXIT_FAILURE);
+    Dag* dag = (Dag*)calloc(1, sizeof(Dag));
+    int* deps = (int*)malloc((size_t)num_nodes * MAX_DAG_FANIN * sizeof(int));
+    if (!dag || !deps) {
+        perror("Failed to allocate DAG");
+        free(dag);
+        free(deps);
+        return NULL;
     }
-    
-    if (pthread_mutex_init(&ctx->shutdown_lock, NULL) != 0) {
-        perror("Failed to initialize shutdown mutex");
-        exit(EXIT_FAILURE);
+    dag->num_nodes = num_nodes;
+    dag->nodes = (DagNode*)calloc(num_nodes, sizeof(DagNode));
+    if (!dag->nodes) {
+        perror("Failed to allocate DAG nodes");
+        free(dag);
+        free(deps);
+        return NULL;
     }
     
-    if (pthread_cond_init(&ctx->shutdown_cond, NULL) != 0) {
-        perror("Failed to initialize shutdown condition");
-        exit(EXIT_FAILURE);
+    // deps[id * MAX_DAG_FANIN ...] lists each node's dependencies
+    for (int id = 0; id < num_nodes; id++) {
+        DagNode* node = &dag->nodes[id];
+        int* own = &deps[(size_t)id * MAX_DAG_FANIN];
+        node->priority = DEFAULT_MIN_PRIORITY +
+                         (int)(rand_r(&seed) % (DEFAULT_MAX_PRIORITY - DEFAULT_MIN_PRIORITY + 1));
+        
+        if (spec->shape == DAG_LAYERED) {
+            int layer = id / spec->width;
+            if (layer == 0) {
+                continue;
+            }
+            // One dependency in the previous layer keeps the layering, the
+            // rest may reach back to any earlier target
+            int wanted = spec->fanin < layer * spec->width ? spec->fanin : layer * spec->width;
+            own[node->num_deps++] = (layer - 1) * spec->width + (int)(rand_r(&seed) % spec->width);
+            while (node->num_deps < wanted) {
+                int dep = (int)(rand_r(&seed) % (layer * spec->width));
+                int duplicate = 0;
+                for (int i = 0; i < node->num_deps; i++) {
+                    duplicate |= own[i] == dep;
+                }
+                if (!duplicate) {
+                    own[node->num_deps++] = dep;
+                }
+            }
+        } else {
+            // Leaves get the lowest IDs: level k of the tree starts at
+            // first[k], with level layers (the leaves) at 0
+            long first = 0;
+            int level = spec->layers;
+            while (id >= first + level_sizes[level]) {
+                first += level_sizes[level];
+                level--;
+            }
+            if (level == spec->layers) {
+                continue;
+            }
+            long index = id - first;
+            long children = first - level_sizes[level + 1];
+            for (int c = 0; c < spec->fanin; c++) {
+                own[node->num_deps++] = (int)(children + index * spec->fanin + c);
+            }
+        }
     }
     
-    ctx->active_workers = num_threads;
-    gettimeofday(&ctx->start_time, NULL);
+    // Invert the dependency lists into successor ranges
+    for (int id = 0; id < num_nodes; id++) {
+        dag->num_edges += dag->nodes[id].num_deps;
+        for (int i = 0; i < dag->nodes[id].num_deps; i++) {
+            dag->nodes[deps[(size_t)id * MAX_DAG_FANIN + i]].num_successors++;
+        }
+    }
+    dag->successors = (int*)malloc((dag->num_edges > 0 ? dag->num_edges : 1) * sizeof(int));
+    if (!dag->successors) {
+        perror("Failed to allocate DAG edges");
+        free(deps);
+        dag_destroy(dag);
+        return NULL;
+    }
+    for (int id = 0, next = 0; id < num_nodes; id++) {
+        dag->nodes[id].first_successor = next;
+        next += dag->nodes[id].num_successors;
+        dag->nodes[id].num_successors = 0;
+    }
+    for (int id = 0; id < num_nodes; id++) {
+        for (int i = 0; i < dag->nodes[id].num_deps; i++) {
+            DagNode* dep = &dag->nodes[deps[(size_t)id * MAX_DAG_FANIN + i]];
+            dag->successors[dep->first_successor + dep->num_successors++] = id;
+        }
+    }
     
-    // Initialize worker statistics
-    for (int i = 0; i < num_threads; i++) {
-        ctx->worker_stats[i].thread_id = i;
-        ctx->worker_stats[i].min_processing_time = 1000.0;  // High initial value
+    free(deps);
+    dag_reset(dag);
+    return dag;
+}
+
+// Make every node wait for its dependencies again; no worker may be running
+void dag_reset(Dag* dag) {
+    for (int id = 0; id < dag->num_nodes; id++) {
+        DagNode* node = &dag->nodes[id];
+        node->pending.store(node->num_deps, std::memory_order_relaxed);
+        node->started = 0.0;
+        node->finished = 0.0;
     }
+    dag->remaining.store(dag->num_nodes, std::memory_order_relaxed);
+    dag->inlined.store(0, std::memory_order_relaxed);
+    dag->queued.store(0, std::memory_order_relaxed);
+    dag->makespan = 0.0;
 }
 
-// Cleanup application context
-void cleanup_app_context(AppContext* ctx) {
-    if (ctx->task_queue) {
-        queue_destroy(ctx->task_queue);
+void dag_destroy(Dag* dag) {
+    if (dag) {
+        free(dag->nodes);
+        free(dag->successors);
+        free(dag);
     }
-    
-    free(ctx->worker_stats);
-    free(ctx->worker_threads);
-    
-    pthread_mutex_destroy(&ctx->stats_lock);
-    pthread_mutex_destroy(&ctx->shutdown_lock);
-    pthread_cond_destroy(&ctx->shutdown_cond);
 }
 
-// Print final statistics
-void print_statistics(AppContext* ctx) {
-    gettimeofday(&ctx->end_time, NULL);
-    double total_time = get_time_diff(&ctx->start_time, &ctx->end_time);
+// Wrap a runnable node in a task
+static Task* dag_task(AppContext* ctx, int id) {
+    Task* task = task_alloc(ctx, 0);
+    if (!task) {
+        return NULL;
+    }
+    task->task_id = id;
+    task->priority = ctx->dag->nodes[id].priority;
+    task->run = dag_run_node;
+    task->arg = &ctx->dag->nodes[id];
+    gettimeofday(&task->start_time, NULL);
+    return task;
+}
+
+// Queue every node without dependencies and start the makespan clock
+void dag_seed(AppContext* ctx) {
+    Dag* dag = ctx->dag;
+    int roots = 0;
     
-    printf("\n");
-    printf("========================================\n");
-    printf("           FINAL STATISTICS\n");
-    printf("========================================\n");
-    printf("Total Execution Time: %.4f seconds\n", total_time);
-    printf("Total Tasks Completed: %d\n", ctx->total_tasks_completed);
-    printf("Total Tasks Failed: %d\n", ctx->total_tasks_failed);
-    printf("Overall Throughput: %.2f tasks/second\n", 
-           total_time > 0 ? ctx->total_tasks_completed / total_time : 0);
+    clock_gettime(CLOCK_MONOTONIC, &dag->seeded);
+    for (int id = 0; id < dag->num_nodes; id++) {
+        if (dag->nodes[id].num_deps > 0) {
+            continue;
+        }
+        Task* task = dag_task(ctx, id);
+        if (!task || queue_enqueue(ctx->task_queue, task) != 0) {
+            task_free(task);
+            break;
+        }
+        roots++;
+    }
+    log_printf("Seeded %d DAG roots of %d nodes\n", roots, dag->num_nodes);
+}
+
+// Run one node, then release its successors. The last dependency to finish
+// makes a successor runnable; the first of those stays on this worker, whose
+// cache still holds the inputs, and the rest go to the queue for others.
+Task* dag_run_node(AppContext* ctx, Task* task) {
+    Dag* dag = ctx->dag;
+    DagNode* node = (DagNode*)task->arg;
+    struct timespec now;
+    Task* next = NULL;
     
-    printf("\nPer-Thread Statistics:\n");
-    printf("========================================\n");
-    printf("%-8s %-15s %-15s %-15s %-15s %-15s\n", 
-           "Thread", "Tasks", "Failed", "Total Time", "Avg Time", "Max Time");
-    printf("========================================\n");
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    node->started = timespec_diff(&dag->seeded, &now);
+    simulate_work(task->task_id, task->priority, ctx->config->work_divisor);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    node->finished = timespec_diff(&dag->seeded, &now);
     
-    for (int i = 0; i < DEFAULT_NUM_THREADS; i++) {
-        WorkerStats* stats = &ctx->worker_stats[i];
-        double avg_time = stats->tasks_completed > 0 ? 
-                         stats->total_processing_time / stats->tasks_completed : 0.0;
+    for (int i = 0; i < node->num_successors; i++) {
+        int id = dag->successors[node->first_successor + i];
+        DagNode* successor = &dag->nodes[id];
         
-        printf("%-8d %-15ld %-15ld %-15.6f %-15.6f %-15.6f\n",
-               stats->thread_id,
-               stats->tasks_completed,
-               stats->tasks_failed,
-               stats->total_processing_time,
-               avg_time,
-               stats->max_processing_time);
+        // Release publishes this node's results; the acquire by the
+        // decrement that reaches zero makes all of them visible
+        ANNOTATE_HAPPENS_BEFORE(&successor->pending);
+        if (successor->pending.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            continue;
+        }
+        ANNOTATE_HAPPENS_AFTER(&successor->pending);
+        
+        Task* ready = dag_task(ctx, id);
+        if (!ready) {
+            continue;
+        }
+        if (!next) {
+            next = ready;
+            dag->inlined.fetch_add(1, std::memory_order_relaxed);
+        } else if (queue_enqueue(ctx->task_queue, ready) == 0) {
+            dag->queued.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            task_free(ready);
+        }
     }
     
-    printf("========================================\n");
+    // The last node to decrement is not necessarily the last to finish; the
+    // decrements form one release sequence, so every finish time is visible here
+    if (dag->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        double makespan = 0.0;
+        for (int i = 0; i < dag->num_nodes; i++) {
+            if (dag->nodes[i].finished > makespan) {
+                makespan = dag->nodes[i].finished;
+            }
+        }
+        dag->makespan = makespan;
+    }
+    return next;
 }
 
-// Signal handler for graceful shutdown
-void signal_handler(int sig) {
-    if (sig == SIGINT || sig == SIGTERM) {
-        printf("\nShutdown signal received. Cleaning up...\n");
-        shutdown_requested = 1;
+void task_group_init(TaskGroup* group) {
+    group->pending.store(0, std::memory_order_relaxed);
+}
+
+// Take the newest forked job nobody has started; call with fork_lock held
+static ForkJob* fork_job_pop(AppContext* ctx) {
+    ForkJob* job = ctx->fork_jobs;
+    if (job) {
+        ctx->fork_jobs = job->next;
     }
+    return job;
 }
 
-// Main function
-int main(int argc, char* argv[]) {
-    AppContext ctx;
-    pthread_t generator_thread, monitor_thread_id, stress_thread;
-    int num_threads = DEFAULT_NUM_THREADS;
-    int run_duration = DEFAULT_TEST_DURATION;
+// Run a forked job and wake its joiner if it was the group's last
+static void fork_job_run(AppContext* ctx, ForkJob* job) {
+    TaskGroup* group = job->group;
     
-    // Setup signal handlers
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    job->fn(ctx, job);
     
-    // Seed random number generator
-    srand(time(NULL));
+    ANNOTATE_HAPPENS_BEFORE(&group->pending);
+    if (group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // Under the lock, so a joiner cannot check and then miss the wakeup
+        profiled_mutex_lock(&ctx->fork_lock);
+        pthread_cond_broadcast(&ctx->fork_cond);
+        profiled_mutex_unlock(&ctx->fork_lock);
+    }
+}
+
+// Worker side of a fork: run whichever job is newest. The joiner may have
+// run the job this ticket was queued for already, leaving nothing to do.
+static Task* fork_ticket_run(AppContext* ctx, Task* task) {
+    (void)task;
+    profiled_mutex_lock(&ctx->fork_lock);
+    ForkJob* job = fork_job_pop(ctx);
+    profiled_mutex_unlock(&ctx->fork_lock);
     
-    printf("========================================\n");
-    printf("       THREADING TEST APPLICATION\n");
-    printf("========================================\n");
-    printf("System Configuration:\n");
-    printf("- Max Threads: %d\n", MAX_THREADS);
-    printf("- Queue Capacity: %d\n", MAX_QUEUE_SIZE);
-    printf("- Default Tasks: %d\n", DEFAULT_NUM_TASKS);
-    printf("- Test Duration: %d seconds\n", DEFAULT_TEST_DURATION);
-    printf("========================================\n\n");
+    if (job) {
+        fork_job_run(ctx, job);
+    }
+    return NULL;
+}
+
+// Fork a job. It goes on the shared job stack, and a ticket in the task
+// queue gets a worker to take it; with the queue full the ticket is dropped
+// and the job waits for a joiner or a later ticket instead of blocking.
+void task_group_spawn(AppContext* ctx, TaskGroup* group, ForkJob* job) {
+    job->group = group;
+    group->pending.fetch_add(1, std::memory_order_relaxed);
     
-    // Initialize application context
-    initialize_app_context(&ctx, num_threads);
+    profiled_mutex_lock(&ctx->fork_lock);
+    job->next = ctx->fork_jobs;
+    ctx->fork_jobs = job;
+    pthread_cond_signal(&ctx->fork_cond);
+    profiled_mutex_unlock(&ctx->fork_lock);
     
-    // Create worker threads
-    printf("Creating %d worker threads...\n", num_threads);
-    for (int i = 0; i < num_threads; i++) {
-        if (pthread_create(&ctx.worker_threads[i], NULL, worker_thread, &ctx) != 0) {
-            perror("Failed to create worker thread");
-            exit(EXIT_FAILURE);
+    Task* ticket = task_alloc(ctx, 0);
+    if (!ticket) {
+        return;
+    }
+    ticket->task_id = 0;
+    ticket->priority = DEFAULT_MAX_PRIORITY;
+    ticket->run = fork_ticket_run;
+    ticket->arg = NULL;
+    ticket->internal = 1;  // The forked job is part of its caller's work, not a task of its own
+    gettimeofday(&ticket->start_time, NULL);
+    if (queue_try_enqueue(ctx->task_queue, ticket) != 0) {
+        task_free(ticket);
+    }
+}
+
+// Join a group. Rather than sleeping while jobs are pending, the joiner runs
+// forked jobs itself, newest first, so nested joins keep every thread busy;
+// it only waits once the group's remaining jobs are running elsewhere.
+void task_group_wait(AppContext* ctx, TaskGroup* group) {
+    profiled_mutex_lock(&ctx->fork_lock);
+    while (group->pending.load(std::memory_order_acquire) > 0) {
+        ForkJob* job = fork_job_pop(ctx);
+        if (job) {
+            profiled_mutex_unlock(&ctx->fork_lock);
+            fork_job_run(ctx, job);
+            profiled_mutex_lock(&ctx->fork_lock);
+        } else {
+            profiled_cond_wait(&ctx->fork_cond, &ctx->fork_lock);
+        }
+    }
+    profiled_mutex_unlock(&ctx->fork_lock);
+    ANNOTATE_HAPPENS_AFTER(&group->pending);
+}
+
+static void parallel_range(AppContext* ctx, ParallelLoop* loop, long begin, long end);
+
+static void parallel_chunk_run(AppContext* ctx, ForkJob* job) {
+    ParallelChunk* chunk = (ParallelChunk*)job;
+    parallel_range(ctx, chunk->loop, chunk->begin, chunk->end);
+    free(chunk);
+}
+
+// Lazy binary splitting: fork the upper half of the range only while the
+// queue holds less than a ticket per worker, i.e. while a worker may be
+// idle, then run what is left. Forked chunks split again the same way, so
+// the split count adapts to how busy the pool is instead of a fixed depth.
+static void parallel_range(AppContext* ctx, ParallelLoop* loop, long begin, long end) {
+    while (end - begin > loop->grain && queue_depth(ctx->task_queue) < ctx->num_threads) {
+        ParallelChunk* chunk = (ParallelChunk*)malloc(sizeof(ParallelChunk));
+        if (!chunk) {
+            break;
         }
+        long mid = begin + (end - begin) / 2;
+        chunk->job.fn = parallel_chunk_run;
+        chunk->loop = loop;
+        chunk->begin = mid;
+        chunk->end = end;
+        task_group_spawn(ctx, &loop->group, &chunk->job);
+        loop->splits.fetch_add(1, std::memory_order_relaxed);
+        end = mid;
     }
+    loop->fn(loop->arg, begin, end);
+}
+
+// Call fn over [begin, end) in chunks of at least grain (0 = about eight
+// per worker) on the pool's workers and the calling thread, which may itself
+// be a worker. Returns the number of chunks fn was called with.
+long parallel_for(AppContext* ctx, long begin, long end, long grain,
+                  void (*fn)(void* arg, long begin, long end), void* arg) {
+    ParallelLoop loop;
     
-    // Create task generator thread
-    printf("Creating task generator thread...\n");
-    if (pthread_create(&generator_thread, NULL, task_generator_thread, &ctx) != 0) {
-        perror("Failed to create task generator thread");
-        exit(EXIT_FAILURE);
+    task_group_init(&loop.group);
+    loop.fn = fn;
+    loop.arg = arg;
+    loop.grain = grain > 0 ? grain : (end - begin) / (8L * ctx->num_threads);
+    if (loop.grain < 1) {
+        loop.grain = 1;
     }
+    loop.splits.store(0, std::memory_order_relaxed);
     
-    // Create monitor thread
-    printf("Creating monitor thread...\n");
-    if (pthread_create(&monitor_thread_id, NULL, monitor_thread, &ctx) != 0) {
-        perror("Failed to create monitor thread");
+    if (end > begin) {
+        parallel_range(ctx, &loop, begin, end);
+    }
+    task_group_wait(ctx, &loop.group);
+    return loop.splits.load(std::memory_order_relaxed) + 1;
+}
+
+// Marks a future's continuation list as closed: it has completed, and
+// continuations attached from now on are dispatched straight away
+static Continuation future_list_closed;
+
+static Future* future_create(AppContext* ctx, int refs) {
+    Future* future = (Future*)malloc(sizeof(Future));
+    if (!future) {
+        perror("Failed to allocate future");
+        return NULL;
+    }
+    future->ctx = ctx;
+    future->continuations.store(NULL, std::memory_order_relaxed);
+    future->state.store(FUTURE_PENDING, std::memory_order_relaxed);
+    future->refs.store(refs, std::memory_order_relaxed);
+    future->waiters.store(0, std::memory_order_relaxed);
+    future->size = 0;
+    future->data = future->storage;
+    return future;
+}
+
+void future_retain(Future* future) {
+    future->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void future_release(Future* future) {
+    if (future && future->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        if (future->data != future->storage) {
+            free(future->data);
+        }
+        free(future);
+    }
+}
+
+// FUTURE_READY once the value can be read
+int future_ready(Future* future) {
+    return future->state.load(std::memory_order_acquire) == FUTURE_READY;
+}
+
+// The value of a ready future; it stays valid while the caller holds a reference
+const void* future_value(Future* future, size_t* size) {
+    if (size) {
+        *size = future->size;
+    }
+    return future->data;
+}
+
+// Run a continuation now and release what it held
+static void continuation_run(AppContext* ctx, Continuation* cont) {
+    Future* input = cont->input;
+    
+    // Only results travelling to a separate continuation are timed; cleanup
+    // after an abandoned input delivers nothing
+    if (input && !cont->run_inline &&
+        input->state.load(std::memory_order_acquire) == FUTURE_READY) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long delay = (long)(timespec_diff(&input->completed_at, &now) * 1e9);
+        long max = ctx->futures->max_delivery_ns.load(std::memory_order_relaxed);
+        ctx->futures->delivered.fetch_add(1, std::memory_order_relaxed);
+        ctx->futures->delivery_ns.fetch_add(delay, std::memory_order_relaxed);
+        while (delay > max && !ctx->futures->max_delivery_ns.compare_exchange_weak(
+                                  max, delay, std::memory_order_relaxed)) {
+        }
+    }
+    
+    cont->fn(ctx, input, cont->arg, cont->output);
+    
+    if (cont->output) {
+        if (cont->output->state.load(std::memory_order_acquire) == FUTURE_PENDING) {
+            if (input && input->state.load(std::memory_order_acquire) == FUTURE_ABANDONED) {
+                future_abandon(cont->output);
+            } else {
+                future_set(cont->output, NULL, 0);
+            }
+        }
+        future_release(cont->output);
+    }
+    future_release(input);
+    free(cont);
+}
+
+static Task* continuation_task_run(AppContext* ctx, Task* task) {
+    continuation_run(ctx, (Continuation*)task->arg);
+    return NULL;
+}
+
+// Dropped at shutdown: the output will never get its value
+static void continuation_task_discard(AppContext* ctx, Task* task) {
+    Continuation* cont = (Continuation*)task->arg;
+    (void)ctx;
+    if (cont->output) {
+        future_abandon(cont->output);
+        future_release(cont->output);
+    }
+    future_release(cont->input);
+    free(cont);
+}
+
+// Wrap a continuation in a pool task
+static Task* continuation_task(AppContext* ctx, Continuation* cont) {
+    Task* task = task_alloc(ctx, 0);
+    if (task) {
+        task->task_id = 0;
+        task->priority = DEFAULT_MAX_PRIORITY;
+        task->run = continuation_task_run;
+        task->discard = continuation_task_discard;
+        task->arg = cont;
+        task->internal = 1;  // Requests count once answered, not per future
+        gettimeofday(&task->start_time, NULL);
+    }
+    return task;
+}
+
+// Schedule a continuation whose input has completed. The completing thread
+// is usually a worker, so it never blocks on the queue: with the queue full
+// it runs the continuation itself.
+static void continuation_dispatch(AppContext* ctx, Continuation* cont) {
+    int abandoned = cont->input &&
+                    cont->input->state.load(std::memory_order_acquire) == FUTURE_ABANDONED;
+    
+    // Bookkeeping and cleanup after an abandoned input are cheap enough to run here
+    if (!cont->run_inline && !abandoned) {
+        Task* task = continuation_task(ctx, cont);
+        if (task && queue_try_enqueue(ctx->task_queue, task) == 0) {
+            ctx->futures->scheduled.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        task_free(task);
+        ctx->futures->fallbacks.fetch_add(1, std::memory_order_relaxed);
+    }
+    continuation_run(ctx, cont);
+}
+
+// Add a continuation, or dispatch it if the future has already completed
+static void future_attach(Future* input, Continuation* cont) {
+    Continuation* head = input->continuations.load(std::memory_order_acquire);
+    do {
+        if (head == &future_list_closed) {
+            ANNOTATE_HAPPENS_AFTER(&input->continuations);
+            continuation_dispatch(input->ctx, cont);
+            return;
+        }
+        cont->next = head;
+    } while (!input->continuations.compare_exchange_weak(head, cont, std::memory_order_release,
+                                                          std::memory_order_acquire));
+}
+
+// Publish the final state, then dispatch the continuations in the order they
+// were attached and wake any waiters
+static void future_finish(Future* future, int state) {
+    AppContext* ctx = future->ctx;
+    
+    clock_gettime(CLOCK_MONOTONIC, &future->completed_at);
+    future->state.store(state);  // Sequentially consistent: pairs with future_wait
+    ANNOTATE_HAPPENS_BEFORE(&future->continuations);
+    Continuation* list = future->continuations.exchange(&future_list_closed,
+                                                        std::memory_order_acq_rel);
+    
+    Continuation* ordered = NULL;
+    while (list) {
+        Continuation* next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    
+    // Waiters check the state under the lock, so this cannot slip between
+    // their check and their wait
+    if (future->waiters.load() > 0) {
+        profiled_mutex_lock(&ctx->fork_lock);
+        pthread_cond_broadcast(&ctx->fork_cond);
+        profiled_mutex_unlock(&ctx->fork_lock);
+    }
+    
+    while (ordered) {
+        Continuation* next = ordered->next;
+        continuation_dispatch(ctx, ordered);
+        ordered = next;
+    }
+}
+
+// Give a future its value; exactly once, by whoever holds its producing side.
+// Returns -1 if a large value could not be stored, leaving the future abandoned.
+int future_set(Future* future, const void* data, size_t size) {
+    AppContext* ctx = future->ctx;
+    
+    if (size > FUTURE_INLINE_BYTES) {
+        future->data = malloc(size);
+        if (!future->data) {
+            perror("Failed to allocate future value");
+            future->data = future->storage;
+            future_abandon(future);
+            return -1;
+        }
+        ctx->futures->heap_values.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        ctx->futures->inline_values.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (size > 0) {
+        memcpy(future->data, data, size);
+    }
+    future->size = size;
+    
+    ctx->futures->completed.fetch_add(1, std::memory_order_relaxed);
+    future_finish(future, FUTURE_READY);
+    return 0;
+}
+
+// Complete a future without a value; continuations see an abandoned input
+void future_abandon(Future* future) {
+    future->ctx->futures->abandoned.fetch_add(1, std::memory_order_relaxed);
+    future_finish(future, FUTURE_ABANDONED);
+}
+
+// Block until the future completes and return its state. Only for threads
+// outside the pool: a worker waiting here holds up the work it waits for,
+// so pool tasks chain with future_then instead.
+int future_wait(Future* future) {
+    AppContext* ctx = future->ctx;
+    
+    future->waiters.fetch_add(1);
+    profiled_mutex_lock(&ctx->fork_lock);
+    while (future->state.load() == FUTURE_PENDING) {
+        profiled_cond_wait(&ctx->fork_cond, &ctx->fork_lock);
+    }
+    profiled_mutex_unlock(&ctx->fork_lock);
+    future->waiters.fetch_sub(1);
+    return future->state.load(std::memory_order_acquire);
+}
+
+// Allocate a future and the task that will run fn for it, without queueing
+// the task. Dropping the task with task_discard abandons the future.
+static Future* future_prepare(AppContext* ctx, FutureFn fn, void* arg, Task** task) {
+    Future* output = future_create(ctx, 2);  // The caller's reference and the task's
+    Continuation* cont = (Continuation*)malloc(sizeof(Continuation));
+    *task = output && cont ? continuation_task(ctx, cont) : NULL;
+    if (!*task) {
+        perror("Failed to submit future");
+        free(output);
+        free(cont);
+        return NULL;
+    }
+    
+    cont->next = NULL;
+    cont->fn = fn;
+    cont->arg = arg;
+    cont->input = NULL;
+    cont->output = output;
+    cont->run_inline = 0;
+    return output;
+}
+
+// Queue a prepared task, or drop it if shutdown has begun
+static void future_start(AppContext* ctx, Task* task) {
+    // A full queue is only woken once at shutdown, so later submissions must not wait on it
+    if (shutdown_requested || queue_enqueue(ctx->task_queue, task) != 0) {
+        task_discard(ctx, task);
+    }
+}
+
+// Run fn on the pool. Blocks while the queue is full, so call it from
+// outside the pool; a future abandoned straight away means shutdown began.
+Future* future_submit(AppContext* ctx, FutureFn fn, void* arg) {
+    Task* task;
+    Future* output = future_prepare(ctx, fn, arg, &task);
+    if (output) {
+        future_start(ctx, task);
+    }
+    return output;
+}
+
+// Run fn on the pool once input completes, with input as its argument
+Future* future_then(Future* input, FutureFn fn, void* arg) {
+    Future* output = future_create(input->ctx, 2);  // The caller's and the continuation's
+    Continuation* cont = (Continuation*)malloc(sizeof(Continuation));
+    if (!output || !cont) {
+        perror("Failed to attach continuation");
+        free(output);
+        free(cont);
+        return NULL;
+    }
+    
+    future_retain(input);
+    cont->fn = fn;
+    cont->arg = arg;
+    cont->input = input;
+    cont->output = output;
+    cont->run_inline = 0;
+    future_attach(input, cont);
+    return output;
+}
+
+// Fan-in state of one future_when_all
+typedef struct {
+    std::atomic<int> remaining;
+    std::atomic<int> abandoned;  // Some input was
+    Future* output;
+} FutureJoin;
+
+// Count one input in; the last completes the output
+static void future_join_arrive(FutureJoin* join, int abandoned) {
+    if (abandoned) {
+        join->abandoned.store(1, std::memory_order_relaxed);
+    }
+    if (join->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        if (join->abandoned.load(std::memory_order_relaxed)) {
+            future_abandon(join->output);
+        } else {
+            future_set(join->output, NULL, 0);
+        }
+        future_release(join->output);
+        free(join);
+    }
+}
+
+static void when_all_arrive(AppContext* ctx, Future* input, void* arg, Future* output) {
+    (void)ctx;
+    (void)output;
+    future_join_arrive((FutureJoin*)arg,
+                       input->state.load(std::memory_order_acquire) == FUTURE_ABANDONED);
+}
+
+// Future completing, without a value, once every input has; abandoned if
+// any input was. The inputs' values are read from the inputs themselves.
+Future* future_when_all(AppContext* ctx, Future** inputs, int count) {
+    Future* output = future_create(ctx, 2);  // The caller's and the join's
+    FutureJoin* join = (FutureJoin*)malloc(sizeof(FutureJoin));
+    if (!output || !join) {
+        perror("Failed to join futures");
+        free(output);
+        free(join);
+        return NULL;
+    }
+    
+    // One extra arrival, made below, keeps the join alive while attaching
+    join->remaining.store(count + 1, std::memory_order_relaxed);
+    join->abandoned.store(0, std::memory_order_relaxed);
+    join->output = output;
+    for (int i = 0; i < count; i++) {
+        Continuation* cont = (Continuation*)malloc(sizeof(Continuation));
+        if (!cont) {
+            perror("Failed to join future");
+            future_join_arrive(join, 1);
+            continue;
+        }
+        future_retain(inputs[i]);
+        cont->fn = when_all_arrive;
+        cont->arg = join;
+        cont->input = inputs[i];
+        cont->output = NULL;
+        cont->run_inline = 1;
+        future_attach(inputs[i], cont);
+    }
+    future_join_arrive(join, 0);
+    return output;
+}
+
+// A request in --requests mode: fanned out to the pool as futures, then
+// answered by a continuation once they have all delivered their results
+typedef struct {
+    int request_id;
+    int priority;
+    int fanout;
+    struct timeval submitted;
+    Future* parts[MAX_REQUEST_FANOUT];
+} Request;
+
+// One part of a request: an equal share of the work a plain task does
+static void request_part_run(AppContext* ctx, Future* input, void* arg, Future* output) {
+    Request* request = (Request*)arg;
+    (void)input;
+    double value = simulate_work(request->request_id, request->priority,
+                                 ctx->config->work_divisor * request->fanout);
+    future_set(output, &value, sizeof(value));
+}
+
+// Combine the parts into the response and record the request's latency
+static void request_respond(AppContext* ctx, Future* input, void* arg, Future* output) {
+    Request* request = (Request*)arg;
+    (void)output;
+    
+    if (future_ready(input)) {
+        volatile double response = 0.0;
+        for (int i = 0; i < request->fanout; i++) {
+            response = response + *(const double*)future_value(request->parts[i], NULL);
+        }
+        
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        profiled_mutex_lock(&ctx->request_lock);
+        histogram_record(&ctx->request_latency, get_time_diff(&request->submitted, &now));
+        profiled_mutex_unlock(&ctx->request_lock);
+        ctx->futures->requests.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    for (int i = 0; i < request->fanout; i++) {
+        future_release(request->parts[i]);
+    }
+    free(request);
+}
+
+// Submit one request; -1 if it could not be allocated or shutdown has begun
+int request_submit(AppContext* ctx, int request_id, int priority) {
+    Task* tasks[MAX_REQUEST_FANOUT];
+    int fanout = ctx->config->request_fanout;
+    Request* request = (Request*)malloc(sizeof(Request));
+    if (!request) {
+        perror("Failed to allocate request");
+        return -1;
+    }
+    request->request_id = request_id;
+    request->priority = priority;
+    request->fanout = fanout;
+    gettimeofday(&request->submitted, NULL);
+    
+    // Everything is allocated before any part is queued, so a failure can be
+    // undone without waiting for parts that are already reading the request
+    int prepared = 0;
+    while (prepared < fanout) {
+        request->parts[prepared] = future_prepare(ctx, request_part_run, request,
+                                                  &tasks[prepared]);
+        if (!request->parts[prepared]) {
+            break;
+        }
+        prepared++;
+    }
+    Future* all = prepared == fanout ? future_when_all(ctx, request->parts, fanout) : NULL;
+    Future* response = all ? future_then(all, request_respond, request) : NULL;
+    if (!response) {
+        // Dropping the tasks abandons the parts, which completes all with no
+        // continuation left to run; the request is then unreferenced
+        for (int i = 0; i < prepared; i++) {
+            task_discard(ctx, tasks[i]);
+            future_release(request->parts[i]);
+        }
+        future_release(all);
+        free(request);
+        return -1;
+    }
+    
+    // From here request_respond owns the request, and runs even if parts are
+    // abandoned; it may free it as soon as the last part is queued
+    for (int i = 0; i < fanout; i++) {
+        future_start(ctx, tasks[i]);
+    }
+    future_release(all);
+    future_release(response);
+    return shutdown_requested ? -1 : 0;
+}
+
+// Block until the mailboxes together hold fewer tasks than the queue can;
+// -1 once shutdown has begun
+static int key_backlog_wait(AppContext* ctx) {
+    KeyBacklog* backlog = ctx->key_backlog;
+    
+    // Registered before checking, so a release either sees the waiter or
+    // has already made room
+    backlog->waiters.fetch_add(1);
+    profiled_mutex_lock(&backlog->lock);
+    while (backlog->tasks.load() >= ctx->task_queue->capacity && !shutdown_requested) {
+        profiled_cond_wait(&backlog->not_full, &backlog->lock);
+    }
+    profiled_mutex_unlock(&backlog->lock);
+    backlog->waiters.fetch_sub(1);
+    return shutdown_requested ? -1 : 0;
+}
+
+// Submit a task that must run after every earlier task with the same key.
+// If the key is idle the task is queued, blocking while the queue is full;
+// otherwise it waits in the key's mailbox without taking a queue slot, or
+// blocks while the mailboxes already hold as many tasks as the queue does.
+// Concurrent submitters may overshoot that cap by one task each.
+// Returns -1 once shutdown has begun, leaving the task to the caller.
+int keyed_submit(AppContext* ctx, Task* task) {
+    KeyMailbox* mailbox = &ctx->mailboxes[task->key];
+    
+    profiled_mutex_lock(&mailbox->lock);
+    while (mailbox->active &&
+           ctx->key_backlog->tasks.load() >= ctx->task_queue->capacity && !shutdown_requested) {
+        profiled_mutex_unlock(&mailbox->lock);
+        key_backlog_wait(ctx);
+        profiled_mutex_lock(&mailbox->lock);
+    }
+    if (shutdown_requested) {
+        profiled_mutex_unlock(&mailbox->lock);
+        return -1;
+    }
+    task->key_sequence = mailbox->submitted++;
+    task->key_next = NULL;
+    if (mailbox->active) {
+        if (mailbox->tail) {
+            mailbox->tail->key_next = task;
+        } else {
+            mailbox->head = task;
+        }
+        mailbox->tail = task;
+        if (++mailbox->backlog > mailbox->max_backlog) {
+            mailbox->max_backlog = mailbox->backlog;
+        }
+        ctx->key_backlog->tasks.fetch_add(1);
+        profiled_mutex_unlock(&mailbox->lock);
+        return 0;
+    }
+    mailbox->active = 1;
+    mailbox->streak = 0;
+    profiled_mutex_unlock(&mailbox->lock);
+    
+    // A full queue is only woken once at shutdown, so do not start waiting on it late
+    if (shutdown_requested || queue_enqueue(ctx->task_queue, task) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Called by the worker that ran a keyed task: returns the key's next task for
+// that worker to run, or NULL if the key went idle or its next task was
+// queued. After KEY_MAILBOX_BATCH tasks in a row the key goes back through
+// the queue so that one busy key cannot hold a worker indefinitely.
+Task* keyed_release(AppContext* ctx, Task* task) {
+    KeyMailbox* mailbox = &ctx->mailboxes[task->key];
+    KeyBacklog* backlog = ctx->key_backlog;
+    
+    profiled_mutex_lock(&mailbox->lock);
+    if (task->key_sequence != mailbox->executed) {
+        mailbox->violations++;
+    }
+    mailbox->executed = task->key_sequence + 1;
+    
+    Task* next = mailbox->head;
+    if (!next) {
+        mailbox->active = 0;
+        profiled_mutex_unlock(&mailbox->lock);
+        return NULL;
+    }
+    mailbox->head = next->key_next;
+    if (!mailbox->head) {
+        mailbox->tail = NULL;
+    }
+    mailbox->backlog--;
+    backlog->tasks.fetch_sub(1);
+    if (backlog->waiters.load() > 0) {
+        profiled_mutex_lock(&backlog->lock);
+        pthread_cond_signal(&backlog->not_full);
+        profiled_mutex_unlock(&backlog->lock);
+    }
+    
+    // The queue lock nests inside the mailbox lock; submitters never hold both
+    if (++mailbox->streak >= KEY_MAILBOX_BATCH &&
+        queue_try_enqueue(ctx->task_queue, next) == 0) {
+        mailbox->streak = 0;
+        mailbox->requeued++;
+        next = NULL;
+    } else {
+        mailbox->inlined++;
+    }
+    profiled_mutex_unlock(&mailbox->lock);
+    return next;
+}
+
+// Start the worker pool on the CPUs the placement gives it
+int start_workers(AppContext* ctx, const CpuTopology* topology, const ThreadPlacement* placement) {
+    for (int i = 0; i < ctx->num_threads; i++) {
+        int created;
+        if (placement->worker_cpus[i] < 0 && ctx->config->numa) {
+            // Bound to the node, free to move between its CPUs
+            created = create_thread_on_cpuset(&ctx->worker_threads[i],
+                                             &topology->node_cpus[placement->worker_nodes[i]],
+                                             worker_thread, ctx);
+        } else {
+            created = create_thread_on_cpu(&ctx->worker_threads[i], placement->worker_cpus[i],
+                                           worker_thread, ctx);
+        }
+        if (created != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Wake and join the workers; shutdown_requested must already be set
+void stop_workers(AppContext* ctx) {
+    for (int i = 0; i < ctx->num_nodes; i++) {
+        queue_wake_all(ctx->node_queues[i]);
+    }
+    for (int s = 1; s < ctx->num_stages; s++) {
+        queue_wake_all(ctx->stage_queues[s]);
+    }
+    // Workers stop releasing keys, so submitters waiting for mailbox room
+    // would otherwise never return
+    if (ctx->key_backlog) {
+        profiled_mutex_lock(&ctx->key_backlog->lock);
+        pthread_cond_broadcast(&ctx->key_backlog->not_full);
+        profiled_mutex_unlock(&ctx->key_backlog->lock);
+    }
+    for (int i = 0; i < ctx->num_threads; i++) {
+        pthread_join(ctx->worker_threads[i], NULL);
+    }
+}
+
+// Initialize application context
+void initialize_app_context(AppContext* ctx, int num_threads, const AppConfig* config,
+                            const CpuTopology* topo, const ThreadPlacement* placement) {
+    memset(ctx, 0, sizeof(AppContext));
+    ctx->config = config;
+    ctx->prometheus_fd = -1;
+    ctx->num_threads = num_threads;
+    ctx->num_nodes = config->numa ? topo->num_nodes : 1;
+    
+    ctx->node_queues = (ThreadSafeQueue**)calloc(ctx->num_nodes, sizeof(ThreadSafeQueue*));
+    if (!ctx->node_queues) {
+        perror("Failed to allocate node queues");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (config->numa) {
+        ctx->node_pools = (TaskPool**)calloc(ctx->num_nodes, sizeof(TaskPool*));
+        if (!ctx->node_pools) {
+            perror("Failed to allocate node task pools");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Enough pooled tasks to fill the queue while every worker holds one
+        for (int i = 0; i < ctx->num_nodes; i++) {
+            ctx->node_queues[i] = queue_create_on_node(config->queue_capacity, i,
+                                                       &topo->node_cpus[i]);
+            ctx->node_pools[i] = task_pool_create(config->queue_capacity + num_threads + 2, i,
+                                                  &topo->node_cpus[i]);
+            if (!ctx->node_queues[i] || !ctx->node_pools[i]) {
+                exit(EXIT_FAILURE);
+            }
+        }
+    } else {
+        // Every DAG node passes through the queue at most once, so with room
+        // for all of them a worker releasing successors never blocks on it
+        int capacity = config->queue_capacity;
+        if (config->dag.shape != DAG_NONE) {
+            capacity += dag_node_count(&config->dag);
+        }
+        ctx->node_queues[0] = queue_create(capacity);
+        if (!ctx->node_queues[0]) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    ctx->task_queue = ctx->node_queues[0];
+    
+    if (config->dag.shape != DAG_NONE) {
+        ctx->dag = dag_create(&config->dag);
+        if (!ctx->dag) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    for (int i = 0; i < num_threads; i++) {
+        ctx->worker_nodes[i] = config->numa ? placement->worker_nodes[i] : 0;
+    }
+    
+    // Producers feed the first stage; each later stage gets a queue of its own
+    ctx->num_stages = config->num_stages;
+    ctx->stage_queues[0] = ctx->task_queue;
+    for (int s = 1; s < ctx->num_stages; s++) {
+        ctx->stage_queues[s] = queue_create(config->queue_capacity);
+        if (!ctx->stage_queues[s]) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int s = 0, worker = 0; s < ctx->num_stages; s++) {
+        for (int i = 0; i < config->stages[s].workers; i++) {
+            ctx->worker_stages[worker++] = s;
+        }
+    }
+    
+    // Cache-line aligned so workers publishing stats never share a line
+    ctx->worker_stats = (WorkerStats*)aligned_alloc(alignof(WorkerStats),
+                                                    num_threads * sizeof(WorkerStats));
+    ctx->worker_seqlocks = (StatsSeqlock*)aligned_alloc(alignof(StatsSeqlock),
+                                                        num_threads * sizeof(StatsSeqlock));
+    if (!ctx->worker_stats || !ctx->worker_seqlocks) {
+        perror("Failed to allocate worker stats");
+        exit(EXIT_FAILURE);
+    }
+    memset(ctx->worker_stats, 0, num_threads * sizeof(WorkerStats));
+    for (int i = 0; i < num_threads; i++) {
+        ctx->worker_seqlocks[i].sequence.store(0, std::memory_order_relaxed);
+    }
+    // Readers copy while a worker may be writing and discard torn copies
+    ANNOTATE_BENIGN_RACE_SIZED(ctx->worker_stats, num_threads * sizeof(WorkerStats),
+                               "seqlock-protected worker stats");
+    
+    if (config->perf) {
+        ctx->worker_perf = (WorkerPerf*)calloc(num_threads, sizeof(WorkerPerf));
+        if (!ctx->worker_perf) {
+            perror("Failed to allocate worker counters");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+                ctx->worker_perf[i].fds[c] = -1;
+            }
+            ctx->worker_perf[i].ready.store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    ctx->worker_threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+    if (!ctx->worker_threads) {
+        perror("Failed to allocate worker threads");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (profiled_mutex_init(&ctx->stats_lock, "stats_lock") != 0) {
+        perror("Failed to initialize stats mutex");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (profiled_mutex_init(&ctx->shutdown_lock, "shutdown_lock") != 0) {
+        perror("Failed to initialize shutdown mutex");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (pthread_cond_init(&ctx->shutdown_cond, NULL) != 0) {
+        perror("Failed to initialize shutdown condition");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (profiled_mutex_init(&ctx->fork_lock, "fork_lock") != 0 ||
+        pthread_cond_init(&ctx->fork_cond, NULL) != 0) {
+        perror("Failed to initialize fork/join state");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (profiled_mutex_init(&ctx->request_lock, "request_lock") != 0) {
+        perror("Failed to initialize request mutex");
+        exit(EXIT_FAILURE);
+    }
+    ctx->futures = (FutureStats*)calloc(1, sizeof(FutureStats));
+    if (!ctx->futures) {
+        perror("Failed to allocate future statistics");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (config->num_keys > 0) {
+        ctx->num_keys = config->num_keys;
+        ctx->mailboxes = (KeyMailbox*)calloc(ctx->num_keys, sizeof(KeyMailbox));
+        ctx->key_backlog = (KeyBacklog*)calloc(1, sizeof(KeyBacklog));
+        if (!ctx->mailboxes || !ctx->key_backlog) {
+            perror("Failed to allocate key mailboxes");
+            exit(EXIT_FAILURE);
+        }
+        if (profiled_mutex_init(&ctx->key_backlog->lock, "key_backlog") != 0 ||
+            pthread_cond_init(&ctx->key_backlog->not_full, NULL) != 0) {
+            perror("Failed to initialize key backlog");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < ctx->num_keys; i++) {
+            char name[24];
+            snprintf(name, sizeof(name), "key[%d]", i);
+            if (profiled_mutex_init(&ctx->mailboxes[i].lock, name) != 0) {
+                perror("Failed to initialize key mailbox");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    
+    ctx->history = interval_history_create(config->history_size);
+    if (!ctx->history) {
+        exit(EXIT_FAILURE);
+    }
+    
+    ctx->bursts = (BurstRecord*)calloc(BURST_MAX_RECORDS, sizeof(BurstRecord));
+    if (!ctx->bursts) {
+        perror("Failed to allocate burst records");
+        exit(EXIT_FAILURE);
+    }
+    
+    // The DAG executor generates the tasks itself
+    ctx->num_producers = ctx->dag ? 0 : config->num_producers;
+    for (int i = 0; i < ctx->num_producers; i++) {
+        Producer* producer = &ctx->producers[i];
+        producer->ctx = ctx;
+        producer->index = i;
+        producer->spec = config->producers[i];
+        producer_task_range(config, i, &producer->first_task_id, &producer->end_task_id);
+    }
+    
+    reset_app_context(ctx);
+}
+
+// Drop every queued task; dropped continuations abandon their futures,
+// which may queue more cleanup, so each queue is emptied until it stays empty
+static void drain_queues(AppContext* ctx) {
+    Task* task;
+    for (int i = 0; i < ctx->num_nodes; i++) {
+        while ((task = (Task*)queue_try_dequeue(ctx->node_queues[i])) != NULL) {
+            task_discard(ctx, task);
+        }
+    }
+    for (int s = 1; s < ctx->num_stages; s++) {
+        while ((task = (Task*)queue_try_dequeue(ctx->stage_queues[s])) != NULL) {
+            task_discard(ctx, task);
+        }
+    }
+}
+
+// Drop the tasks waiting in key mailboxes and return every key to idle
+static void drain_mailboxes(AppContext* ctx) {
+    for (int i = 0; i < ctx->num_keys; i++) {
+        KeyMailbox* mailbox = &ctx->mailboxes[i];
+        while (mailbox->head) {
+            Task* task = mailbox->head;
+            mailbox->head = task->key_next;
+            task_discard(ctx, task);
+        }
+        mailbox->tail = NULL;
+        mailbox->active = 0;
+        mailbox->streak = 0;
+        mailbox->backlog = 0;
+    }
+    if (ctx->key_backlog) {
+        ctx->key_backlog->tasks.store(0);
+    }
+}
+
+// Return the per-run state to its starting values while keeping every
+// allocation, so a reused context starts the next run with warm queues,
+// pools and malloc arenas. No other thread may be running.
+void reset_app_context(AppContext* ctx) {
+    const AppConfig* config = ctx->config;
+    int num_threads = ctx->num_threads;
+    
+    // Tasks left behind by a run that hit the time limit go back to their pools
+    drain_queues(ctx);
+    drain_mailboxes(ctx);
+    for (int i = 0; i < ctx->num_keys; i++) {
+        KeyMailbox* mailbox = &ctx->mailboxes[i];
+        mailbox->max_backlog = 0;
+        mailbox->submitted = 0;
+        mailbox->executed = 0;
+        mailbox->violations = 0;
+        mailbox->inlined = 0;
+        mailbox->requeued = 0;
+        profiled_mutex_reset(&mailbox->lock);
+    }
+    if (ctx->key_backlog) {
+        profiled_mutex_reset(&ctx->key_backlog->lock);
+    }
+    for (int i = 0; i < ctx->num_nodes; i++) {
+        profiled_mutex_reset(&ctx->node_queues[i]->lock);
+        if (ctx->node_pools) {
+            profiled_mutex_reset(&ctx->node_pools[i]->lock);
+        }
+    }
+    for (int s = 1; s < ctx->num_stages; s++) {
+        profiled_mutex_reset(&ctx->stage_queues[s]->lock);
+    }
+    profiled_mutex_reset(&ctx->stats_lock);
+    profiled_mutex_reset(&ctx->shutdown_lock);
+    profiled_mutex_reset(&ctx->fork_lock);
+    profiled_mutex_reset(&ctx->request_lock);
+    
+    // Drained above, so no future completes after this
+    FutureStats* futures = ctx->futures;
+    std::atomic<long>* counters[] = {&futures->completed, &futures->abandoned,
+                                     &futures->inline_values, &futures->heap_values,
+                                     &futures->scheduled, &futures->fallbacks,
+                                     &futures->delivered, &futures->delivery_ns,
+                                     &futures->max_delivery_ns,
+                                     &futures->requests};
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        counters[i]->store(0, std::memory_order_relaxed);
+    }
+    memset(&ctx->request_latency, 0, sizeof(LatencyHistogram));
+    
+    memset(ctx->worker_stats, 0, num_threads * sizeof(WorkerStats));
+    for (int i = 0; i < num_threads; i++) {
+        ctx->worker_seqlocks[i].sequence.store(0, std::memory_order_relaxed);
+        ctx->worker_stats[i].thread_id = i;
+        ctx->worker_stats[i].min_processing_time = 1000.0;  // High initial value
+    }
+    
+    // Workers reopen their counters when they start
+    if (ctx->worker_perf) {
+        for (int i = 0; i < num_threads; i++) {
+            perf_counters_close(&ctx->worker_perf[i]);
+            ctx->worker_perf[i].error = 0;
+            ctx->worker_perf[i].ready.store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    memset(ctx->worker_usage, 0, sizeof(ctx->worker_usage));
+    for (int i = 0; i < ctx->num_producers; i++) {
+        Producer* producer = &ctx->producers[i];
+        producer->enqueued = 0;
+        producer->blocked_time = 0.0;
+        producer->max_blocked = 0.0;
+        memset(&producer->usage, 0, sizeof(ThreadUsage));
+    }
+    memset(&ctx->monitor_usage, 0, sizeof(ThreadUsage));
+    memset(&ctx->stress_usage, 0, sizeof(ThreadUsage));
+    ctx->num_bursts = 0;
+    if (ctx->dag) {
+        dag_reset(ctx->dag);
+    }
+    memset(&ctx->exporter_usage, 0, sizeof(ThreadUsage));
+    ctx->history->count = 0;
+    ctx->history->next = 0;
+    
+    // Threads register fresh trace rings each run
+    if (config->trace_file) {
+        trace_destroy(ctx->trace);
+        ctx->trace = trace_create(config->trace_sample);
+        if (!ctx->trace) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    ctx->active_workers = num_threads;
+    gettimeofday(&ctx->start_time, NULL);
+}
+
+// Cleanup application context
+void cleanup_app_context(AppContext* ctx) {
+    drain_queues(ctx);
+    drain_mailboxes(ctx);
+    for (int i = 0; i < ctx->num_keys; i++) {
+        profiled_mutex_destroy(&ctx->mailboxes[i].lock);
+    }
+    free(ctx->mailboxes);
+    if (ctx->key_backlog) {
+        profiled_mutex_destroy(&ctx->key_backlog->lock);
+        pthread_cond_destroy(&ctx->key_backlog->not_full);
+        free(ctx->key_backlog);
+    }
+    for (int i = 0; i < ctx->num_nodes; i++) {
+        queue_destroy(ctx->node_queues[i]);
+        if (ctx->node_pools) {
+            task_pool_destroy(ctx->node_pools[i]);
+        }
+    }
+    free(ctx->node_queues);
+    free(ctx->node_pools);
+    for (int s = 1; s < ctx->num_stages; s++) {
+        queue_destroy(ctx->stage_queues[s]);
+    }
+    
+    free(ctx->worker_stats);
+    free(ctx->worker_seqlocks);
+    if (ctx->worker_perf) {
+        for (int i = 0; i < ctx->num_threads; i++) {
+            perf_counters_close(&ctx->worker_perf[i]);
+        }
+        free(ctx->worker_perf);
+    }
+    free(ctx->worker_threads);
+    free(ctx->bursts);
+    dag_destroy(ctx->dag);
+    interval_history_destroy(ctx->history);
+    trace_destroy(ctx->trace);
+    
+    profiled_mutex_destroy(&ctx->stats_lock);
+    profiled_mutex_destroy(&ctx->shutdown_lock);
+    pthread_cond_destroy(&ctx->shutdown_cond);
+    profiled_mutex_destroy(&ctx->fork_lock);
+    pthread_cond_destroy(&ctx->fork_cond);
+    profiled_mutex_destroy(&ctx->request_lock);
+    free(ctx->futures);
+}
+
+// Start a stats update; only the owning worker may call this
+void stats_publish_begin(StatsSeqlock* seqlock) {
+    unsigned sequence = seqlock->sequence.load(std::memory_order_relaxed);
+    seqlock->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+// Finish a stats update, making it visible to readers
+void stats_publish_end(StatsSeqlock* seqlock) {
+    unsigned sequence = seqlock->sequence.load(std::memory_order_relaxed);
+    ANNOTATE_HAPPENS_BEFORE(seqlock);
+    seqlock->sequence.store(sequence + 1, std::memory_order_release);
+}
+
+// Copy one worker's stats, retrying if the worker updated them meanwhile
+void stats_read_worker(AppContext* ctx, int worker, WorkerStats* out) {
+    StatsSeqlock* seqlock = &ctx->worker_seqlocks[worker];
+
+    for (;;) {
+        unsigned before = seqlock->sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        *out = ctx->worker_stats[worker];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seqlock->sequence.load(std::memory_order_relaxed) == before) {
+            ANNOTATE_HAPPENS_AFTER(seqlock);
+            return;
+        }
+    }
+}
+
+// Take a snapshot of every statistic; each worker's entry is self-consistent
+void stats_snapshot(AppContext* ctx, StatsSnapshot* snap) {
+    memset(snap, 0, sizeof(StatsSnapshot));
+    gettimeofday(&snap->taken_at, NULL);
+
+    for (int i = 0; i < ctx->num_threads; i++) {
+        WorkerStats* stats = &snap->workers[i];
+        stats_read_worker(ctx, i, stats);
+        snap->total_completed += stats->tasks_completed;
+        snap->total_failed += stats->tasks_failed;
+        snap->local_dequeues += stats->local_dequeues;
+        snap->remote_dequeues += stats->remote_dequeues;
+        snap->total_processing_time += stats->total_processing_time;
+        histogram_merge(&snap->latency, &stats->latency);
+    }
+    
+    // In --requests mode the unit of work is the answered request; the
+    // futures' own tasks are not counted
+    if (ctx->config->request_fanout > 0) {
+        profiled_mutex_lock(&ctx->request_lock);
+        snap->total_completed += ctx->request_latency.count;
+        histogram_merge(&snap->latency, &ctx->request_latency);
+        profiled_mutex_unlock(&ctx->request_lock);
+    }
+
+    snap->queue_depth = total_queue_depth(ctx);
+    snap->mailbox_depth =
+        ctx->key_backlog ? ctx->key_backlog->tasks.load(std::memory_order_relaxed) : 0;
+    snap->queue_capacity = ctx->task_queue->capacity * ctx->num_nodes;
+    for (int s = 1; s < ctx->num_stages; s++) {
+        snap->queue_capacity += ctx->stage_queues[s]->capacity;
+    }
+}
+
+// Map a latency to its histogram bucket
+static int latency_bucket(double seconds) {
+    long long us = (long long)(seconds * 1000000.0);
+    if (us < LATENCY_LINEAR_BUCKETS) {
+        return us < 0 ? 0 : (int)us;
+    }
+
+    // Power-of-two range, split into LATENCY_SUB_BUCKETS linear steps
+    int exponent = 63 - __builtin_clzll((unsigned long long)us);
+    int shift = exponent - 3;
+    int sub = (int)((us >> shift) & (LATENCY_SUB_BUCKETS - 1));
+    int bucket = LATENCY_LINEAR_BUCKETS + (exponent - 4) * LATENCY_SUB_BUCKETS + sub;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// Upper bound of a histogram bucket in seconds
+static double latency_bucket_upper(int bucket) {
+    if (bucket < LATENCY_LINEAR_BUCKETS) {
+        return (bucket + 1) / 1000000.0;
+    }
+    int exponent = 4 + (bucket - LATENCY_LINEAR_BUCKETS) / LATENCY_SUB_BUCKETS;
+    int sub = (bucket - LATENCY_LINEAR_BUCKETS) % LATENCY_SUB_BUCKETS;
+    long long upper = (long long)(LATENCY_SUB_BUCKETS + sub + 1) << (exponent - 3);
+    return upper / 1000000.0;
+}
+
+// Add one latency sample
+void histogram_record(LatencyHistogram* hist, double seconds) {
+    hist->buckets[latency_bucket(seconds)]++;
+    hist->count++;
+    hist->sum += seconds;
+    if (seconds > hist->max) {
+        hist->max = seconds;
+    }
+}
+
+// Accumulate src into dst
+void histogram_merge(LatencyHistogram* dst, const LatencyHistogram* src) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+// Remove an earlier cumulative histogram, leaving the samples since then.
+// The maximum cannot be un-merged, so it becomes the highest non-empty bucket,
+// clamped to the cumulative maximum since the bucket bound can lie above it.
+void histogram_subtract(LatencyHistogram* dst, const LatencyHistogram* prev) {
+    double recorded_max = dst->max;
+    dst->max = 0.0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        dst->buckets[i] -= prev->buckets[i];
+        if (dst->buckets[i] > 0) {
+            dst->max = fmin(latency_bucket_upper(i), recorded_max);
+        }
+    }
+    dst->count -= prev->count;
+    dst->sum -= prev->sum;
+}
+
+// Latency at or below which the given percentage of samples fall
+double histogram_percentile(const LatencyHistogram* hist, double percentile) {
+    if (hist->count <= 0) {
+        return 0.0;
+    }
+
+    long target = (long)ceil(hist->count * percentile / 100.0);
+    long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target && seen > 0) {
+            double upper = latency_bucket_upper(i);
+            return upper < hist->max || hist->max == 0.0 ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// Turn two cumulative snapshots and the depth samples between them into
+// per-interval figures
+void interval_compute(const StatsSnapshot* prev, const StatsSnapshot* curr,
+                      const QueueDepthWindow* window, double start_offset,
+                      IntervalStats* out) {
+    LatencyHistogram delta = curr->latency;
+    histogram_subtract(&delta, &prev->latency);
+
+    memset(out, 0, sizeof(IntervalStats));
+    out->duration = get_time_diff((struct timeval*)&prev->taken_at,
+                                  (struct timeval*)&curr->taken_at);
+    out->elapsed = start_offset + out->duration;
+    out->completed = curr->total_completed - prev->total_completed;
+    out->failed = curr->total_failed - prev->total_failed;
+    out->throughput = out->duration > 0 ? out->completed / out->duration : 0.0;
+    out->latency_p50 = histogram_percentile(&delta, 50.0);
+    out->latency_p90 = histogram_percentile(&delta, 90.0);
+    out->latency_p99 = histogram_percentile(&delta, 99.0);
+    out->latency_max = delta.max;
+
+    if (window->samples > 0) {
+        out->queue_min = window->min;
+        out->queue_max = window->max;
+        out->queue_avg = (double)window->sum / window->samples;
+    } else {
+        out->queue_min = out->queue_max = curr->queue_depth;
+        out->queue_avg = curr->queue_depth;
+    }
+}
+
+// Create a ring buffer holding the last capacity intervals
+IntervalHistory* interval_history_create(int capacity) {
+    IntervalHistory* history = (IntervalHistory*)calloc(1, sizeof(IntervalHistory));
+    if (!history) {
+        perror("Failed to allocate interval history");
+        return NULL;
+    }
+
+    history->records = (IntervalStats*)calloc(capacity, sizeof(IntervalStats));
+    if (!history->records) {
+        free(history);
+        perror("Failed to allocate interval records");
+        return NULL;
+    }
+
+    history->capacity = capacity;
+    return history;
+}
+
+// Free an interval history
+void interval_history_destroy(IntervalHistory* history) {
+    if (history) {
+        free(history->records);
+        free(history);
+    }
+}
+
+// Append an interval, overwriting the oldest once full (monitor thread only)
+void interval_history_push(IntervalHistory* history, const IntervalStats* record) {
+    history->records[history->next] = *record;
+    history->next = (history->next + 1) % history->capacity;
+    if (history->count < history->capacity) {
+        history->count++;
+    }
+}
+
+// Write the retained intervals as CSV, oldest first
+void interval_history_dump(const IntervalHistory* history, FILE* out) {
+    fprintf(out, "elapsed_s,duration_s,completed,failed,throughput,"
+                 "latency_p50_s,latency_p90_s,latency_p99_s,latency_max_s,"
+                 "queue_min,queue_avg,queue_max\n");
+
+    int first = (history->next - history->count + history->capacity) % history->capacity;
+    for (int i = 0; i < history->count; i++) {
+        const IntervalStats* rec = &history->records[(first + i) % history->capacity];
+        fprintf(out, "%.3f,%.3f,%ld,%ld,%.2f,%.6f,%.6f,%.6f,%.6f,%d,%.1f,%d\n",
+                rec->elapsed, rec->duration, rec->completed, rec->failed, rec->throughput,
+                rec->latency_p50, rec->latency_p90, rec->latency_p99, rec->latency_max,
+                rec->queue_min, rec->queue_avg, rec->queue_max);
+    }
+}
+
+// Open the metrics destination: a path, "fd:N" for an inherited descriptor,
+// or "-" for stdout
+FILE* metrics_open(const char* target) {
+    if (!target || strcmp(target, "-") == 0) {
+        return stdout;
+    }
+    if (strncmp(target, "fd:", 3) == 0) {
+        char* end;
+        long fd = strtol(target + 3, &end, 10);
+        if (end == target + 3 || *end != '\0' || fd < 0) {
+            fprintf(stderr, "Invalid metrics descriptor: %s\n", target);
+            return NULL;
+        }
+        FILE* out = fdopen((int)fd, "w");
+        if (!out) {
+            perror("Failed to open metrics descriptor");
+        }
+        return out;
+    }
+
+    FILE* out = fopen(target, "w");
+    if (!out) {
+        perror("Failed to open metrics file");
+    }
+    return out;
+}
+
+// Flush and close the metrics stream, leaving stdout open
+void metrics_close(FILE* metrics) {
+    if (!metrics) {
+        return;
+    }
+    if (metrics == stdout) {
+        fflush(metrics);
+    } else {
+        fclose(metrics);
+    }
+}
+
+// Write the CSV column header; JSON Lines records are self-describing
+void metrics_write_header(AppContext* ctx) {
+    if (!ctx->metrics || ctx->config->metrics_format != METRICS_CSV) {
+        return;
+    }
+
+    FILE* out = ctx->metrics;
+    fprintf(out, "schema,type,elapsed_s,duration_s,"
+                 "threads,queue_capacity,affinity,numa,nodes,"
+                 "completed,failed,throughput,"
+                 "latency_p50_s,latency_p90_s,latency_p99_s,latency_max_s,"
+                 "queue_min,queue_avg,queue_max,"
+                 "total_completed,total_failed,total_throughput,"
+                 "total_latency_p50_s,total_latency_p90_s,total_latency_p99_s,"
+                 "total_latency_max_s,queue_depth");
+    for (int i = 0; i < ctx->num_threads; i++) {
+        fprintf(out, ",w%d_completed,w%d_failed,w%d_busy_s,w%d_max_s,w%d_local,w%d_remote",
+                i, i, i, i, i, i);
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+// Write one interval or summary record in the configured format
+void metrics_write_record(AppContext* ctx, const char* type, const StatsSnapshot* snap,
+                          const IntervalStats* interval) {
+    const AppConfig* config = ctx->config;
+    FILE* out = ctx->metrics;
+    double elapsed = interval->elapsed;
+    double total_throughput = elapsed > 0 ? snap->total_completed / elapsed : 0.0;
+    double total_p50 = histogram_percentile(&snap->latency, 50.0);
+    double total_p90 = histogram_percentile(&snap->latency, 90.0);
+    double total_p99 = histogram_percentile(&snap->latency, 99.0);
+
+    if (config->metrics_format == METRICS_JSONL) {
+        fprintf(out, "{\"schema\":%d,\"type\":\"%s\",\"elapsed_s\":%.3f,\"duration_s\":%.3f,",
+                METRICS_SCHEMA_VERSION, type, elapsed, interval->duration);
+        fprintf(out, "\"config\":{\"threads\":%d,\"queue_capacity\":%d,\"affinity\":\"%s\","
+                     "\"numa\":%d,\"nodes\":%d},",
+                ctx->num_threads, config->queue_capacity,
+                affinity_policy_name(config->affinity), config->numa, ctx->num_nodes);
+        fprintf(out, "\"interval\":{\"completed\":%ld,\"failed\":%ld,\"throughput\":%.2f,"
+                     "\"latency_p50_s\":%.6f,\"latency_p90_s\":%.6f,\"latency_p99_s\":%.6f,"
+                     "\"latency_max_s\":%.6f,\"queue_min\":%d,\"queue_avg\":%.1f,"
+                     "\"queue_max\":%d},",
+                interval->completed, interval->failed, interval->throughput,
+                interval->latency_p50, interval->latency_p90, interval->latency_p99,
+                interval->latency_max, interval->queue_min, interval->queue_avg,
+                interval->queue_max);
+        fprintf(out, "\"total\":{\"completed\":%ld,\"failed\":%ld,\"throughput\":%.2f,"
+                     "\"latency_p50_s\":%.6f,\"latency_p90_s\":%.6f,\"latency_p99_s\":%.6f,"
+                     "\"latency_max_s\":%.6f,\"queue_depth\":%d,\"queue_capacity\":%d},",
+                snap->total_completed, snap->total_failed, total_throughput,
+                total_p50, total_p90, total_p99, snap->latency.max,
+                snap->queue_depth, snap->queue_capacity);
+        fprintf(out, "\"workers\":[");
+        for (int i = 0; i < ctx->num_threads; i++) {
+            const WorkerStats* stats = &snap->workers[i];
+            fprintf(out, "%s{\"id\":%d,\"node\":%d,\"completed\":%ld,\"failed\":%ld,"
+                         "\"busy_s\":%.6f,\"max_s\":%.6f,\"local\":%ld,\"remote\":%ld}",
+                    i > 0 ? "," : "", stats->thread_id, ctx->worker_nodes[i],
+                    stats->tasks_completed, stats->tasks_failed,
+                    stats->total_processing_time, stats->max_processing_time,
+                    stats->local_dequeues, stats->remote_dequeues);
+        }
+        fprintf(out, "]}\n");
+    } else {
+        fprintf(out, "%d,%s,%.3f,%.3f,%d,%d,%s,%d,%d,",
+                METRICS_SCHEMA_VERSION, type, elapsed, interval->duration,
+                ctx->num_threads, config->queue_capacity,
+                affinity_policy_name(config->affinity), config->numa, ctx->num_nodes);
+        fprintf(out, "%ld,%ld,%.2f,%.6f,%.6f,%.6f,%.6f,%d,%.1f,%d,",
+                interval->completed, interval->failed, interval->throughput,
+                interval->latency_p50, interval->latency_p90, interval->latency_p99,
+                interval->latency_max, interval->queue_min, interval->queue_avg,
+                interval->queue_max);
+        fprintf(out, "%ld,%ld,%.2f,%.6f,%.6f,%.6f,%.6f,%d",
+                snap->total_completed, snap->total_failed, total_throughput,
+                total_p50, total_p90, total_p99, snap->latency.max, snap->queue_depth);
+        for (int i = 0; i < ctx->num_threads; i++) {
+            const WorkerStats* stats = &snap->workers[i];
+            fprintf(out, ",%ld,%ld,%.6f,%.6f,%ld,%ld",
+                    stats->tasks_completed, stats->tasks_failed,
+                    stats->total_processing_time, stats->max_processing_time,
+                    stats->local_dequeues, stats->remote_dequeues);
+        }
+        fprintf(out, "\n");
+    }
+
+    // Consumers tail the stream while the run is in progress
+    fflush(out);
+}
+
+// Write the whole run as a single "summary" record
+void metrics_write_summary(AppContext* ctx) {
+    if (!ctx->metrics) {
+        return;
+    }
+
+    // Treat the run as one interval measured from an empty baseline
+    StatsSnapshot* start = (StatsSnapshot*)calloc(1, sizeof(StatsSnapshot));
+    StatsSnapshot* end = (StatsSnapshot*)malloc(sizeof(StatsSnapshot));
+    if (!start || !end) {
+        perror("Failed to allocate summary snapshots");
+        free(start);
+        free(end);
+        return;
+    }
+
+    stats_snapshot(ctx, end);
+    start->taken_at = ctx->start_time;
+
+    QueueDepthWindow window = {0, 0, 0, 0};
+    IntervalStats run;
+    interval_compute(start, end, &window, 0.0, &run);
+    // Nothing was subtracted, so the exact maximum still applies
+    run.latency_p50 = histogram_percentile(&end->latency, 50.0);
+    run.latency_p90 = histogram_percentile(&end->latency, 90.0);
+    run.latency_p99 = histogram_percentile(&end->latency, 99.0);
+    run.latency_max = end->latency.max;
+    metrics_write_record(ctx, "summary", end, &run);
+
+    free(start);
+    free(end);
+}
+
+// Record the figures a baseline keeps for the window between two snapshots:
+// the end of the warmup and the end of the run
+void run_result_capture(const StatsSnapshot* start, const StatsSnapshot* end, RunResult* out) {
+    memset(out, 0, sizeof(RunResult));
+    out->duration = get_time_diff((struct timeval*)&start->taken_at,
+                                  (struct timeval*)&end->taken_at);
+    out->completed = end->total_completed - start->total_completed;
+    out->failed = end->total_failed - start->total_failed;
+    out->throughput = out->duration > 0 ? out->completed / out->duration : 0.0;
+    out->latency = end->latency;
+    // Without a warmup nothing is subtracted and the exact maximum still applies
+    if (start->latency.count > 0) {
+        histogram_subtract(&out->latency, &start->latency);
+    }
+}
+
+// Write the workload configuration and every run's results as a line-based
+// text file that baseline_load reads back
+int baseline_save(const char* path, const AppConfig* config, const ResourceLimits* limits,
+                  const RunResult* runs, int num_runs) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror("Failed to open baseline file");
+        return -1;
+    }
+
+    char burst[96];
+    format_burst_profile(&config->burst, burst, sizeof(burst));
+    
+    fprintf(out, "# threads baseline; rerun with --compare=%s\n", path);
+    fprintf(out, "version %d\n", BASELINE_FORMAT_VERSION);
+    fprintf(out, "config threads=%d tasks=%d queue_capacity=%d affinity=%s numa=%d "
+                 "work_divisor=%d stress_tasks=%d warmup_ms=%d reuse_context=%d "
+                 "request_fanout=%d keys=%d effective_cpus=%d burst=%s producers=",
+            config->num_threads, config->num_tasks, config->queue_capacity,
+            affinity_policy_name(config->affinity), config->numa, config->work_divisor,
+            config->stress_tasks, config->warmup_ms, config->reuse_context,
+            config->request_fanout, config->num_keys, limits->effective_cpus, burst);
+    for (int i = 0; i < config->num_producers; i++) {
+        char spec[48];
+        format_producer_spec(&config->producers[i], spec, sizeof(spec));
+        fprintf(out, "%s%s", i > 0 ? "," : "", spec);
+    }
+    fprintf(out, " stages=");
+    for (int i = 0; i < config->num_stages; i++) {
+        char spec[48];
+        format_stage_spec(&config->stages[i], spec, sizeof(spec));
+        fprintf(out, "%s%s", i > 0 ? "," : "", spec);
+    }
+    if (config->num_stages == 0) {
+        fprintf(out, "-");
+    }
+    char dag[96];
+    format_dag_spec(&config->dag, dag, sizeof(dag));
+    fprintf(out, " dag=%s", dag);
+    fprintf(out, " cpus=");
+    if (config->cpu_list_len > 0) {
+        for (int i = 0; i < config->cpu_list_len; i++) {
+            fprintf(out, "%s%d", i > 0 ? "," : "", config->cpu_list[i]);
+        }
+    } else {
+        fprintf(out, "-");
+    }
+    fprintf(out, "\n");
+
+    // Only non-empty latency buckets are written, as index:count
+    for (int i = 0; i < num_runs; i++) {
+        const RunResult* run = &runs[i];
+        fprintf(out, "run duration=%.6f completed=%ld failed=%ld throughput=%.3f\n",
+                run->duration, run->completed, run->failed, run->throughput);
+        fprintf(out, "hist count=%ld sum=%.9f max=%.9f",
+                run->latency.count, run->latency.sum, run->latency.max);
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            if (run->latency.buckets[b] > 0) {
+                fprintf(out, " %d:%ld", b, run->latency.buckets[b]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+
+    if (fclose(out) != 0) {
+        perror("Failed to write baseline file");
+        return -1;
+    }
+    printf("Baseline of %d run(s) saved to %s\n", num_runs, path);
+    return 0;
+}
+
+// Apply one key=value field (or index:count bucket) of a baseline line;
+// unknown keys are skipped so newer files still load
+static int baseline_parse_field(Baseline* baseline, const char* kind, RunResult* run,
+                                char* field) {
+    char* value = strchr(field, '=');
+
+    if (strcmp(kind, "hist") == 0 && !value) {
+        int bucket;
+        long count;
+        if (sscanf(field, "%d:%ld", &bucket, &count) != 2 ||
+            bucket < 0 || bucket >= LATENCY_BUCKETS || count < 0) {
+            return -1;
+        }
+        run->latency.buckets[bucket] = count;
+        return 0;
+    }
+    if (!value) {
+        return -1;
+    }
+    *value++ = '\0';
+
+    AppConfig* config = &baseline->config;
+    if (strcmp(kind, "config") == 0) {
+        if (strcmp(field, "threads") == 0) {
+            config->num_threads = atoi(value);
+        } else if (strcmp(field, "tasks") == 0) {
+            config->num_tasks = atoi(value);
+        } else if (strcmp(field, "queue_capacity") == 0) {
+            config->queue_capacity = atoi(value);
+        } else if (strcmp(field, "affinity") == 0) {
+            return affinity_policy_parse(value, &config->affinity);
+        } else if (strcmp(field, "numa") == 0) {
+            config->numa = atoi(value);
+        } else if (strcmp(field, "work_divisor") == 0) {
+            config->work_divisor = atoi(value);
+        } else if (strcmp(field, "stress_tasks") == 0) {
+            config->stress_tasks = atoi(value);
+        } else if (strcmp(field, "warmup_ms") == 0) {
+            config->warmup_ms = atoi(value);
+        } else if (strcmp(field, "reuse_context") == 0) {
+            config->reuse_context = atoi(value);
+        } else if (strcmp(field, "request_fanout") == 0) {
+            config->request_fanout = atoi(value);
+        } else if (strcmp(field, "keys") == 0) {
+            config->num_keys = atoi(value);
+        } else if (strcmp(field, "effective_cpus") == 0) {
+            baseline->effective_cpus = atoi(value);
+        } else if (strcmp(field, "burst") == 0) {
+            return parse_burst_profile(value, &config->burst);
+        } else if (strcmp(field, "dag") == 0) {
+            return parse_dag_spec(value, &config->dag);
+        } else if (strcmp(field, "producers") == 0) {
+            config->num_producers = 0;
+            for (char* save = NULL, *spec = strtok_r(value, ",", &save); spec;
+                 spec = strtok_r(NULL, ",", &save)) {
+                if (config->num_producers == MAX_PRODUCERS ||
+                    parse_producer_spec(spec, &config->producers[config->num_producers]) != 0) {
+                    return -1;
+                }
+                config->num_producers++;
+            }
+        } else if (strcmp(field, "stages") == 0 && strcmp(value, "-") != 0) {
+            config->num_stages = 0;
+            for (char* save = NULL, *spec = strtok_r(value, ",", &save); spec;
+                 spec = strtok_r(NULL, ",", &save)) {
+                if (config->num_stages == MAX_STAGES ||
+                    parse_stage_spec(spec, &config->stages[config->num_stages]) != 0) {
+                    return -1;
+                }
+                config->num_stages++;
+            }
+        } else if (strcmp(field, "cpus") == 0 && strcmp(value, "-") != 0) {
+            config->cpu_list_len = parse_cpu_list(value, config->cpu_list, MAX_CPUS);
+            if (config->cpu_list_len <= 0) {
+                return -1;
+            }
+        }
+    } else if (strcmp(kind, "run") == 0) {
+        if (strcmp(field, "duration") == 0) {
+            run->duration = atof(value);
+        } else if (strcmp(field, "completed") == 0) {
+            run->completed = atol(value);
+        } else if (strcmp(field, "failed") == 0) {
+            run->failed = atol(value);
+        } else if (strcmp(field, "throughput") == 0) {
+            run->throughput = atof(value);
+        }
+    } else {
+        if (strcmp(field, "count") == 0) {
+            run->latency.count = atol(value);
+        } else if (strcmp(field, "sum") == 0) {
+            run->latency.sum = atof(value);
+        } else if (strcmp(field, "max") == 0) {
+            run->latency.max = atof(value);
+        }
+    }
+    return 0;
+}
+
+// Read a file written by baseline_save
+Baseline* baseline_load(const char* path) {
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        perror("Failed to open baseline file");
+        return NULL;
+    }
+
+    Baseline* baseline = (Baseline*)calloc(1, sizeof(Baseline));
+    if (!baseline) {
+        perror("Failed to allocate baseline");
+        fclose(in);
+        return NULL;
+    }
+
+    // Baselines from before burst profiles ran the default spike
+    burst_profile_default(&baseline->config.burst);
+    
+    char line[BASELINE_LINE_MAX];
+    RunResult* run = NULL;
+    int version = 0;
+    int line_number = 0;
+    int error = 0;
+
+    while (!error && fgets(line, sizeof(line), in)) {
+        char* save;
+        char* kind = strtok_r(line, " \n", &save);
+        line_number++;
+        if (!kind || kind[0] == '#') {
+            continue;
+        }
+
+        if (strcmp(kind, "version") == 0) {
+            char* value = strtok_r(NULL, " \n", &save);
+            version = value ? atoi(value) : 0;
+            continue;
+        }
+        if (strcmp(kind, "run") == 0) {
+            if (baseline->num_runs == BASELINE_MAX_RUNS) {
+                fprintf(stderr, "%s: more than %d runs\n", path, BASELINE_MAX_RUNS);
+                error = 1;
+                break;
+            }
+            run = &baseline->runs[baseline->num_runs++];
+        } else if (strcmp(kind, "config") != 0 && (strcmp(kind, "hist") != 0 || !run)) {
+            error = 1;
+        }
+
+        for (char* field = strtok_r(NULL, " \n", &save); !error && field;
+             field = strtok_r(NULL, " \n", &save)) {
+            error = baseline_parse_field(baseline, kind, run, field) != 0;
+        }
+        if (error) {
+            fprintf(stderr, "%s:%d: malformed baseline line\n", path, line_number);
+        }
+    }
+    fclose(in);
+
+    if (!error && version != BASELINE_FORMAT_VERSION) {
+        fprintf(stderr, "%s has baseline format %d; this build reads %d\n",
+                path, version, BASELINE_FORMAT_VERSION);
+        error = 1;
+    }
+    if (!error && (baseline->num_runs == 0 || baseline->config.num_threads < 1 ||
+                   baseline->config.num_threads > MAX_THREADS ||
+                   baseline->config.num_tasks < 1 || baseline->config.queue_capacity < 1)) {
+        fprintf(stderr, "%s has no usable configuration or runs\n", path);
+        error = 1;
+    }
+    if (error) {
+        free(baseline);
+        return NULL;
+    }
+    return baseline;
+}
+
+// Rerun exactly the baseline's workload, whatever the command line or the
+// container limits would have chosen
+void baseline_apply_config(const Baseline* baseline, AppConfig* config) {
+    const AppConfig* saved = &baseline->config;
+
+    config->num_threads = saved->num_threads;
+    config->num_tasks = saved->num_tasks;
+    config->queue_capacity = saved->queue_capacity;
+    config->affinity = saved->affinity;
+    config->numa = saved->numa;
+    config->work_divisor = saved->work_divisor > 0 ? saved->work_divisor : 1;
+    config->stress_tasks = saved->stress_tasks;
+    config->warmup_ms = saved->warmup_ms;
+    config->reuse_context = saved->reuse_context;
+    config->request_fanout = saved->request_fanout;
+    config->num_keys = saved->num_keys;
+    config->burst = saved->burst;
+    if (config->burst.amplitude == BURST_AMPLITUDE_DEFAULT) {
+        config->burst.amplitude = config->stress_tasks;
+    }
+    // Baselines from before producers were configurable had a single one
+    if (saved->num_producers > 0) {
+        config->num_producers = saved->num_producers;
+        memcpy(config->producers, saved->producers, sizeof(config->producers));
+    } else {
+        config->num_producers = 1;
+        config->producers[0].rate = 0.0;
+        config->producers[0].min_priority = DEFAULT_MIN_PRIORITY;
+        config->producers[0].max_priority = DEFAULT_MAX_PRIORITY;
+    }
+    config->num_stages = saved->num_stages;
+    memcpy(config->stages, saved->stages, sizeof(config->stages));
+    config->dag = saved->dag;
+    config->cpu_list_len = saved->cpu_list_len;
+    memcpy(config->cpu_list, saved->cpu_list, sizeof(config->cpu_list));
+}
+
+static int compare_ranked_samples(const void* a, const void* b) {
+    double x = ((const RankedSample*)a)->value;
+    double y = ((const RankedSample*)b)->value;
+    return (x > y) - (x < y);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Median of values; reorders the array
+static double median_of(double* values, int count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+// One-sided Mann-Whitney U test: the probability of b ranking this far above
+// a if both came from the same distribution. Uses the normal approximation
+// with tie and continuity corrections, which needs no distributional
+// assumption about run-to-run noise.
+double mann_whitney_p(const double* a, int na, const double* b, int nb) {
+    int n = na + nb;
+    if (na < 1 || nb < 1 || n < 3) {
+        return 1.0;
+    }
+
+    RankedSample* samples = (RankedSample*)malloc(n * sizeof(RankedSample));
+    if (!samples) {
+        perror("Failed to allocate rank samples");
+        return 1.0;
+    }
+    for (int i = 0; i < na; i++) {
+        samples[i].value = a[i];
+        samples[i].in_b = 0;
+    }
+    for (int i = 0; i < nb; i++) {
+        samples[na + i].value = b[i];
+        samples[na + i].in_b = 1;
+    }
+    qsort(samples, n, sizeof(RankedSample), compare_ranked_samples);
+
+    // Tied samples share the average of the ranks they span
+    double rank_sum_b = 0.0;
+    double ties = 0.0;
+    for (int i = 0; i < n;) {
+        int j = i;
+        while (j < n && samples[j].value == samples[i].value) {
+            j++;
+        }
+        double rank = (i + 1 + j) / 2.0;
+        for (int k = i; k < j; k++) {
+            if (samples[k].in_b) {
+                rank_sum_b += rank;
+            }
+        }
+        double tied = j - i;
+        ties += tied * tied * tied - tied;
+        i = j;
+    }
+    free(samples);
+
+    double u = rank_sum_b - nb * (nb + 1) / 2.0;
+    double mean = na * nb / 2.0;
+    double variance = na * nb / 12.0 * ((n + 1) - ties / ((double)n * (n - 1)));
+    if (variance <= 0.0) {
+        return 1.0;
+    }
+    double z = (u - mean - 0.5) / sqrt(variance);
+    return 0.5 * erfc(z / sqrt(2.0));
+}
+
+static const char* run_metric_names[RUN_METRIC_COUNT] = {
+    "throughput", "latency_p50", "latency_p90", "latency_p99"
+};
+
+// Value of one metric for a run
+static double run_metric(const RunResult* run, RunMetric metric) {
+    switch (metric) {
+        case RUN_THROUGHPUT:  return run->throughput;
+        case RUN_LATENCY_P50: return histogram_percentile(&run->latency, 50.0);
+        case RUN_LATENCY_P90: return histogram_percentile(&run->latency, 90.0);
+        default:              return histogram_percentile(&run->latency, 99.0);
+    }
+}
+
+// Compare the medians of this session's runs with the baseline's and print
+// a verdict per metric. A metric regresses when it is significantly worse
+// and the median moved by more than threshold percent. Returns the number
+// of regressed metrics.
+int baseline_compare(const Baseline* baseline, const char* path, const RunResult* runs,
+                     int num_runs, double threshold) {
+    double saved[BASELINE_MAX_RUNS];
+    double current[BASELINE_MAX_RUNS];
+    int regressions = 0;
+
+    printf("\nBaseline Comparison:\n");
+    printf("========================================\n");
+    printf("Baseline %s: %d runs; this session: %d runs\n", path, baseline->num_runs, num_runs);
+    printf("Regression: one-sided Mann-Whitney p < %.2f and median %.1f%% worse\n",
+           BASELINE_ALPHA, threshold);
+    if (baseline->num_runs < BASELINE_MIN_RUNS || num_runs < BASELINE_MIN_RUNS) {
+        printf("Note: fewer than %d runs on a side; only large shifts can be detected\n",
+               BASELINE_MIN_RUNS);
+    }
+    printf("%-12s %-14s %-14s %-9s %-9s %s\n",
+           "Metric", "Baseline", "Current", "Change", "p-value", "Verdict");
+    printf("========================================\n");
+
+    for (int m = 0; m < RUN_METRIC_COUNT; m++) {
+        int higher_is_better = m == RUN_THROUGHPUT;
+        for (int i = 0; i < baseline->num_runs; i++) {
+            saved[i] = run_metric(&baseline->runs[i], (RunMetric)m);
+        }
+        for (int i = 0; i < num_runs; i++) {
+            current[i] = run_metric(&runs[i], (RunMetric)m);
+        }
+
+        // Test in the direction that would be bad, and the other way for
+        // reporting improvements
+        double p_worse = higher_is_better ?
+                         mann_whitney_p(current, num_runs, saved, baseline->num_runs) :
+                         mann_whitney_p(saved, baseline->num_runs, current, num_runs);
+        double p_better = higher_is_better ?
+                          mann_whitney_p(saved, baseline->num_runs, current, num_runs) :
+                          mann_whitney_p(current, num_runs, saved, baseline->num_runs);
+
+        double saved_median = median_of(saved, baseline->num_runs);
+        double current_median = median_of(current, num_runs);
+        double change = saved_median != 0.0 ?
+                        100.0 * (current_median - saved_median) / saved_median : 0.0;
+        double worse_by = higher_is_better ? -change : change;
+
+        const char* verdict = "ok";
+        double p = p_worse;
+        if (p_worse < BASELINE_ALPHA && worse_by > threshold) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (p_better < BASELINE_ALPHA && -worse_by > threshold) {
+            verdict = "improved";
+            p = p_better;
+        }
+        printf("%-12s %-14.6g %-14.6g %+7.1f%%  %-9.4f %s\n",
+               run_metric_names[m], saved_median, current_median, change, p, verdict);
+    }
+
+    printf("========================================\n");
+    printf("Result: %s\n", regressions > 0 ? "REGRESSION" : "no significant regression");
+    return regressions;
+}
+
+// Distribution-free confidence interval for the median from order
+// statistics of sorted values. Returns the coverage actually achieved,
+// which falls short of the target when there are too few values (below six
+// for 95%), in which case the interval is the full range.
+double median_confidence_interval(const double* sorted, int count, double confidence,
+                                  double* low, double* high) {
+    // [x(k), x(n-k+1)] misses the median with probability 2 * P(Bin(n, 1/2) < k)
+    double tail = 0.0;
+    double term = pow(0.5, count);  // P(Bin = 0)
+    int k = 1;
+    double coverage = 1.0 - 2.0 * term;
+    for (int j = 1; j <= (count - 1) / 2; j++) {
+        tail += term;
+        term *= (double)(count - j + 1) / j;
+        double candidate = 1.0 - 2.0 * (tail + term);
+        if (candidate < confidence) {
+            break;
+        }
+        k = j + 1;
+        coverage = candidate;
+    }
+    *low = sorted[k - 1];
+    *high = sorted[count - k];
+    return coverage;
+}
+
+// Median and confidence interval of each metric across runs
+void print_trial_summary(const AppConfig* config, const RunResult* runs, int num_runs) {
+    double values[BASELINE_MAX_RUNS];
+
+    printf("\nTrial Summary:\n");
+    printf("========================================\n");
+    printf("Trials: %d, warmup discarded per trial: %d ms, context %s\n", num_runs,
+           config->warmup_ms, config->reuse_context ? "reused" : "rebuilt per trial");
+    printf("%-12s %-14s %-30s %s\n", "Metric", "Median", "Confidence Interval", "Coverage");
+    printf("========================================\n");
+
+    for (int m = 0; m < RUN_METRIC_COUNT; m++) {
+        for (int i = 0; i < num_runs; i++) {
+            values[i] = run_metric(&runs[i], (RunMetric)m);
+        }
+        double median = median_of(values, num_runs);  // Leaves values sorted
+        double low, high;
+        double coverage = median_confidence_interval(values, num_runs, TRIAL_CONFIDENCE,
+                                                     &low, &high);
+        char interval[64];
+        snprintf(interval, sizeof(interval), "[%.6g, %.6g]", low, high);
+        printf("%-12s %-14.6g %-30s %.1f%%\n", run_metric_names[m], median, interval,
+               100.0 * coverage);
+    }
+
+    printf("========================================\n");
+    if (num_runs < 6) {
+        printf("Note: %d trials cannot give %.0f%% coverage; the interval is the full range\n",
+               num_runs, 100.0 * TRIAL_CONFIDENCE);
+    }
+}
+
+// Remove a Unix domain socket left at path; anything else there is left
+// alone. Returns 0 if the path is now free, -1 if something else holds it.
+static int unlink_stale_socket(const char* path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EEXIST;
+        return -1;
+    }
+    return unlink(path);
+}
+
+// Open the exporter's listening socket: "unix:PATH" for a Unix domain socket,
+// otherwise a TCP port bound to loopback only
+int prometheus_listen(const char* address) {
+    int fd;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        const char* path = address + 5;
+        if (strlen(path) == 0 || strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Invalid Prometheus socket path: %s\n", path);
+            return -1;
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("Failed to create Prometheus socket");
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        // A socket left behind by an earlier run is replaced, never a regular file
+        if (unlink_stale_socket(path) != 0) {
+            fprintf(stderr, "Cannot use %s for the Prometheus socket: %s\n", path,
+                    errno == EEXIST ? "path exists and is not a socket" : strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            perror("Failed to bind Prometheus socket");
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr;
+        char* end;
+        long port = strtol(address, &end, 10);
+        if (end == address || *end != '\0' || port < 1 || port > 65535) {
+            fprintf(stderr, "Invalid Prometheus port: %s\n", address);
+            return -1;
+        }
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("Failed to create Prometheus socket");
+            return -1;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            perror("Failed to bind Prometheus port");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 8) != 0) {
+        perror("Failed to listen on Prometheus socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Close the listening socket and remove a Unix socket path
+void prometheus_close(int fd, const char* address) {
+    if (fd < 0) {
+        return;
+    }
+    close(fd);
+    if (strncmp(address, "unix:", 5) == 0) {
+        unlink_stale_socket(address + 5);
+    }
+}
+
+// Render a snapshot in the Prometheus text exposition format
+void prometheus_format(AppContext* ctx, const StatsSnapshot* snap, FILE* out) {
+    fprintf(out, "# HELP valiant_tasks_completed_total Tasks processed by all workers.\n");
+    fprintf(out, "# TYPE valiant_tasks_completed_total counter\n");
+    fprintf(out, "valiant_tasks_completed_total %ld\n", snap->total_completed);
+    fprintf(out, "# HELP valiant_tasks_failed_total Tasks that failed in all workers.\n");
+    fprintf(out, "# TYPE valiant_tasks_failed_total counter\n");
+    fprintf(out, "valiant_tasks_failed_total %ld\n", snap->total_failed);
+    fprintf(out, "# HELP valiant_queue_depth Tasks waiting in all queues.\n");
+    fprintf(out, "# TYPE valiant_queue_depth gauge\n");
+    fprintf(out, "valiant_queue_depth %d\n", snap->queue_depth);
+    fprintf(out, "# HELP valiant_queue_capacity Slots across all queues.\n");
+    fprintf(out, "# TYPE valiant_queue_capacity gauge\n");
+    fprintf(out, "valiant_queue_capacity %d\n", snap->queue_capacity);
+    fprintf(out, "# HELP valiant_active_workers Worker threads still running.\n");
+    fprintf(out, "# TYPE valiant_active_workers gauge\n");
+    fprintf(out, "valiant_active_workers %d\n", ctx->active_workers);
+    fprintf(out, "# HELP valiant_uptime_seconds Seconds since the run started.\n");
+    fprintf(out, "# TYPE valiant_uptime_seconds gauge\n");
+    fprintf(out, "valiant_uptime_seconds %.3f\n",
+            get_time_diff(&ctx->start_time, (struct timeval*)&snap->taken_at));
+
+    fprintf(out, "# HELP valiant_worker_tasks_completed_total Tasks processed per worker.\n");
+    fprintf(out, "# TYPE valiant_worker_tasks_completed_total counter\n");
+    for (int i = 0; i < ctx->num_threads; i++) {
+        fprintf(out, "valiant_worker_tasks_completed_total{worker=\"%d\",node=\"%d\"} %ld\n",
+                i, ctx->worker_nodes[i], snap->workers[i].tasks_completed);
+    }
+    fprintf(out, "# HELP valiant_worker_busy_seconds_total Time spent processing tasks per worker.\n");
+    fprintf(out, "# TYPE valiant_worker_busy_seconds_total counter\n");
+    for (int i = 0; i < ctx->num_threads; i++) {
+        fprintf(out, "valiant_worker_busy_seconds_total{worker=\"%d\",node=\"%d\"} %.6f\n",
+                i, ctx->worker_nodes[i], snap->workers[i].total_processing_time);
+    }
+    if (ctx->num_nodes > 1) {
+        fprintf(out, "# HELP valiant_worker_dequeues_total Dequeues per worker by queue locality.\n");
+        fprintf(out, "# TYPE valiant_worker_dequeues_total counter\n");
+        for (int i = 0; i < ctx->num_threads; i++) {
+            fprintf(out, "valiant_worker_dequeues_total{worker=\"%d\",locality=\"local\"} %ld\n",
+                    i, snap->workers[i].local_dequeues);
+            fprintf(out, "valiant_worker_dequeues_total{worker=\"%d\",locality=\"remote\"} %ld\n",
+                    i, snap->workers[i].remote_dequeues);
+        }
+    }
+
+    // Collapse the log-linear buckets to powers of two to keep scrapes small
+    fprintf(out, "# HELP valiant_task_latency_seconds Enqueue to completion latency.\n");
+    fprintf(out, "# TYPE valiant_task_latency_seconds histogram\n");
+    long cumulative = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        cumulative += snap->latency.buckets[i];
+        int boundary = i < LATENCY_LINEAR_BUCKETS ?
+                       i == LATENCY_LINEAR_BUCKETS - 1 :
+                       (i - LATENCY_LINEAR_BUCKETS) % LATENCY_SUB_BUCKETS == LATENCY_SUB_BUCKETS - 1;
+        if (boundary) {
+            fprintf(out, "valiant_task_latency_seconds_bucket{le=\"%.9g\"} %ld\n",
+                    latency_bucket_upper(i), cumulative);
+        }
+    }
+    fprintf(out, "valiant_task_latency_seconds_bucket{le=\"+Inf\"} %ld\n", snap->latency.count);
+    fprintf(out, "valiant_task_latency_seconds_sum %.6f\n", snap->latency.sum);
+    fprintf(out, "valiant_task_latency_seconds_count %ld\n", snap->latency.count);
+}
+
+// Serve one scrape per connection from stats snapshots; never blocks workers
+void* prometheus_thread(void* arg) {
+    AppContext* ctx = (AppContext*)arg;
+    StatsSnapshot* snap = (StatsSnapshot*)malloc(sizeof(StatsSnapshot));
+    if (!snap) {
+        perror("Failed to allocate exporter snapshot");
+        return NULL;
+    }
+
+    thread_usage_start(&ctx->exporter_usage);
+    if (ctx->logger) {
+        logger_register(ctx->logger);
+    }
+    log_printf("Prometheus exporter listening on %s\n", ctx->config->prometheus);
+
+    while (!shutdown_requested) {
+        struct pollfd pfd = {ctx->prometheus_fd, POLLIN, 0};
+        if (poll(&pfd, 1, PROMETHEUS_POLL_MS) <= 0) {
+            continue;
+        }
+
+        int client = accept(ctx->prometheus_fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+
+        // Any request gets the metrics page; drain what the client sent
+        char request[1024];
+        struct pollfd cfd = {client, POLLIN, 0};
+        if (poll(&cfd, 1, PROMETHEUS_POLL_MS) > 0) {
+            if (recv(client, request, sizeof(request), 0) < 0) {
+                close(client);
+                continue;
+            }
+        }
+
+        char* body = NULL;
+        size_t body_len = 0;
+        FILE* out = open_memstream(&body, &body_len);
+        if (out) {
+            stats_snapshot(ctx, snap);
+            prometheus_format(ctx, snap, out);
+            fclose(out);
+
+            char header[160];
+            int header_len = snprintf(header, sizeof(header),
+                                      "HTTP/1.0 200 OK\r\n"
+                                      "Content-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: %zu\r\n\r\n", body_len);
+            if (send(client, header, header_len, MSG_NOSIGNAL) == header_len) {
+                send(client, body, body_len, MSG_NOSIGNAL);
+            }
+            free(body);
+        }
+        close(client);
+    }
+
+    free(snap);
+    thread_usage_stop(&ctx->exporter_usage);
+    return NULL;
+}
+
+// Create the shared-memory stats segment and fill in the static fields
+ValiantShmStats* shm_stats_create(AppContext* ctx, const char* name) {
+    // A segment already under this name may still be mapped by a viewer or
+    // another instance; truncating it would pull the pages from under them.
+    // Unlinking leaves their object intact and gives this run a fresh one.
+    if (shm_unlink(name) != 0 && errno != ENOENT) {
+        perror("Failed to replace shared-memory segment");
+        return NULL;
+    }
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("Failed to create shared-memory segment");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(ValiantShmStats)) != 0) {
+        perror("Failed to size shared-memory segment");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    void* ptr = mmap(NULL, sizeof(ValiantShmStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        perror("Failed to map shared-memory segment");
+        shm_unlink(name);
+        return NULL;
+    }
+
+    ValiantShmStats* shm = (ValiantShmStats*)ptr;
+    shm->version = VALIANT_SHM_VERSION;
+    shm->size = sizeof(ValiantShmStats);
+    shm->pid = getpid();
+    shm->state = VALIANT_STATE_RUNNING;
+    shm->num_workers = ctx->num_threads;
+    shm->num_nodes = ctx->num_nodes;
+    shm->queue_capacity = ctx->task_queue->capacity * ctx->num_nodes;
+    for (int i = 0; i < ctx->num_threads; i++) {
+        shm->workers[i].node = ctx->worker_nodes[i];
+    }
+
+    // Viewers check the magic last, so a half-initialised segment is rejected
+    __atomic_store_n(&shm->magic, VALIANT_SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+// Publish one monitor interval (monitor thread only)
+void shm_stats_publish(AppContext* ctx, const StatsSnapshot* prev, const StatsSnapshot* curr,
+                       const IntervalStats* interval) {
+    ValiantShmStats* shm = ctx->shm;
+
+    valiant_shm_write_begin(shm);
+    shm->elapsed = interval->elapsed;
+    shm->queue_depth = curr->queue_depth;
+    shm->active_workers = ctx->active_workers;
+    shm->total_completed = curr->total_completed;
+    shm->total_failed = curr->total_failed;
+    shm->throughput = interval->throughput;
+    shm->latency_p50 = interval->latency_p50;
+    shm->latency_p90 = interval->latency_p90;
+    shm->latency_p99 = interval->latency_p99;
+    shm->latency_max = interval->latency_max;
+    for (int i = 0; i < ctx->num_threads; i++) {
+        const WorkerStats* stats = &curr->workers[i];
+        double busy = stats->total_processing_time - prev->workers[i].total_processing_time;
+        shm->workers[i].tasks_completed = stats->tasks_completed;
+        shm->workers[i].tasks_failed = stats->tasks_failed;
+        shm->workers[i].busy_seconds = stats->total_processing_time;
+        shm->workers[i].utilization = interval->duration > 0 ? busy / interval->duration : 0.0;
+    }
+    valiant_shm_write_end(shm);
+}
+
+// Publish the final totals and tell viewers the run is over
+void shm_stats_finish(AppContext* ctx) {
+    ValiantShmStats* shm = ctx->shm;
+    StatsSnapshot* snap = (StatsSnapshot*)malloc(sizeof(StatsSnapshot));
+    if (!snap) {
+        perror("Failed to allocate final snapshot");
+        return;
+    }
+    stats_snapshot(ctx, snap);
+
+    valiant_shm_write_begin(shm);
+    shm->state = VALIANT_STATE_FINISHED;
+    shm->elapsed = get_time_diff(&ctx->start_time, &snap->taken_at);
+    shm->queue_depth = snap->queue_depth;
+    shm->active_workers = 0;
+    shm->total_completed = snap->total_completed;
+    shm->total_failed = snap->total_failed;
+    shm->throughput = 0.0;
+    for (int i = 0; i < ctx->num_threads; i++) {
+        shm->workers[i].tasks_completed = snap->workers[i].tasks_completed;
+        shm->workers[i].tasks_failed = snap->workers[i].tasks_failed;
+        shm->workers[i].busy_seconds = snap->workers[i].total_processing_time;
+        shm->workers[i].utilization = 0.0;
+    }
+    valiant_shm_write_end(shm);
+
+    free(snap);
+}
+
+// Unmap and remove the segment; attached viewers keep their mapping
+void shm_stats_destroy(ValiantShmStats* shm, const char* name) {
+    if (shm) {
+        munmap(shm, sizeof(ValiantShmStats));
+        shm_unlink(name);
+    }
+}
+
+// Open one counter for the calling thread
+static int perf_open_counter(uint32_t type, uint64_t config, int exclude_kernel) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Open every counter for the calling worker; missing ones stay at -1
+void perf_counters_open(WorkerPerf* perf) {
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+        int exclude_kernel;
+    } events[PERF_COUNTER_COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 1},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 1},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 1},
+        // Switches happen in the kernel; excluding it would always count zero
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 0},
+    };
+
+    perf->error = 0;
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        perf->fds[c] = perf_open_counter(events[c].type, events[c].config,
+                                         events[c].exclude_kernel);
+        if (perf->fds[c] < 0 && perf->error == 0) {
+            perf->error = errno;
+        }
+    }
+    ANNOTATE_HAPPENS_BEFORE(&perf->ready);
+    perf->ready.store(1, std::memory_order_release);
+}
+
+// Read a worker's counters; safe from any thread once the worker opened them
+void perf_counters_read(WorkerPerf* perf, PerfSample* out) {
+    memset(out, 0, sizeof(PerfSample));
+    if (!perf->ready.load(std::memory_order_acquire)) {
+        return;
+    }
+    ANNOTATE_HAPPENS_AFTER(&perf->ready);
+
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        uint64_t data[3];  // value, time enabled, time running
+        if (perf->fds[c] < 0 || read(perf->fds[c], data, sizeof(data)) != sizeof(data)) {
+            continue;
+        }
+        out->values[c] = data[2] > 0 ? (double)data[0] * data[1] / data[2] : 0.0;
+        out->available |= 1u << c;
+    }
+}
+
+// Close a worker's counters
+void perf_counters_close(WorkerPerf* perf) {
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        if (perf->fds[c] >= 0) {
+            close(perf->fds[c]);
+            perf->fds[c] = -1;
+        }
+    }
+}
+
+// Read every worker's counters; returns the counters available for all of them
+unsigned perf_snapshot(AppContext* ctx, PerfSample* samples) {
+    unsigned available = (1u << PERF_COUNTER_COUNT) - 1;
+    for (int i = 0; i < ctx->num_threads; i++) {
+        perf_counters_read(&ctx->worker_perf[i], &samples[i]);
+        available &= samples[i].available;
+    }
+    return available;
+}
+
+// Describe counter deltas as IPC and per-task rates, "n/a" where unavailable
+void perf_format(char* buffer, size_t size, const PerfSample* delta, long tasks, double seconds) {
+    char ipc[32], llc[32], branch[32], switches[32];
+    unsigned available = delta->available;
+
+    snprintf(ipc, sizeof(ipc), "n/a");
+    snprintf(llc, sizeof(llc), "n/a");
+    snprintf(branch, sizeof(branch), "n/a");
+    snprintf(switches, sizeof(switches), "n/a");
+
+    if ((available & (1u << PERF_CYCLES)) && (available & (1u << PERF_INSTRUCTIONS)) &&
+        delta->values[PERF_CYCLES] > 0) {
+        snprintf(ipc, sizeof(ipc), "%.2f",
+                 delta->values[PERF_INSTRUCTIONS] / delta->values[PERF_CYCLES]);
+    }
+    if ((available & (1u << PERF_LLC_MISSES)) && tasks > 0) {
+        snprintf(llc, sizeof(llc), "%.1f", delta->values[PERF_LLC_MISSES] / tasks);
+    }
+    if ((available & (1u << PERF_BRANCH_MISSES)) && tasks > 0) {
+        snprintf(branch, sizeof(branch), "%.1f", delta->values[PERF_BRANCH_MISSES] / tasks);
+    }
+    if ((available & (1u << PERF_CONTEXT_SWITCHES)) && seconds > 0) {
+        snprintf(switches, sizeof(switches), "%.1f",
+                 delta->values[PERF_CONTEXT_SWITCHES] / seconds);
+    }
+
+    snprintf(buffer, size, "IPC %s, LLC misses/task %s, branch misses/task %s, "
+             "context switches/s %s", ipc, llc, branch, switches);
+}
+
+// CPU time consumed by the calling thread, in seconds
+double thread_cpu_time(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0.0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Note when the calling thread started
+void thread_usage_start(ThreadUsage* usage) {
+    memset(usage, 0, sizeof(ThreadUsage));
+    gettimeofday(&usage->started, NULL);
+}
+
+// Record the calling thread's CPU time and context switches; call just
+// before the thread returns
+void thread_usage_stop(ThreadUsage* usage) {
+    struct timeval now;
+    struct rusage ru;
+
+    gettimeofday(&now, NULL);
+    usage->wall_time = get_time_diff(&usage->started, &now);
+    usage->cpu_time = thread_cpu_time();
+    if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+        usage->voluntary_switches = ru.ru_nvcsw;
+        usage->involuntary_switches = ru.ru_nivcsw;
+    }
+    usage->recorded = 1;
+}
+
+// Print one row of the CPU usage table
+static void print_usage_row(const char* label, const ThreadUsage* usage) {
+    if (!usage->recorded) {
+        return;
+    }
+    double wall = usage->wall_time > 0 ? usage->wall_time : 1.0;
+    printf("%-12s %-10.4f %-10.4f %-8.1f %-12.1f %-12.1f\n",
+           label, usage->cpu_time, usage->wall_time, 100.0 * usage->cpu_time / wall,
+           usage->voluntary_switches / wall, usage->involuntary_switches / wall);
+}
+
+// Print per-thread CPU cost, so backends can be compared on efficiency
+void print_thread_usage(AppContext* ctx, const StatsSnapshot* snap) {
+    double worker_cpu = 0.0;
+    double busy_cpu = 0.0;
+    double total_cpu = 0.0;
+    char label[32];
+
+    printf("\nCPU Usage:\n");
+    printf("========================================\n");
+    printf("%-12s %-10s %-10s %-8s %-12s %-12s\n",
+           "Thread", "CPU (s)", "Wall (s)", "CPU %", "Vol Sw/s", "Invol Sw/s");
+    printf("========================================\n");
+
+    for (int i = 0; i < ctx->num_threads; i++) {
+        snprintf(label, sizeof(label), "worker %d", i);
+        print_usage_row(label, &ctx->worker_usage[i]);
+        worker_cpu += ctx->worker_usage[i].cpu_time;
+        busy_cpu += snap->workers[i].busy_cpu_time;
+    }
+    total_cpu = worker_cpu;
+    for (int i = 0; i < ctx->num_producers; i++) {
+        snprintf(label, sizeof(label), "producer %d", i);
+        print_usage_row(label, &ctx->producers[i].usage);
+        total_cpu += ctx->producers[i].usage.cpu_time;
+    }
+    print_usage_row("monitor", &ctx->monitor_usage);
+    print_usage_row("stress", &ctx->stress_usage);
+    print_usage_row("exporter", &ctx->exporter_usage);
+    total_cpu += ctx->monitor_usage.cpu_time + ctx->stress_usage.cpu_time +
+                 ctx->exporter_usage.cpu_time;
+
+    // Anything a worker burned outside a task went to queue handling and waits
+    double idle_cpu = worker_cpu > busy_cpu ? worker_cpu - busy_cpu : 0.0;
+    printf("========================================\n");
+    printf("CPU-seconds per 1000 tasks: %.4f (workers), %.4f (all threads)\n",
+           snap->total_completed > 0 ? 1000.0 * worker_cpu / snap->total_completed : 0.0,
+           snap->total_completed > 0 ? 1000.0 * total_cpu / snap->total_completed : 0.0);
+    printf("Worker CPU outside tasks: %.4f seconds (%.1f%% of worker CPU)\n",
+           idle_cpu, worker_cpu > 0 ? 100.0 * idle_cpu / worker_cpu : 0.0);
+}
+
+// Create an empty trace log; rings are allocated by the threads themselves
+TraceLog* trace_create(int sample_every) {
+    TraceLog* trace = (TraceLog*)calloc(1, sizeof(TraceLog));
+    if (!trace) {
+        perror("Failed to allocate trace log");
+        return NULL;
+    }
+    trace->num_rings.store(0, std::memory_order_relaxed);
+    trace->sample_every = sample_every;
+    clock_gettime(CLOCK_MONOTONIC, &trace->origin);
+    return trace;
+}
+
+// Free a trace log and every ring in it
+void trace_destroy(TraceLog* trace) {
+    if (trace) {
+        int count = trace->num_rings.load(std::memory_order_relaxed);
+        for (int i = 0; i < count && i < TRACE_MAX_THREADS; i++) {
+            free(trace->rings[i].events);
+        }
+        free(trace);
+    }
+}
+
+// Give the calling thread a ring of its own; events are dropped if none is left
+void trace_register(AppContext* ctx, const char* name) {
+    int index = ctx->trace->num_rings.fetch_add(1, std::memory_order_relaxed);
+    if (index >= TRACE_MAX_THREADS) {
+        return;
+    }
+
+    TraceRing* ring = &ctx->trace->rings[index];
+    ring->events = (TraceEvent*)malloc(TRACE_RING_EVENTS * sizeof(TraceEvent));
+    if (!ring->events) {
+        perror("Failed to allocate trace ring");
+        return;
+    }
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    trace_current = ring;
+}
+
+// Record an event for the calling thread; a no-op unless it is tracing
+void trace_record(TraceEventType type, int task_id) {
+    TraceRing* ring = trace_current;
+    if (!ring) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    TraceEvent* event = &ring->events[ring->written % TRACE_RING_EVENTS];
+    event->timestamp_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    event->type = type;
+    event->task_id = task_id;
+    ring->written++;
+}
+
+// Whether this task's lifecycle should be traced
+int trace_sampled(AppContext* ctx, int task_id) {
+    return ctx->trace && task_id % ctx->trace->sample_every == 0;
+}
+
+// Write every ring as Chrome Trace Event JSON (loadable in Perfetto)
+int trace_write_json(TraceLog* trace, const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+
+    uint64_t origin = (uint64_t)trace->origin.tv_sec * 1000000000ull + trace->origin.tv_nsec;
+    int pid = getpid();
+    int count = trace->num_rings.load(std::memory_order_acquire);
+    long dropped = 0;
+    long total = 0;
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                 "\"args\":{\"name\":\"threads\"}}", pid);
+
+    for (int tid = 0; tid < count && tid < TRACE_MAX_THREADS; tid++) {
+        TraceRing* ring = &trace->rings[tid];
+        if (!ring->events) {
+            continue;
+        }
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                     "\"args\":{\"name\":\"%s\"}}", pid, tid, ring->name);
+
+        long first = ring->written > TRACE_RING_EVENTS ? ring->written - TRACE_RING_EVENTS : 0;
+        dropped += first;
+        total += ring->written - first;
+
+        // Ends whose begin was overwritten would confuse the viewer
+        int work_open = 0;
+        int wait_open = 0;
+        for (long i = first; i < ring->written; i++) {
+            const TraceEvent* event = &ring->events[i % TRACE_RING_EVENTS];
+            double ts = (event->timestamp_ns - origin) / 1000.0;
+
+            switch (event->type) {
+                case TRACE_ENQUEUE:
+                    fprintf(out, ",\n{\"name\":\"enqueue\",\"cat\":\"task\",\"ph\":\"i\","
+                                 "\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                                 "\"args\":{\"task\":%d}}", ts, pid, tid, event->task_id);
+                    fprintf(out, ",\n{\"name\":\"task\",\"cat\":\"flow\",\"ph\":\"s\","
+                                 "\"id\":%d,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                            event->task_id, ts, pid, tid);
+                    break;
+                case TRACE_DEQUEUE:
+                    fprintf(out, ",\n{\"name\":\"dequeue\",\"cat\":\"task\",\"ph\":\"i\","
+                                 "\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                                 "\"args\":{\"task\":%d}}", ts, pid, tid, event->task_id);
+                    fprintf(out, ",\n{\"name\":\"task\",\"cat\":\"flow\",\"ph\":\"f\","
+                                 "\"bp\":\"e\",\"id\":%d,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                            event->task_id, ts, pid, tid);
+                    break;
+                case TRACE_WORK_BEGIN:
+                    work_open = 1;
+                    fprintf(out, ",\n{\"name\":\"task %d\",\"cat\":\"work\",\"ph\":\"B\","
+                                 "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                            event->task_id, ts, pid, tid);
+                    break;
+                case TRACE_WORK_END:
+                    if (work_open) {
+                        work_open = 0;
+                        fprintf(out, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                                ts, pid, tid);
+                    }
+                    break;
+                case TRACE_WAIT_NOT_FULL_BEGIN:
+                case TRACE_WAIT_NOT_EMPTY_BEGIN:
+                    wait_open = 1;
+                    fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"wait\",\"ph\":\"B\","
+                                 "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                            event->type == TRACE_WAIT_NOT_FULL_BEGIN ?
+                            "wait not_full" : "wait not_empty", ts, pid, tid);
+                    break;
+                case TRACE_WAIT_NOT_FULL_END:
+                case TRACE_WAIT_NOT_EMPTY_END:
+                    if (wait_open) {
+                        wait_open = 0;
+                        fprintf(out, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                                ts, pid, tid);
+                    }
+                    break;
+            }
+        }
+    }
+
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"sample_every\":%d,"
+                 "\"recorded_events\":%ld,\"dropped_events\":%ld}}\n",
+            trace->sample_every, total, dropped);
+    fclose(out);
+
+    printf("Trace written to %s (%ld events, %ld overwritten)\n", path, total, dropped);
+    return 0;
+}
+
+#if LOCK_PROFILING
+// Print one row of the lock table
+static void print_lock_row(const ProfiledMutex* mutex) {
+    printf("%-14s %-12ld %-12ld %-8.1f %-12.6f %-14.2f %-14.2f\n",
+           mutex->name, mutex->acquisitions, mutex->contended,
+           mutex->acquisitions > 0 ? 100.0 * mutex->contended / mutex->acquisitions : 0.0,
+           mutex->wait_time,
+           mutex->contended > 0 ? 1e6 * mutex->wait_time / mutex->contended : 0.0,
+           1e6 * mutex->max_hold_time);
+}
+
+// One row for all the per-key mailbox locks, which can number in the thousands
+static void print_key_lock_row(AppContext* ctx) {
+    ProfiledMutex keys;
+    
+    memset(&keys, 0, sizeof(keys));
+    snprintf(keys.name, sizeof(keys.name), "key[0-%d]", ctx->num_keys - 1);
+    for (int i = 0; i < ctx->num_keys; i++) {
+        const ProfiledMutex* lock = &ctx->mailboxes[i].lock;
+        keys.acquisitions += lock->acquisitions;
+        keys.contended += lock->contended;
+        keys.wait_time += lock->wait_time;
+        if (lock->max_hold_time > keys.max_hold_time) {
+            keys.max_hold_time = lock->max_hold_time;
+        }
+    }
+    print_lock_row(&keys);
+}
+#endif
+
+// Print contention figures for every profiled lock; call once threads are joined
+void print_lock_statistics(AppContext* ctx) {
+#if LOCK_PROFILING
+    printf("\nLock Contention:\n");
+    printf("========================================\n");
+    printf("%-14s %-12s %-12s %-8s %-12s %-14s %-14s\n", "Lock", "Acquired", "Contended",
+           "Cont %", "Wait (s)", "Avg Wait (us)", "Max Hold (us)");
+    printf("========================================\n");
+    for (int i = 0; i < ctx->num_nodes; i++) {
+        print_lock_row(&ctx->node_queues[i]->lock);
+        if (ctx->node_pools) {
+            print_lock_row(&ctx->node_pools[i]->lock);
+        }
+    }
+    for (int s = 1; s < ctx->num_stages; s++) {
+        print_lock_row(&ctx->stage_queues[s]->lock);
+    }
+    print_lock_row(&ctx->stats_lock);
+    print_lock_row(&ctx->shutdown_lock);
+    print_lock_row(&ctx->fork_lock);
+    print_lock_row(&ctx->request_lock);
+    if (ctx->key_backlog) {
+        print_lock_row(&ctx->key_backlog->lock);
+        print_key_lock_row(ctx);
+    }
+    printf("========================================\n");
+#else
+    (void)ctx;
+#endif
+}
+
+// Create a logger writing to fd; rings are allocated as threads register
+AsyncLogger* logger_create(int fd) {
+    AsyncLogger* logger = (AsyncLogger*)calloc(1, sizeof(AsyncLogger));
+    if (!logger) {
+        perror("Failed to allocate logger");
+        return NULL;
+    }
+    logger->num_rings.store(0, std::memory_order_relaxed);
+    logger->stop.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < LOG_MAX_RINGS; i++) {
+        logger->rings[i].ready.store(0, std::memory_order_relaxed);
+    }
+    logger->fd = fd;
+    return logger;
+}
+
+// Start the writer thread
+int logger_start(AsyncLogger* logger, int cpu) {
+    if (create_thread_on_cpu(&logger->thread, cpu, logger_thread, logger) != 0) {
+        perror("Failed to create logger thread");
+        return -1;
+    }
+    return 0;
+}
+
+// Give the calling thread a ring; without one it prints directly
+void logger_register(AsyncLogger* logger) {
+    int index = logger->num_rings.load(std::memory_order_relaxed);
+    do {
+        if (index >= LOG_MAX_RINGS) {
+            return;
+        }
+    } while (!logger->num_rings.compare_exchange_weak(index, index + 1,
+                                                      std::memory_order_relaxed));
+
+    LogRing* ring = &logger->rings[index];
+    ring->data = (char*)malloc(LOG_RING_BYTES);
+    if (!ring->data) {
+        perror("Failed to allocate log ring");
+        return;
+    }
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->dropped.store(0, std::memory_order_relaxed);
+    ANNOTATE_HAPPENS_BEFORE(&ring->ready);
+    ring->ready.store(1, std::memory_order_release);
+    log_current = ring;
+}
+
+// Copy into the ring at a free-running position, wrapping at the end
+static void log_ring_write(LogRing* ring, size_t pos, const void* src, size_t len) {
+    size_t offset = pos & (LOG_RING_BYTES - 1);
+    size_t first = len < LOG_RING_BYTES - offset ? len : LOG_RING_BYTES - offset;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char*)src + first, len - first);
+}
+
+// Format a message into the calling thread's ring. Never blocks: when the
+// ring is full the message is counted as dropped.
+void log_printf(const char* format, ...) {
+    va_list args;
+    LogRing* ring = log_current;
+
+    va_start(args, format);
+    if (!ring || !ring->data) {
+        vfprintf(log_direct_stream ? log_direct_stream : stdout, format, args);
+        va_end(args);
+        return;
+    }
+
+    char message[LOG_MESSAGE_MAX];
+    int length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (length <= 0) {
+        return;
+    }
+    uint32_t len = length < LOG_MESSAGE_MAX ? (uint32_t)length : LOG_MESSAGE_MAX - 1;
+
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    size_t tail = ring->tail.load(std::memory_order_acquire);
+    ANNOTATE_HAPPENS_AFTER(&ring->tail);
+    if (LOG_RING_BYTES - (head - tail) < sizeof(len) + len) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    log_ring_write(ring, head, &len, sizeof(len));
+    log_ring_write(ring, head + sizeof(len), message, len);
+    ANNOTATE_HAPPENS_BEFORE(&ring->head);
+    ring->head.store(head + sizeof(len) + len, std::memory_order_release);
+}
+
+// writev that keeps going after short writes
+static void log_writev_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;  // Nowhere to report it; the output is gone
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// Write out everything currently in the rings; returns the bytes written
+static size_t logger_drain(AsyncLogger* logger) {
+    struct iovec iov[LOG_BATCH_IOVECS];
+    size_t tails[LOG_MAX_RINGS];
+    int ready[LOG_MAX_RINGS];
+    size_t total = 0;
+    int rings = logger->num_rings.load(std::memory_order_acquire);
+    if (rings > LOG_MAX_RINGS) {
+        rings = LOG_MAX_RINGS;
+    }
+
+    for (;;) {
+        int count = 0;
+        size_t batch = 0;
+
+        // Gather whole records from each ring in turn until the batch is full
+        for (int i = 0; i < rings; i++) {
+            LogRing* ring = &logger->rings[i];
+            ready[i] = ring->ready.load(std::memory_order_acquire);
+            if (!ready[i]) {
+                continue;  // Slot claimed but not yet initialised
+            }
+            ANNOTATE_HAPPENS_AFTER(&ring->ready);
+            size_t tail = ring->tail.load(std::memory_order_relaxed);
+            size_t head = ring->head.load(std::memory_order_acquire);
+            ANNOTATE_HAPPENS_AFTER(&ring->head);
+            while (tail != head && count + 2 <= LOG_BATCH_IOVECS) {
+                uint32_t len;
+                size_t offset = tail & (LOG_RING_BYTES - 1);
+                size_t first = sizeof(len) < LOG_RING_BYTES - offset ?
+                               sizeof(len) : LOG_RING_BYTES - offset;
+                memcpy(&len, ring->data + offset, first);
+                memcpy((char*)&len + first, ring->data, sizeof(len) - first);
+
+                size_t start = (tail + sizeof(len)) & (LOG_RING_BYTES - 1);
+                size_t contiguous = len < LOG_RING_BYTES - start ? len : LOG_RING_BYTES - start;
+                iov[count].iov_base = ring->data + start;
+                iov[count++].iov_len = contiguous;
+                if (contiguous < len) {
+                    iov[count].iov_base = ring->data;
+                    iov[count++].iov_len = len - contiguous;
+                }
+                tail += sizeof(len) + len;
+                batch += len;
+            }
+            tails[i] = tail;
+        }
+
+        if (count == 0) {
+            return total;
+        }
+        log_writev_all(logger->fd, iov, count);
+        total += batch;
+
+        // Only now may producers reuse the space
+        for (int i = 0; i < rings; i++) {
+            if (ready[i]) {
+                ANNOTATE_HAPPENS_BEFORE(&logger->rings[i].tail);
+                logger->rings[i].tail.store(tails[i], std::memory_order_release);
+            }
+        }
+    }
+}
+
+// Writer thread: drain the rings, sleeping briefly when they are empty
+void* logger_thread(void* arg) {
+    AsyncLogger* logger = (AsyncLogger*)arg;
+
+    while (!logger->stop.load(std::memory_order_acquire)) {
+        if (logger_drain(logger) == 0) {
+            usleep(LOG_IDLE_US);
+        }
+    }
+    logger_drain(logger);
+    return NULL;
+}
+
+// Flush and stop the writer; call after every other logging thread has been
+// joined. The calling thread goes back to printing directly. Returns the
+// number of dropped messages.
+long logger_stop(AsyncLogger* logger) {
+    long dropped = 0;
+
+    logger->stop.store(1, std::memory_order_release);
+    pthread_join(logger->thread, NULL);
+    log_current = NULL;
+
+    int rings = logger->num_rings.load(std::memory_order_relaxed);
+    for (int i = 0; i < rings && i < LOG_MAX_RINGS; i++) {
+        dropped += logger->rings[i].dropped.load(std::memory_order_relaxed);
+    }
+    return dropped;
+}
+
+// Free the logger and its rings
+void logger_destroy(AsyncLogger* logger) {
+    if (logger) {
+        int rings = logger->num_rings.load(std::memory_order_relaxed);
+        for (int i = 0; i < rings && i < LOG_MAX_RINGS; i++) {
+            free(logger->rings[i].data);
+        }
+        free(logger);
+    }
+}
+
+// Per-stage load of a pipeline run. Utilization is the busy fraction of the
+// stage's workers; time blocked on a full downstream queue is not busy, so
+// the stage with the highest utilization is the one holding the others back.
+void print_stage_statistics(AppContext* ctx, const StatsSnapshot* snap, double total_time) {
+    int bottleneck = -1;
+    double highest = -1.0;
+    
+    if (ctx->num_stages == 0) {
+        return;
+    }
+    
+    printf("\nPipeline Stages:\n");
+    printf("========================================\n");
+    printf("%-6s %-12s %-8s %-14s %-10s %-12s %-12s %-12s %-8s\n", "Stage", "Name", "Workers",
+           "Work", "Tasks", "Busy (s)", "Blocked (s)", "Utilization", "Queue");
+    printf("========================================\n");
+    
+    for (int s = 0; s < ctx->num_stages; s++) {
+        const StageSpec* stage = &ctx->config->stages[s];
+        long handled = 0;
+        double busy = 0.0;
+        double blocked = 0.0;
+        char spec[48];
+        
+        for (int i = 0; i < ctx->num_threads; i++) {
+            if (ctx->worker_stages[i] == s) {
+                const WorkerStats* stats = &snap->workers[i];
+                handled += stats->tasks_completed + stats->tasks_forwarded;
+                busy += stats->total_processing_time;
+                blocked += stats->downstream_blocked;
+            }
+        }
+        double utilization = total_time > 0 ? busy / (total_time * stage->workers) : 0.0;
+        if (utilization > highest) {
+            highest = utilization;
+            bottleneck = s;
+        }
+        
+        // The work column is the spec without its name and worker count
+        format_stage_spec(stage, spec, sizeof(spec));
+        const char* work = strchr(strchr(spec, ':') + 1, ':') + 1;
+        printf("%-6d %-12s %-8d %-14s %-10ld %-12.3f %-12.3f %-12.1f %d/%d\n", s, stage->name,
+               stage->workers, work, handled, busy, blocked, 100.0 * utilization,
+               queue_depth(ctx->stage_queues[s]), ctx->stage_queues[s]->capacity);
+    }
+    
+    printf("========================================\n");
+    printf("Bottleneck: stage %d (%s), %.1f%% utilized\n", bottleneck,
+           ctx->config->stages[bottleneck].name, 100.0 * highest);
+}
+
+// Critical path of the DAG from the measured node times against the makespan
+// the pool achieved. No schedule on P workers beats max(critical path,
+// total work / P), so the ratio to that bound is the scheduling efficiency.
+void print_dag_statistics(AppContext* ctx) {
+    Dag* dag = ctx->dag;
+    char spec[96];
+    
+    if (!dag) {
+        return;
+    }
+    
+    format_dag_spec(&ctx->config->dag, spec, sizeof(spec));
+    printf("\nDAG Schedule (%s):\n", spec);
+    printf("========================================\n");
+    printf("Nodes: %d, Edges: %d, Workers: %d\n", dag->num_nodes, dag->num_edges,
+           ctx->num_threads);
+    
+    int remaining = dag->remaining.load(std::memory_order_acquire);
+    if (remaining > 0) {
+        printf("Incomplete: %d of %d nodes finished before the run ended\n",
+               dag->num_nodes - remaining, dag->num_nodes);
+        printf("========================================\n");
+        return;
+    }
+    
+    // IDs are topological, so one forward pass finds the longest path
+    double* longest = (double*)calloc(dag->num_nodes, sizeof(double));
+    int* length = (int*)calloc(dag->num_nodes, sizeof(int));
+    if (!longest || !length) {
+        perror("Failed to allocate critical path");
+        free(longest);
+        free(length);
+        return;
+    }
+    double work = 0.0;
+    double critical = 0.0;
+    int critical_nodes = 0;
+    for (int id = 0; id < dag->num_nodes; id++) {
+        const DagNode* node = &dag->nodes[id];
+        double duration = node->finished - node->started;
+        
+        work += duration;
+        longest[id] += duration;
+        length[id]++;
+        if (longest[id] > critical) {
+            critical = longest[id];
+            critical_nodes = length[id];
+        }
+        for (int i = 0; i < node->num_successors; i++) {
+            int successor = dag->successors[node->first_successor + i];
+            if (longest[id] > longest[successor]) {
+                longest[successor] = longest[id];
+                length[successor] = length[id];
+            }
+        }
+    }
+    free(longest);
+    free(length);
+    
+    double bound = work / ctx->num_threads > critical ? work / ctx->num_threads : critical;
+    long inlined = dag->inlined.load(std::memory_order_relaxed);
+    long queued = dag->queued.load(std::memory_order_relaxed);
+    printf("Total Work: %.4f seconds\n", work);
+    printf("Critical Path: %.4f seconds over %d nodes\n", critical, critical_nodes);
+    printf("Makespan: %.4f seconds\n", dag->makespan);
+    printf("Lower Bound max(critical path, work/%d): %.4f seconds, efficiency %.1f%%\n",
+           ctx->num_threads, bound, dag->makespan > 0 ? 100.0 * bound / dag->makespan : 0.0);
+    printf("Released Successors: %ld run inline, %ld queued (%.1f%% inline)\n", inlined, queued,
+           inlined + queued > 0 ? 100.0 * inlined / (inlined + queued) : 0.0);
+    printf("========================================\n");
+}
+
+// Cost of delivering results through futures, and request latency in
+// --requests mode
+void print_future_statistics(AppContext* ctx, double total_time) {
+    FutureStats* futures = ctx->futures;
+    long completed = futures->completed.load(std::memory_order_relaxed);
+    long abandoned = futures->abandoned.load(std::memory_order_relaxed);
+    long scheduled = futures->scheduled.load(std::memory_order_relaxed);
+    long fallbacks = futures->fallbacks.load(std::memory_order_relaxed);
+    long delivered = futures->delivered.load(std::memory_order_relaxed);
+    long requests = futures->requests.load(std::memory_order_relaxed);
+    
+    if (completed + abandoned == 0) {
+        return;
+    }
+    
+    printf("\nFutures:\n");
+    printf("========================================\n");
+    printf("Completed: %ld (%ld values stored inline, %ld on the heap), %ld abandoned\n",
+           completed, futures->inline_values.load(std::memory_order_relaxed),
+           futures->heap_values.load(std::memory_order_relaxed), abandoned);
+    printf("Continuations: %ld run on the pool, %ld by the completing thread (queue full)\n",
+           scheduled, fallbacks);
+    if (delivered > 0) {
+        printf("Result Delivery: avg %.1f us, max %.1f us (input complete to continuation start)\n",
+               futures->delivery_ns.load(std::memory_order_relaxed) / 1e3 / delivered,
+               futures->max_delivery_ns.load(std::memory_order_relaxed) / 1e3);
+    }
+    if (ctx->config->request_fanout > 0) {
+        printf("Requests: %ld answered from %d parts each, %.2f requests/second\n", requests,
+               ctx->config->request_fanout, total_time > 0 ? requests / total_time : 0.0);
+        printf("Request Latency p50/p90/p99/max: %.6f/%.6f/%.6f/%.6f seconds\n",
+               histogram_percentile(&ctx->request_latency, 50.0),
+               histogram_percentile(&ctx->request_latency, 90.0),
+               histogram_percentile(&ctx->request_latency, 99.0), ctx->request_latency.max);
+    }
+    printf("========================================\n");
+}
+
+// Sum the mailbox counters of every key; safe while keyed tasks are running
+void key_totals(AppContext* ctx, KeyTotals* totals) {
+    memset(totals, 0, sizeof(KeyTotals));
+    for (int i = 0; i < ctx->num_keys; i++) {
+        KeyMailbox* mailbox = &ctx->mailboxes[i];
+        profiled_mutex_lock(&mailbox->lock);
+        totals->executed += mailbox->executed;
+        totals->inlined += mailbox->inlined;
+        totals->requeued += mailbox->requeued;
+        totals->violations += mailbox->violations;
+        totals->used += mailbox->executed > 0;
+        if (mailbox->executed > totals->busiest) {
+            totals->busiest = mailbox->executed;
+        }
+        if (mailbox->max_backlog > totals->max_backlog) {
+            totals->max_backlog = mailbox->max_backlog;
+        }
+        profiled_mutex_unlock(&mailbox->lock);
+    }
+}
+
+// How keyed tasks were handed between workers, and whether any ran out of order
+void print_key_statistics(AppContext* ctx) {
+    KeyTotals totals;
+    
+    if (!ctx->mailboxes) {
+        return;
+    }
+    key_totals(ctx, &totals);
+    
+    printf("\nKeyed Execution:\n");
+    printf("========================================\n");
+    printf("Keys: %d (%d used), busiest key ran %.1f%% of tasks\n", ctx->num_keys, totals.used,
+           totals.executed > 0 ? 100.0 * totals.busiest / totals.executed : 0.0);
+    printf("Tasks: %ld, %ld handed on by the previous task's worker, %ld requeued after %d in a row\n",
+           totals.executed, totals.inlined, totals.requeued, KEY_MAILBOX_BATCH);
+    printf("Max Mailbox Backlog: %d tasks\n", totals.max_backlog);
+    printf("Order Violations: %ld\n", totals.violations);
+    printf("========================================\n");
+}
+
+// Format a recovery time, or "-" if the system never recovered
+static void format_recovery(double seconds, char* buffer, size_t size) {
+    if (seconds < 0) {
+        snprintf(buffer, size, "-");
+    } else {
+        snprintf(buffer, size, "%.3f", seconds);
+    }
+}
+
+// Queue depth and latency recovery after each burst of stress load
+void print_burst_statistics(AppContext* ctx) {
+    const BurstProfile* burst = &ctx->config->burst;
+    double depth_times[BURST_MAX_RECORDS];
+    double latency_times[BURST_MAX_RECORDS];
+    int depth_recovered = 0;
+    int latency_recovered = 0;
+    char profile[96];
+    
+    if (burst->shape == BURST_NONE) {
+        return;
+    }
+    
+    format_burst_profile(burst, profile, sizeof(profile));
+    printf("\nBurst Recovery (%s):\n", profile);
+    printf("========================================\n");
+    printf("%-6s %-10s %-7s %-17s %-12s %-21s %-12s\n", "Burst", "Start (s)", "Tasks",
+           "Depth Ref/Peak", "Depth Rec", "p99 Ref/Peak (s)", "Latency Rec");
+    printf("========================================\n");
+    
+    for (int i = 0; i < ctx->num_bursts; i++) {
+        const BurstRecord* record = &ctx->bursts[i];
+        char depth[32], latency[40], depth_time[16], latency_time[16];
+        
+        snprintf(depth, sizeof(depth), "%.1f/%d", record->reference_depth, record->peak_depth);
+        snprintf(latency, sizeof(latency), "%.4f/%.4f", record->reference_p99, record->peak_p99);
+        format_recovery(record->depth_recovery, depth_time, sizeof(depth_time));
+        format_recovery(record->latency_recovery, latency_time, sizeof(latency_time));
+        printf("%-6d %-10.2f %-7d %-17s %-12s %-21s %-12s\n", i, record->started,
+               record->tasks, depth, depth_time, latency, latency_time);
+        
+        if (record->depth_recovery >= 0) {
+            depth_times[depth_recovered++] = record->depth_recovery;
+        }
+        if (record->latency_recovery >= 0) {
+            latency_times[latency_recovered++] = record->latency_recovery;
+        }
+    }
+    
+    printf("========================================\n");
+    if (ctx->num_bursts == 0) {
+        printf("No burst completed during the run\n");
+        return;
+    }
+    printf("Depth recovered after %d of %d bursts", depth_recovered, ctx->num_bursts);
+    if (depth_recovered > 0) {
+        printf(", median %.3f s", median_of(depth_times, depth_recovered));
+    }
+    printf("\nLatency recovered after %d of %d bursts", latency_recovered, ctx->num_bursts);
+    if (latency_recovered > 0) {
+        printf(", median %.3f s", median_of(latency_times, latency_recovered));
+    }
+    printf("\n");
+}
+
+// Per-producer enqueue throughput and time spent blocked in the queue
+void print_producer_statistics(AppContext* ctx) {
+    char spec[48];
+    
+    if (ctx->num_producers == 0) {
+        return;
+    }
+    
+    printf("\nProducer Statistics:\n");
+    printf("========================================\n");
+    printf("%-9s %-20s %-13s %-10s %-12s %-10s %-12s\n",
+           "Producer", "Rate:Priorities", "Task IDs", "Enqueued", "Enqueue/s",
+           "Blocked %", "Max Wait (s)");
+    printf("========================================\n");
+    
+    long total_enqueued = 0;
+    double total_blocked = 0.0;
+    for (int i = 0; i < ctx->num_producers; i++) {
+        const Producer* producer = &ctx->producers[i];
+        double wall = producer->usage.wall_time;
+        char ids[32];
+        
+        format_producer_spec(&producer->spec, spec, sizeof(spec));
+        snprintf(ids, sizeof(ids), "%d-%d", producer->first_task_id,
+                 producer->end_task_id - 1);
+        printf("%-9d %-20s %-13s %-10ld %-12.1f %-10.1f %-12.6f\n",
+               i, spec, ids, producer->enqueued,
+               wall > 0 ? producer->enqueued / wall : 0.0,
+               wall > 0 ? 100.0 * producer->blocked_time / wall : 0.0,
+               producer->max_blocked);
+        total_enqueued += producer->enqueued;
+        total_blocked += producer->blocked_time;
+    }
+    
+    printf("========================================\n");
+    printf("Total Enqueued: %ld, blocked in enqueue: %.4f producer-seconds\n",
+           total_enqueued, total_blocked);
+}
+
+// Print final statistics
+void print_statistics(AppContext* ctx) {
+    StatsSnapshot snap;
+    stats_snapshot(ctx, &snap);
+    ctx->end_time = snap.taken_at;
+    double total_time = get_time_diff(&ctx->start_time, &ctx->end_time);
+    
+    printf("\n");
+    printf("========================================\n");
+    printf("           FINAL STATISTICS\n");
+    printf("========================================\n");
+    printf("Total Execution Time: %.4f seconds\n", total_time);
+    printf("Total Tasks Completed: %ld\n", snap.total_completed);
+    printf("Total Tasks Failed: %ld\n", snap.total_failed);
+    printf("Overall Throughput: %.2f tasks/second\n", 
+           total_time > 0 ? snap.total_completed / total_time : 0);
+    printf("Latency p50/p90/p99/max: %.6f/%.6f/%.6f/%.6f seconds\n",
+           histogram_percentile(&snap.latency, 50.0),
+           histogram_percentile(&snap.latency, 90.0),
+           histogram_percentile(&snap.latency, 99.0),
+           snap.latency.max);
+    
+    printf("\nPer-Thread Statistics:\n");
+    printf("========================================\n");
+    printf("%-8s %-15s %-15s %-15s %-15s %-15s\n", 
+           "Thread", "Tasks", "Failed", "Total Time", "Avg Time", "Max Time");
+    printf("========================================\n");
+    
+    for (int i = 0; i < ctx->num_threads; i++) {
+        WorkerStats* stats = &snap.workers[i];
+        long handled = stats->tasks_completed + stats->tasks_forwarded;
+        double avg_time = handled > 0 ? stats->total_processing_time / handled : 0.0;
+        
+        printf("%-8d %-15ld %-15ld %-15.6f %-15.6f %-15.6f\n",
+               stats->thread_id,
+               handled,
+               stats->tasks_failed,
+               stats->total_processing_time,
+               avg_time,
+               stats->max_processing_time);
+    }
+    
+    printf("========================================\n");
+    
+    if (ctx->num_nodes > 1) {
+        long total_local = 0;
+        long total_remote = 0;
+        
+        printf("\nNUMA Dequeue Locality:\n");
+        printf("========================================\n");
+        printf("%-8s %-8s %-15s %-15s %-15s\n", "Thread", "Node", "Local", "Remote", "Local %");
+        printf("========================================\n");
+        
+        for (int i = 0; i < ctx->num_threads; i++) {
+            WorkerStats* stats = &snap.workers[i];
+            long dequeues = stats->local_dequeues + stats->remote_dequeues;
+            
+            printf("%-8d %-8d %-15ld %-15ld %-15.1f\n",
+                   stats->thread_id,
+                   ctx->worker_nodes[i],
+                   stats->local_dequeues,
+                   stats->remote_dequeues,
+                   dequeues > 0 ? 100.0 * stats->local_dequeues / dequeues : 0.0);
+            total_local += stats->local_dequeues;
+            total_remote += stats->remote_dequeues;
+        }
+        
+        printf("========================================\n");
+        printf("Total Local/Remote Dequeues: %ld/%ld\n", total_local, total_remote);
+    }
+    
+    print_stage_statistics(ctx, &snap, total_time);
+    print_dag_statistics(ctx);
+    print_future_statistics(ctx, total_time);
+    print_key_statistics(ctx);
+    print_producer_statistics(ctx);
+    print_burst_statistics(ctx);
+    print_thread_usage(ctx, &snap);
+    print_lock_statistics(ctx);
+    
+    if (ctx->worker_perf) {
+        PerfSample samples[MAX_THREADS];
+        PerfSample total;
+        char line[256];
+        
+        memset(&total, 0, sizeof(total));
+        total.available = perf_snapshot(ctx, samples);
+        
+        // Any worker may be the one whose counters failed to open
+        int error = 0;
+        for (int i = 0; i < ctx->num_threads && error == 0; i++) {
+            error = ctx->worker_perf[i].error;
+        }
+        if (error == 0) {
+            error = ENOSYS;
+        }
+        
+        printf("\nHardware Counters:\n");
+        printf("========================================\n");
+        if (total.available == 0) {
+            printf("Unavailable: %s", strerror(error));
+            if (error == EACCES || error == EPERM) {
+                printf(" (check kernel.perf_event_paranoid or the container seccomp profile)");
+            }
+            printf("\n");
+        } else {
+            for (int i = 0; i < ctx->num_threads; i++) {
+                for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+                    total.values[c] += samples[i].values[c];
+                }
+                perf_format(line, sizeof(line), &samples[i], snap.workers[i].tasks_completed,
+                            total_time);
+                printf("Thread %-3d %s\n", i, line);
+            }
+            perf_format(line, sizeof(line), &total, snap.total_completed, total_time);
+            printf("All        %s\n", line);
+            if (total.available != (1u << PERF_COUNTER_COUNT) - 1) {
+                printf("Some counters unavailable: %s\n", strerror(error));
+            }
+        }
+        printf("========================================\n");
+    }
+}
+
+// Parse a sysfs-style CPU list such as "0-3,8,10-11"
+int parse_cpu_list(const char* text, int* cpus, int max_cpus) {
+    int count = 0;
+    const char* p = text;
+
+    while (*p && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= MAX_CPUS) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= MAX_CPUS) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (count >= max_cpus) {
+                return -1;
+            }
+            cpus[count++] = (int)cpu;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p && *p != '\n') {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+// Read a single integer from a sysfs file
+static int read_sysfs_int(const char* path, int* value) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    int ok = fscanf(file, "%d", value) == 1;
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+// Discover online CPUs and their package/core layout from sysfs
+void topology_discover(CpuTopology* topo) {
+    cpu_set_t allowed;
+    int online[MAX_CPUS];
+    int num_online = -1;
+    char buffer[4096];
+
+    memset(topo, 0, sizeof(CpuTopology));
+
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            CPU_SET(cpu, &allowed);
+        }
+    }
+
+    FILE* file = fopen(SYSFS_CPU_DIR "/online", "r");
+    if (file) {
+        if (fgets(buffer, sizeof(buffer), file)) {
+            num_online = parse_cpu_list(buffer, online, MAX_CPUS);
+        }
+        fclose(file);
+    }
+
+    // Without sysfs, treat every allowed CPU as its own core
+    if (num_online < 0) {
+        num_online = 0;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                online[num_online++] = cpu;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_online; i++) {
+        int cpu = online[i];
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+
+        CpuInfo* info = &topo->cpus[topo->num_cpus++];
+        info->cpu = cpu;
+        info->package_id = 0;
+        info->core_id = cpu;
+
+        snprintf(buffer, sizeof(buffer),
+                 SYSFS_CPU_DIR "/cpu%d/topology/physical_package_id", cpu);
+        read_sysfs_int(buffer, &info->package_id);
+        snprintf(buffer, sizeof(buffer), SYSFS_CPU_DIR "/cpu%d/topology/core_id", cpu);
+        read_sysfs_int(buffer, &info->core_id);
+    }
+
+    // Group CPUs by NUMA node; nodes without usable CPUs are skipped
+    int node_list[MAX_NUMA_NODES];
+    int num_node_ids = -1;
+    file = fopen(SYSFS_NODE_DIR "/online", "r");
+    if (file) {
+        if (fgets(buffer, sizeof(buffer), file)) {
+            num_node_ids = parse_cpu_list(buffer, node_list, MAX_NUMA_NODES);
+        }
+        fclose(file);
+    }
+
+    for (int i = 0; i < num_node_ids; i++) {
+        int node_cpus[MAX_CPUS];
+        int num_node_cpus = -1;
+        cpu_set_t* set = &topo->node_cpus[topo->num_nodes];
+
+        snprintf(buffer, sizeof(buffer), SYSFS_NODE_DIR "/node%d/cpulist", node_list[i]);
+        file = fopen(buffer, "r");
+        if (!file) {
+            continue;
+        }
+        if (fgets(buffer, sizeof(buffer), file)) {
+            num_node_cpus = parse_cpu_list(buffer, node_cpus, MAX_CPUS);
+        }
+        fclose(file);
+
+        CPU_ZERO(set);
+        for (int j = 0; j < num_node_cpus; j++) {
+            for (int k = 0; k < topo->num_cpus; k++) {
+                if (topo->cpus[k].cpu == node_cpus[j]) {
+                    topo->cpus[k].node = topo->num_nodes;
+                    CPU_SET(node_cpus[j], set);
+                }
+            }
+        }
+        if (CPU_COUNT(set) > 0) {
+            topo->node_ids[topo->num_nodes++] = node_list[i];
+        }
+    }
+
+    // No NUMA information: everything is on a single node
+    if (topo->num_nodes == 0) {
+        topo->num_nodes = 1;
+        topo->node_ids[0] = 0;
+        CPU_ZERO(&topo->node_cpus[0]);
+        for (int i = 0; i < topo->num_cpus; i++) {
+            topo->cpus[i].node = 0;
+            CPU_SET(topo->cpus[i].cpu, &topo->node_cpus[0]);
+        }
+    }
+
+    // Derive SMT sibling indices and core/package counts
+    for (int i = 0; i < topo->num_cpus; i++) {
+        CpuInfo* info = &topo->cpus[i];
+        int new_package = 1;
+
+        for (int j = 0; j < i; j++) {
+            const CpuInfo* other = &topo->cpus[j];
+            if (other->package_id != info->package_id) {
+                continue;
+            }
+            new_package = 0;
+            if (other->core_id == info->core_id) {
+                info->smt_index++;
+            }
+        }
+
+        if (info->smt_index == 0) {
+            topo->num_cores++;
+        }
+        if (new_package) {
+            topo->num_packages++;
+        }
+    }
+
+    // Rank each core within its package so scatter can interleave packages
+    for (int i = 0; i < topo->num_cpus; i++) {
+        CpuInfo* info = &topo->cpus[i];
+        for (int j = 0; j < topo->num_cpus; j++) {
+            const CpuInfo* other = &topo->cpus[j];
+            if (other->package_id == info->package_id && other->smt_index == 0 &&
+                other->core_id < info->core_id) {
+                info->core_rank++;
+            }
+        }
+    }
+}
+
+// Order CPUs by package, core, then SMT sibling
+static int compare_cpu_compact(const void* a, const void* b) {
+    const CpuInfo* x = (const CpuInfo*)a;
+    const CpuInfo* y = (const CpuInfo*)b;
+    if (x->package_id != y->package_id) return x->package_id - y->package_id;
+    if (x->core_rank != y->core_rank) return x->core_rank - y->core_rank;
+    return x->smt_index - y->smt_index;
+}
+
+// Order CPUs by SMT sibling, then core, alternating packages
+static int compare_cpu_scatter(const void* a, const void* b) {
+    const CpuInfo* x = (const CpuInfo*)a;
+    const CpuInfo* y = (const CpuInfo*)b;
+    if (x->smt_index != y->smt_index) return x->smt_index - y->smt_index;
+    if (x->core_rank != y->core_rank) return x->core_rank - y->core_rank;
+    return x->package_id - y->package_id;
+}
+
+// Produce the CPU order a placement policy fills threads in
+int topology_order(const CpuTopology* topo, AffinityPolicy policy, int* order) {
+    CpuInfo* sorted = (CpuInfo*)malloc(topo->num_cpus * sizeof(CpuInfo));
+    int count = 0;
+
+    if (!sorted) {
+        perror("Failed to allocate CPU order");
+        return 0;
+    }
+    memcpy(sorted, topo->cpus, topo->num_cpus * sizeof(CpuInfo));
+
+    qsort(sorted, topo->num_cpus, sizeof(CpuInfo),
+          policy == AFFINITY_SCATTER ? compare_cpu_scatter : compare_cpu_compact);
+
+    for (int i = 0; i < topo->num_cpus; i++) {
+        if (policy == AFFINITY_CORE && sorted[i].smt_index != 0) {
+            continue;
+        }
+        order[count++] = sorted[i].cpu;
+    }
+
+    free(sorted);
+    return count;
+}
+
+// Assign a CPU to every worker, producer and the monitor
+int assign_thread_placement(const CpuTopology* topo, const AppConfig* config,
+                            int num_threads, ThreadPlacement* placement) {
+    int order[MAX_CPUS];
+    int count = 0;
+
+    placement->monitor_cpu = -1;
+    for (int i = 0; i < MAX_PRODUCERS; i++) {
+        placement->producer_cpus[i] = -1;
+    }
+    for (int i = 0; i < MAX_THREADS; i++) {
+        placement->worker_cpus[i] = -1;
+        placement->worker_nodes[i] = i % topo->num_nodes;
+    }
+
+    if (config->affinity == AFFINITY_NONE) {
+        return 0;
+    }
+
+    if (config->affinity == AFFINITY_LIST) {
+        for (int i = 0; i < config->cpu_list_len; i++) {
+            int known = 0;
+            for (int j = 0; j < topo->num_cpus; j++) {
+                if (topo->cpus[j].cpu == config->cpu_list[i]) {
+                    known = 1;
+                    break;
+                }
+            }
+            if (!known) {
+                fprintf(stderr, "CPU %d is offline or not allowed for this process\n",
+                        config->cpu_list[i]);
+                return -1;
+            }
+            order[count++] = config->cpu_list[i];
+        }
+    } else {
+        count = topology_order(topo, config->affinity, order);
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "No CPUs available for affinity policy %s\n",
+                affinity_policy_name(config->affinity));
+        return -1;
+    }
+
+    // Workers take the first slots; producers and the monitor follow them
+    for (int i = 0; i < num_threads; i++) {
+        placement->worker_cpus[i] = order[i % count];
+        for (int j = 0; j < topo->num_cpus; j++) {
+            if (topo->cpus[j].cpu == placement->worker_cpus[i]) {
+                placement->worker_nodes[i] = topo->cpus[j].node;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < config->num_producers; i++) {
+        placement->producer_cpus[i] = order[(num_threads + i) % count];
+    }
+    placement->monitor_cpu = order[(num_threads + config->num_producers) % count];
+
+    return 0;
+}
+
+// Create a thread, pinned to a CPU unless cpu is -1
+int create_thread_on_cpu(pthread_t* thread, int cpu, void* (*fn)(void*), void* arg) {
+    if (cpu < 0) {
+        return create_thread_on_cpuset(thread, NULL, fn, arg);
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    return create_thread_on_cpuset(thread, &cpuset, fn, arg);
+}
+
+// Create a thread restricted to a set of CPUs, unrestricted if cpus is NULL
+int create_thread_on_cpuset(pthread_t* thread, const cpu_set_t* cpus,
+                            void* (*fn)(void*), void* arg) {
+    pthread_attr_t attr;
+    int result;
+
+    if (!cpus) {
+        return pthread_create(thread, NULL, fn, arg);
+    }
+
+    if (pthread_attr_init(&attr) != 0) {
+        return -1;
+    }
+
+    result = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpus);
+    if (result == 0) {
+        result = pthread_create(thread, &attr, fn, arg);
+    }
+
+    pthread_attr_destroy(&attr);
+    return result;
+}
+
+// Format a CPU set as a compact list such as "0-3,8"
+void format_cpu_set(const cpu_set_t* cpus, char* buffer, size_t size) {
+    size_t used = 0;
+    buffer[0] = '\0';
+
+    for (int cpu = 0; cpu < MAX_CPUS && used < size; cpu++) {
+        if (!CPU_ISSET(cpu, cpus)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < MAX_CPUS && CPU_ISSET(last + 1, cpus)) {
+            last++;
+        }
+        if (last == cpu) {
+            used += snprintf(buffer + used, size - used, "%s%d", used ? "," : "", cpu);
+        } else {
+            used += snprintf(buffer + used, size - used, "%s%d-%d", used ? "," : "", cpu, last);
+        }
+        cpu = last;
+    }
+}
+
+// Human-readable name of a placement policy
+const char* affinity_policy_name(AffinityPolicy policy) {
+    switch (policy) {
+        case AFFINITY_COMPACT: return "compact";
+        case AFFINITY_SCATTER: return "scatter";
+        case AFFINITY_CORE:    return "core";
+        case AFFINITY_LIST:    return "list";
+        default:               return "none";
+    }
+}
+
+// Inverse of affinity_policy_name; returns -1 for an unknown name
+int affinity_policy_parse(const char* name, AffinityPolicy* policy) {
+    static const AffinityPolicy policies[] = {
+        AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SCATTER, AFFINITY_CORE, AFFINITY_LIST
+    };
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(name, affinity_policy_name(policies[i])) == 0) {
+            *policy = policies[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Print the chosen CPU for each thread as part of the banner
+void print_thread_placement(const CpuTopology* topo, const AppConfig* config,
+                            const ThreadPlacement* placement, int num_threads) {
+    printf("- CPU Topology: %d CPUs, %d cores, %d packages\n",
+           topo->num_cpus, topo->num_cores, topo->num_packages);
+    printf("- CPU Affinity: %s\n", affinity_policy_name(config->affinity));
+
+    if (config->numa) {
+        char cpus[256];
+        printf("- NUMA Mode: enabled (%d nodes, one queue and task pool per node)\n",
+               topo->num_nodes);
+        for (int i = 0; i < topo->num_nodes; i++) {
+            format_cpu_set(&topo->node_cpus[i], cpus, sizeof(cpus));
+            printf("    node %-5d -> CPUs %s\n", topo->node_ids[i], cpus);
+        }
+        if (config->affinity == AFFINITY_NONE) {
+            for (int i = 0; i < num_threads; i++) {
+                printf("    worker %-3d -> node %d\n", i,
+                       topo->node_ids[placement->worker_nodes[i]]);
+            }
+        }
+    }
+
+    if (config->affinity == AFFINITY_NONE) {
+        return;
+    }
+
+    for (int i = 0; i < num_threads + config->num_producers + 1; i++) {
+        int cpu;
+        char role[32];
+
+        if (i < num_threads) {
+            cpu = placement->worker_cpus[i];
+            snprintf(role, sizeof(role), "worker %d", i);
+        } else if (i < num_threads + config->num_producers) {
+            cpu = placement->producer_cpus[i - num_threads];
+            snprintf(role, sizeof(role), "producer %d", i - num_threads);
+        } else {
+            cpu = placement->monitor_cpu;
+            snprintf(role, sizeof(role), "monitor");
+        }
+
+        for (int j = 0; j < topo->num_cpus; j++) {
+            const CpuInfo* info = &topo->cpus[j];
+            if (info->cpu == cpu) {
+                printf("    %-10s -> CPU %d (package %d, core %d, thread %d, node %d)\n",
+                       role, cpu, info->package_id, info->core_id, info->smt_index,
+                       topo->node_ids[info->node]);
+                break;
+            }
+        }
+    }
+}
+
+// Read the first line of a small file, without the trailing newline
+static int read_first_line(const char* path, char* buffer, size_t size) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    int ok = fgets(buffer, size, file) != NULL;
+    fclose(file);
+    if (!ok) {
+        return -1;
+    }
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return 0;
+}
+
+// Find this process's cgroup path for a v1 controller, or the v2 path when
+// controller is NULL, from /proc/self/cgroup
+static int cgroup_self_path(const char* controller, char* path, size_t size) {
+    char line[512];
+    int found = -1;
+
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (!file) {
+        return -1;
+    }
+
+    // Lines look like "4:memory:/docker/abc" (v1) or "0::/docker/abc" (v2)
+    while (found != 0 && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* controllers = strchr(line, ':');
+        char* cgroup = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!cgroup) {
+            continue;
+        }
+        *cgroup++ = '\0';
+        controllers++;
+
+        if (!controller) {
+            if (*controllers == '\0') {
+                snprintf(path, size, "%s", cgroup);
+                found = 0;
+            }
+            continue;
+        }
+
+        for (char* name = strtok(controllers, ","); name; name = strtok(NULL, ",")) {
+            if (strcmp(name, controller) == 0) {
+                snprintf(path, size, "%s", cgroup);
+                found = 0;
+                break;
+            }
+        }
+    }
+
+    fclose(file);
+    return found;
+}
+
+// Apply the tighter of two limits where 0 means unlimited
+static void tighten_cpu_quota(ResourceLimits* limits, double quota) {
+    if (quota > 0 && (limits->cpu_quota == 0 || quota < limits->cpu_quota)) {
+        limits->cpu_quota = quota;
+    }
+}
+
+static void tighten_memory_limit(ResourceLimits* limits, long long bytes) {
+    if (bytes > 0 && (limits->memory_limit == 0 || bytes < limits->memory_limit)) {
+        limits->memory_limit = bytes;
+    }
+}
+
+// Walk from a cgroup directory up to the mount root, since every ancestor's
+// limit also applies. In a cgroup namespace the path may not exist under the
+// mount, in which case only the root is checked.
+static void cgroup_walk(const char* mount, const char* cgroup, int version,
+                        int want_cpu, int want_memory, ResourceLimits* limits) {
+    char dir[512];
+    char path[640];
+    char value[128];
+
+    snprintf(dir, sizeof(dir), "%s%s", mount, cgroup);
+    while (strlen(dir) > strlen(mount) && access(dir, F_OK) != 0) {
+        *strrchr(dir, '/') = '\0';
+    }
+
+    for (;;) {
+        if (want_cpu && version == 2) {
+            snprintf(path, sizeof(path), "%s/cpu.max", dir);
+            char quota[32];
+            long long period;
+            if (read_first_line(path, value, sizeof(value)) == 0 &&
+                sscanf(value, "%31s %lld", quota, &period) == 2 &&
+                strcmp(quota, "max") != 0 && period > 0) {
+                tighten_cpu_quota(limits, atof(quota) / period);
+            }
+        } else if (want_cpu) {
+            long long quota = -1;
+            long long period = 0;
+            snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+            if (read_first_line(path, value, sizeof(value)) == 0) {
+                quota = atoll(value);
+            }
+            snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+            if (read_first_line(path, value, sizeof(value)) == 0) {
+                period = atoll(value);
+            }
+            if (quota > 0 && period > 0) {
+                tighten_cpu_quota(limits, (double)quota / period);
+            }
+        }
+
+        if (want_memory) {
+            snprintf(path, sizeof(path), "%s/%s", dir,
+                     version == 2 ? "memory.max" : "memory.limit_in_bytes");
+            if (read_first_line(path, value, sizeof(value)) == 0 &&
+                strcmp(value, "max") != 0) {
+                tighten_memory_limit(limits, atoll(value));
+            }
+        }
+
+        if (strlen(dir) <= strlen(mount)) {
+            break;
+        }
+        *strrchr(dir, '/') = '\0';
+    }
+}
+
+// Discover CPU and memory limits from cgroup v2 or v1 and the affinity mask
+void resource_limits_discover(ResourceLimits* limits) {
+    char cgroup[256];
+    cpu_set_t allowed;
+
+    memset(limits, 0, sizeof(ResourceLimits));
+
+    limits->online_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (limits->online_cpus < 1) {
+        limits->online_cpus = 1;
+    }
+    limits->allowed_cpus = limits->online_cpus;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        limits->allowed_cpus = CPU_COUNT(&allowed);
+    }
+
+    if (access(CGROUP_ROOT "/cgroup.controllers", F_OK) == 0) {
+        limits->cgroup_version = 2;
+        if (cgroup_self_path(NULL, cgroup, sizeof(cgroup)) != 0) {
+            strcpy(cgroup, "/");
+        }
+        cgroup_walk(CGROUP_ROOT, cgroup, 2, 1, 1, limits);
+    } else if (access(CGROUP_ROOT "/memory", F_OK) == 0 ||
+               access(CGROUP_ROOT "/cpu", F_OK) == 0) {
+        limits->cgroup_version = 1;
+        if (cgroup_self_path("cpu", cgroup, sizeof(cgroup)) != 0) {
+            strcpy(cgroup, "/");
+        }
+        if (access(CGROUP_ROOT "/cpu", F_OK) == 0) {
+            cgroup_walk(CGROUP_ROOT "/cpu", cgroup, 1, 1, 0, limits);
+        } else {
+            cgroup_walk(CGROUP_ROOT "/cpu,cpuacct", cgroup, 1, 1, 0, limits);
+        }
+        if (cgroup_self_path("memory", cgroup, sizeof(cgroup)) != 0) {
+            strcpy(cgroup, "/");
+        }
+        cgroup_walk(CGROUP_ROOT "/memory", cgroup, 1, 0, 1, limits);
+    }
+
+    // v1 reports "unlimited" as a huge page-rounded number
+    long long physical = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (physical > 0 && limits->memory_limit >= physical) {
+        limits->memory_limit = 0;
+    }
+
+    limits->effective_cpus = limits->allowed_cpus;
+    if (limits->cpu_quota > 0 && ceil(limits->cpu_quota) < limits->effective_cpus) {
+        limits->effective_cpus = (int)ceil(limits->cpu_quota);
+    }
+}
+
+// Fill in worker count and queue capacity not given on the command line
+void apply_resource_defaults(const ResourceLimits* limits, AppConfig* config) {
+    if (config->num_threads == 0) {
+        config->num_threads = DEFAULT_NUM_THREADS;
+        if (limits->effective_cpus < config->num_threads) {
+            config->num_threads = limits->effective_cpus;
+        }
+    }
+
+    if (config->queue_capacity == 0) {
+        config->queue_capacity = MAX_QUEUE_SIZE;
+        if (limits->memory_limit > 0) {
+            // Each slot may carry a pooled task as well as the pointer to it
+            long long budget = limits->memory_limit / QUEUE_MEMORY_FRACTION;
+            long long slots = budget / (long long)(sizeof(void*) + sizeof(Task));
+            if (slots < config->queue_capacity) {
+                config->queue_capacity = slots < MIN_QUEUE_SIZE ? MIN_QUEUE_SIZE : (int)slots;
+            }
+        }
+    }
+}
+
+// Under valgrind every instruction is emulated, so shrink the workload to
+// keep memcheck/helgrind/callgrind sessions to minutes. --tasks still wins.
+void apply_valgrind_defaults(AppConfig* config) {
+    int task_divisor = 1;
+
+    config->valgrind = RUNNING_ON_VALGRIND ? 1 : 0;
+    if (config->valgrind) {
+        task_divisor = VALGRIND_TASK_DIVISOR;
+        config->work_divisor = VALGRIND_WORK_DIVISOR;
+    }
+    if (config->num_tasks == 0) {
+        config->num_tasks = DEFAULT_NUM_TASKS / task_divisor;
+    }
+    config->stress_tasks = DEFAULT_STRESS_TASKS / task_divisor;
+    if (config->burst.amplitude == BURST_AMPLITUDE_DEFAULT) {
+        config->burst.amplitude = config->stress_tasks;
+    }
+}
+
+// Print the limits the defaults were derived from
+void print_resource_limits(const ResourceLimits* limits) {
+    char quota[32];
+    char memory[32];
+
+    if (limits->cpu_quota > 0) {
+        snprintf(quota, sizeof(quota), "%.2f CPUs", limits->cpu_quota);
+    } else {
+        snprintf(quota, sizeof(quota), "unlimited");
+    }
+    if (limits->memory_limit > 0) {
+        snprintf(memory, sizeof(memory), "%.1f MiB", limits->memory_limit / (1024.0 * 1024.0));
+    } else {
+        snprintf(memory, sizeof(memory), "unlimited");
+    }
+
+    if (limits->cgroup_version > 0) {
+        printf("- Cgroup: v%d, CPU quota %s, memory limit %s\n",
+               limits->cgroup_version, quota, memory);
+    } else {
+        printf("- Cgroup: not found\n");
+    }
+    printf("- Effective CPUs: %d (%d online, %d in affinity mask)\n",
+           limits->effective_cpus, limits->online_cpus, limits->allowed_cpus);
+}
+
+// Signal handler for graceful shutdown
+void signal_handler(int sig) {
+    if (sig == SIGINT || sig == SIGTERM) {
+        printf("\nShutdown signal received. Cleaning up...\n");
+        shutdown_requested = 1;
+        interrupted = 1;
+    }
+}
+
+static const char* dag_shape_names[] = {"none", "layered", "tree"};
+
+// Parse SHAPE[:key=value,...]: "layered:layers=L,width=W,fanin=F" or
+// "tree:depth=D,fanout=F", both also taking seed=N
+int parse_dag_spec(const char* text, DagSpec* spec) {
+    char buffer[128];
+    char* save;
+    
+    if (strlen(text) >= sizeof(buffer)) {
+        return -1;
+    }
+    strcpy(buffer, text);
+    char* options = strchr(buffer, ':');
+    if (options) {
+        *options++ = '\0';
+    }
+    
+    memset(spec, 0, sizeof(DagSpec));
+    spec->seed = 1;
+    if (strcmp(buffer, dag_shape_names[DAG_LAYERED]) == 0) {
+        spec->shape = DAG_LAYERED;
+        spec->layers = 10;
+        spec->width = 100;
+        spec->fanin = 3;
+    } else if (strcmp(buffer, dag_shape_names[DAG_TREE]) == 0) {
+        spec->shape = DAG_TREE;
+        spec->layers = 6;
+        spec->fanin = 4;
+    } else {
+        return strcmp(buffer, dag_shape_names[DAG_NONE]) == 0 && !options ? 0 : -1;
+    }
+    
+    for (char* field = options ? strtok_r(options, ",", &save) : NULL; field;
+         field = strtok_r(NULL, ",", &save)) {
+        char* value = strchr(field, '=');
+        if (!value) {
+            return -1;
+        }
+        *value++ = '\0';
+        int layered = spec->shape == DAG_LAYERED;
+        if (strcmp(field, layered ? "layers" : "depth") == 0) {
+            spec->layers = atoi(value);
+        } else if (layered && strcmp(field, "width") == 0) {
+            spec->width = atoi(value);
+        } else if (strcmp(field, layered ? "fanin" : "fanout") == 0) {
+            spec->fanin = atoi(value);
+        } else if (strcmp(field, "seed") == 0) {
+            spec->seed = (unsigned)strtoul(value, NULL, 10);
+        } else {
+            return -1;
+        }
+    }
+    
+    if (spec->shape == DAG_LAYERED && (spec->layers < 1 || spec->width < 1)) {
+        return -1;
+    }
+    if (spec->shape == DAG_TREE && (spec->layers < 0 || spec->fanin < 2 || spec->layers > 62)) {
+        return -1;
+    }
+    if (spec->fanin < 1 || spec->fanin > MAX_DAG_FANIN || dag_node_count(spec) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Inverse of parse_dag_spec
+void format_dag_spec(const DagSpec* spec, char* buffer, size_t size) {
+    if (spec->shape == DAG_LAYERED) {
+        snprintf(buffer, size, "layered:layers=%d,width=%d,fanin=%d,seed=%u", spec->layers,
+                 spec->width, spec->fanin, spec->seed);
+    } else if (spec->shape == DAG_TREE) {
+        snprintf(buffer, size, "tree:depth=%d,fanout=%d,seed=%u", spec->layers, spec->fanin,
+                 spec->seed);
+    } else {
+        snprintf(buffer, size, "none");
+    }
+}
+
+static const char* stage_work_names[] = {"priority", "cpu", "io"};
+
+// Parse NAME:WORKERS[:WORK], WORK being priority (the default model),
+// cpu=USEC or io=USEC, e.g. "compute:4:cpu=500"
+int parse_stage_spec(const char* text, StageSpec* stage) {
+    char buffer[64];
+    
+    if (strlen(text) >= sizeof(buffer)) {
+        return -1;
+    }
+    strcpy(buffer, text);
+    char* workers = strchr(buffer, ':');
+    if (!workers || workers == buffer || workers - buffer >= (long)sizeof(stage->name)) {
+        return -1;
+    }
+    *workers++ = '\0';
+    snprintf(stage->name, sizeof(stage->name), "%s", buffer);
+    
+    char* work = strchr(workers, ':');
+    if (work) {
+        *work++ = '\0';
+    }
+    stage->workers = atoi(workers);
+    if (stage->workers < 1 || stage->workers > MAX_THREADS) {
+        return -1;
+    }
+    
+    stage->work = WORK_PRIORITY;
+    stage->work_us = 0;
+    if (!work || strcmp(work, stage_work_names[WORK_PRIORITY]) == 0) {
+        return 0;
+    }
+    char* value = strchr(work, '=');
+    if (!value) {
+        return -1;
+    }
+    *value++ = '\0';
+    if (strcmp(work, stage_work_names[WORK_CPU]) == 0) {
+        stage->work = WORK_CPU;
+    } else if (strcmp(work, stage_work_names[WORK_IO]) == 0) {
+        stage->work = WORK_IO;
+    } else {
+        return -1;
+    }
+    stage->work_us = atoi(value);
+    return stage->work_us > 0 ? 0 : -1;
+}
+
+// Inverse of parse_stage_spec
+void format_stage_spec(const StageSpec* stage, char* buffer, size_t size) {
+    if (stage->work == WORK_PRIORITY) {
+        snprintf(buffer, size, "%s:%d:%s", stage->name, stage->workers,
+                 stage_work_names[stage->work]);
+    } else {
+        snprintf(buffer, size, "%s:%d:%s=%d", stage->name, stage->workers,
+                 stage_work_names[stage->work], stage->work_us);
+    }
+}
+
+static const char* burst_shape_names[] = {"none", "spike", "square", "ramp", "sine"};
+
+// The stress load used when --burst is not given: a spike every five seconds
+void burst_profile_default(BurstProfile* profile) {
+    profile->shape = BURST_SPIKE;
+    profile->amplitude = BURST_AMPLITUDE_DEFAULT;
+    profile->period_ms = DEFAULT_BURST_PERIOD_MS;
+    profile->duration_ms = 0;
+    profile->min_priority = 1;  // Lowest priority for stress tasks
+    profile->max_priority = 1;
+}
+
+// Parse SHAPE[:key=value,...], e.g. "ramp:amplitude=2000,period=4000,
+// duration=1500,priority=1-3"; unset keys keep their current values
+int parse_burst_profile(const char* text, BurstProfile* profile) {
+    char buffer[128];
+    char* save;
+    
+    if (strlen(text) >= sizeof(buffer)) {
+        return -1;
+    }
+    strcpy(buffer, text);
+    char* options = strchr(buffer, ':');
+    if (options) {
+        *options++ = '\0';
+    }
+    
+    int shape = -1;
+    for (int i = 0; i < (int)(sizeof(burst_shape_names) / sizeof(burst_shape_names[0])); i++) {
+        if (strcmp(buffer, burst_shape_names[i]) == 0) {
+            shape = i;
+        }
+    }
+    if (shape < 0) {
+        return -1;
+    }
+    profile->shape = (BurstShape)shape;
+    if (profile->shape != BURST_SPIKE && profile->duration_ms == 0) {
+        profile->duration_ms = DEFAULT_BURST_DURATION_MS;
+    }
+    
+    for (char* field = options ? strtok_r(options, ",", &save) : NULL; field;
+         field = strtok_r(NULL, ",", &save)) {
+        char* value = strchr(field, '=');
+        if (!value) {
+            return -1;
+        }
+        *value++ = '\0';
+        if (strcmp(field, "amplitude") == 0) {
+            profile->amplitude = atoi(value);
+            if (profile->amplitude < 0) {
+                return -1;
+            }
+        } else if (strcmp(field, "period") == 0) {
+            profile->period_ms = atoi(value);
+        } else if (strcmp(field, "duration") == 0) {
+            profile->duration_ms = atoi(value);
+        } else if (strcmp(field, "priority") == 0) {
+            if (sscanf(value, "%d-%d", &profile->min_priority, &profile->max_priority) != 2) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    
+    if (profile->period_ms < 1 || profile->duration_ms < 0 ||
+        profile->duration_ms > profile->period_ms || profile->min_priority < 1 ||
+        profile->max_priority < profile->min_priority) {
+        return -1;
+    }
+    return 0;
+}
+
+// Inverse of parse_burst_profile
+void format_burst_profile(const BurstProfile* profile, char* buffer, size_t size) {
+    if (profile->shape == BURST_NONE) {
+        snprintf(buffer, size, "none");
+        return;
+    }
+    snprintf(buffer, size, "%s:amplitude=%d,period=%d,duration=%d,priority=%d-%d",
+             burst_shape_names[profile->shape], profile->amplitude, profile->period_ms,
+             profile->duration_ms, profile->min_priority, profile->max_priority);
+}
+
+// Parse RATE[:MIN-MAX], e.g. "2000:1-5"; a rate of 0 or "max" keeps the
+// default throttle
+int parse_producer_spec(const char* text, ProducerSpec* spec) {
+    char* end;
+    
+    spec->min_priority = DEFAULT_MIN_PRIORITY;
+    spec->max_priority = DEFAULT_MAX_PRIORITY;
+    if (strncmp(text, "max", 3) == 0) {
+        spec->rate = 0.0;
+        end = (char*)text + 3;
+    } else {
+        spec->rate = strtod(text, &end);
+        if (end == text || spec->rate < 0) {
+            return -1;
+        }
+    }
+    
+    if (*end == ':') {
+        if (sscanf(end + 1, "%d-%d", &spec->min_priority, &spec->max_priority) != 2) {
+            return -1;
+        }
+    } else if (*end != '\0') {
+        return -1;
+    }
+    if (spec->min_priority < 1 || spec->max_priority < spec->min_priority) {
+        return -1;
+    }
+    return 0;
+}
+
+// Inverse of parse_producer_spec
+void format_producer_spec(const ProducerSpec* spec, char* buffer, size_t size) {
+    if (spec->rate > 0) {
+        snprintf(buffer, size, "%g:%d-%d", spec->rate, spec->min_priority, spec->max_priority);
+    } else {
+        snprintf(buffer, size, "max:%d-%d", spec->min_priority, spec->max_priority);
+    }
+}
+
+// Print command line help
+void print_usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --threads=N         Worker threads (default: derived from cgroup CPU limits)\n");
+    printf("  --tasks=N           Tasks to generate (default: %d, scaled down under valgrind)\n",
+           DEFAULT_NUM_TASKS);
+    printf("  --producers=N       Producer threads sharing the task IDs (default: 1, max %d)\n",
+           MAX_PRODUCERS);
+    printf("  --producer=SPEC     Add a producer generating RATE[:MIN-MAX] tasks per second\n");
+    printf("                      with priorities MIN-MAX (rate max = default throttle, 1-10)\n");
+    printf("  --burst=PROFILE     Stress load: none, or SHAPE[:amplitude=N,period=MS,duration=MS,\n");
+    printf("                      priority=MIN-MAX] with SHAPE spike, square, ramp or sine\n");
+    printf("                      (default: spike of %d tasks every %d ms)\n",
+           DEFAULT_STRESS_TASKS, DEFAULT_BURST_PERIOD_MS);
+    printf("  --stage=SPEC        Add a pipeline stage NAME:WORKERS[:WORK], WORK being priority,\n");
+    printf("                      cpu=USEC or io=USEC; stages run in order, each with its own\n");
+    printf("                      queue, and replace --threads (max %d stages)\n", MAX_STAGES);
+    printf("  --dag=SPEC          Run a dependency graph instead of the producers' tasks:\n");
+    printf("                      layered[:layers=L,width=W,fanin=F] or tree[:depth=D,fanout=F],\n");
+    printf("                      with seed=N to draw a different graph (max %d nodes)\n",
+           MAX_DAG_NODES);
+    printf("  --requests=FANOUT   Producers submit requests instead of tasks: FANOUT futures\n");
+    printf("                      sharing a task's work, joined and answered by a continuation\n");
+    printf("                      (max %d)\n", MAX_REQUEST_FANOUT);
+    printf("  --keys=N            Give tasks one of N keys; tasks sharing a key run in the\n");
+    printf("                      order they were submitted (max %d)\n", MAX_KEYS);
+    printf("  --queue-capacity=N  Queue slots (default: derived from cgroup memory limit)\n");
+    printf("  --affinity=POLICY   Thread placement: none, compact, scatter, core\n");
+    printf("  --cpus=LIST         Pin threads to an explicit CPU list (e.g. 0,2,4-7)\n");
+    printf("  --numa              One queue and task pool per NUMA node, workers bound to nodes\n");
+    printf("  --history=N         Monitor intervals kept for the exit dump (default: %d)\n",
+           DEFAULT_HISTORY_SIZE);
+    printf("  --history-file=PATH Write the interval history CSV here instead of stdout\n");
+    printf("  --metrics-format=F  Emit machine-readable metrics: jsonl or csv\n");
+    printf("  --metrics-out=DEST  Metrics destination: path, fd:N or - (default: stdout)\n");
+    printf("  --prometheus=ADDR   Serve Prometheus metrics on unix:PATH or a loopback port\n");
+    printf("  --shm[=NAME]        Publish live stats in shared memory for valiant_top\n");
+    printf("                      (default name: %s<pid>)\n", VALIANT_SHM_PREFIX);
+    printf("  --perf              Per-worker cycles, instructions, LLC/branch misses, switches\n");
+    printf("  --trace=PATH        Write a Chrome/Perfetto trace of task lifecycles and waits\n");
+    printf("  --trace-sample=N    Trace one task in N (default: every task)\n");
+    printf("  --runs=N, --trials=N  Repeat the run N times (default: 1, or as many as --compare's\n");
+    printf("                      baseline holds); use at least %d for comparisons\n",
+           BASELINE_MIN_RUNS);
+    printf("  --warmup=MS         Leave the first MS of each run out of its figures\n");
+    printf("  --reuse-context     Keep queues, pools and stats memory across runs\n");
+    printf("  --save-baseline=PATH  Save the configuration and each run's results\n");
+    printf("  --compare=PATH      Rerun a saved baseline's configuration and exit with status %d\n",
+           EXIT_REGRESSION);
+    printf("                      if throughput or latency regressed significantly\n");
+    printf("  --regression-threshold=PCT  Median change treated as noise (default: %.0f)\n",
+           DEFAULT_REGRESSION_THRESHOLD);
+    printf("  --help              Show this help\n");
+}
+
+// Parse command line options into the configuration
+void parse_arguments(int argc, char* argv[], AppConfig* config) {
+    static const struct option options[] = {
+        {"threads",        required_argument, NULL, 't'},
+        {"tasks",          required_argument, NULL, 'k'},
+        {"producers",      required_argument, NULL, 'g'},
+        {"producer",       required_argument, NULL, 'G'},
+        {"burst",          required_argument, NULL, 'b'},
+        {"stage",          required_argument, NULL, 'L'},
+        {"dag",            required_argument, NULL, 'D'},
+        {"requests",       required_argument, NULL, 'Q'},
+        {"keys",           required_argument, NULL, 'K'},
+        {"queue-capacity", required_argument, NULL, 'q'},
+        {"affinity", required_argument, NULL, 'a'},
+        {"cpus",     required_argument, NULL, 'c'},
+        {"numa",     no_argument,       NULL, 'n'},
+        {"history",        required_argument, NULL, 'H'},
+        {"history-file",   required_argument, NULL, 'F'},
+        {"metrics-format", required_argument, NULL, 'M'},
+        {"metrics-out",    required_argument, NULL, 'O'},
+        {"prometheus",     required_argument, NULL, 'P'},
+        {"shm",            optional_argument, NULL, 'S'},
+        {"perf",           no_argument,       NULL, 'p'},
+        {"trace",          required_argument, NULL, 'T'},
+        {"trace-sample",   required_argument, NULL, 's'},
+        {"runs",           required_argument, NULL, 'R'},
+        {"trials",         required_argument, NULL, 'R'},
+        {"warmup",         required_argument, NULL, 'W'},
+        {"reuse-context",  no_argument,       NULL, 'U'},
+        {"save-baseline",  required_argument, NULL, 'B'},
+        {"compare",        required_argument, NULL, 'C'},
+        {"regression-threshold", required_argument, NULL, 'x'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    memset(config, 0, sizeof(AppConfig));
+    config->work_divisor = 1;
+    config->affinity = AFFINITY_NONE;
+    config->history_size = DEFAULT_HISTORY_SIZE;
+    config->trace_sample = 1;
+    config->regression_threshold = DEFAULT_REGRESSION_THRESHOLD;
+    burst_profile_default(&config->burst);
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                config->num_threads = atoi(optarg);
+                if (config->num_threads < 1 || config->num_threads > MAX_THREADS) {
+                    fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                config->num_tasks = atoi(optarg);
+                if (config->num_tasks < 1) {
+                    fprintf(stderr, "Task count must be positive\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'g':
+                config->num_producers = atoi(optarg);
+                if (config->num_producers < 1 || config->num_producers > MAX_PRODUCERS) {
+                    fprintf(stderr, "Producer count must be between 1 and %d\n", MAX_PRODUCERS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'G':
+                if (config->num_producer_specs == MAX_PRODUCERS) {
+                    fprintf(stderr, "At most %d producers can be configured\n", MAX_PRODUCERS);
+                    exit(EXIT_FAILURE);
+                }
+                if (parse_producer_spec(optarg,
+                                        &config->producers[config->num_producer_specs]) != 0) {
+                    fprintf(stderr, "Invalid producer (want RATE[:MIN-MAX]): %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                config->num_producer_specs++;
+                break;
+            case 'b':
+                if (parse_burst_profile(optarg, &config->burst) != 0) {
+                    fprintf(stderr, "Invalid burst profile: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L':
+                if (config->num_stages == MAX_STAGES) {
+                    fprintf(stderr, "At most %d pipeline stages\n", MAX_STAGES);
+                    exit(EXIT_FAILURE);
+                }
+                if (parse_stage_spec(optarg, &config->stages[config->num_stages]) != 0) {
+                    fprintf(stderr, "Invalid stage: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                config->num_stages++;
+                break;
+            case 'D':
+                if (parse_dag_spec(optarg, &config->dag) != 0) {
+                    fprintf(stderr, "Invalid DAG: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Q':
+                config->request_fanout = atoi(optarg);
+                if (config->request_fanout < 1 || config->request_fanout > MAX_REQUEST_FANOUT) {
+                    fprintf(stderr, "Request fan-out must be between 1 and %d\n",
+                            MAX_REQUEST_FANOUT);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'K':
+                config->num_keys = atoi(optarg);
+                if (config->num_keys < 1 || config->num_keys > MAX_KEYS) {
+                    fprintf(stderr, "Key count must be between 1 and %d\n", MAX_KEYS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                config->queue_capacity = atoi(optarg);
+                if (config->queue_capacity < 1) {
+                    fprintf(stderr, "Queue capacity must be positive\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                // "list" is implied by --cpus rather than chosen directly
+                if (affinity_policy_parse(optarg, &config->affinity) != 0 ||
+                    config->affinity == AFFINITY_LIST) {
+                    fprintf(stderr, "Unknown affinity policy: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                config->cpu_list_len = parse_cpu_list(optarg, config->cpu_list, MAX_CPUS);
+                if (config->cpu_list_len <= 0) {
+                    fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                config->affinity = AFFINITY_LIST;
+                break;
+            case 'n':
+                config->numa = 1;
+                break;
+            case 'H':
+                config->history_size = atoi(optarg);
+                if (config->history_size < 1) {
+                    fprintf(stderr, "History size must be positive\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'F':
+                config->history_file = optarg;
+                break;
+            case 'M':
+                if (strcmp(optarg, "jsonl") == 0) {
+                    config->metrics_format = METRICS_JSONL;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    config->metrics_format = METRICS_CSV;
+                } else {
+                    fprintf(stderr, "Unknown metrics format: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'O':
+                config->metrics_out = optarg;
+                break;
+            case 'P':
+                config->prometheus = optarg;
+                break;
+            case 'S':
+                if (optarg) {
+                    if (optarg[0] != '/' || strlen(optarg) >= sizeof(config->shm_name) ||
+                        strchr(optarg + 1, '/')) {
+                        fprintf(stderr, "Shared-memory name must look like /name\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    strcpy(config->shm_name, optarg);
+                } else {
+                    snprintf(config->shm_name, sizeof(config->shm_name), "%s%d",
+                             VALIANT_SHM_PREFIX, (int)getpid());
+                }
+                break;
+            case 'p':
+                config->perf = 1;
+                break;
+            case 'T':
+                config->trace_file = optarg;
+                break;
+            case 's':
+                config->trace_sample = atoi(optarg);
+                if (config->trace_sample < 1) {
+                    fprintf(stderr, "Trace sample rate must be positive\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                config->runs = atoi(optarg);
+                if (config->runs < 1 || config->runs > BASELINE_MAX_RUNS) {
+                    fprintf(stderr, "Run count must be between 1 and %d\n", BASELINE_MAX_RUNS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'W':
+                config->warmup_ms = atoi(optarg);
+                if (config->warmup_ms < 0 || config->warmup_ms >= DEFAULT_TEST_DURATION * 1000) {
+                    fprintf(stderr, "Warmup must be between 0 and %d ms\n",
+                            DEFAULT_TEST_DURATION * 1000 - 1);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'U':
+                config->reuse_context = 1;
+                break;
+            case 'B':
+                config->baseline_out = optarg;
+                break;
+            case 'C':
+                config->baseline_in = optarg;
+                break;
+            case 'x':
+                config->regression_threshold = atof(optarg);
+                if (config->regression_threshold < 0) {
+                    fprintf(stderr, "Regression threshold must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // A destination on its own implies the default format
+    if (config->metrics_out && config->metrics_format == METRICS_NONE) {
+        config->metrics_format = METRICS_JSONL;
+    }
+    
+    // Producers without a --producer of their own get the default mix
+    if (config->num_producers == 0) {
+        config->num_producers = config->num_producer_specs > 0 ? config->num_producer_specs : 1;
+    }
+    if (config->num_producer_specs > config->num_producers) {
+        fprintf(stderr, "%d producers configured but --producers=%d\n",
+                config->num_producer_specs, config->num_producers);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = config->num_producer_specs; i < config->num_producers; i++) {
+        config->producers[i].rate = 0.0;
+        config->producers[i].min_priority = DEFAULT_MIN_PRIORITY;
+        config->producers[i].max_priority = DEFAULT_MAX_PRIORITY;
+    }
+    
+    // A pipeline's workers are its stages' workers
+    if (config->num_stages > 0) {
+        int workers = 0;
+        for (int s = 0; s < config->num_stages; s++) {
+            workers += config->stages[s].workers;
+        }
+        if (workers > MAX_THREADS) {
+            fprintf(stderr, "Pipeline stages need %d workers, more than %d\n", workers, MAX_THREADS);
+            exit(EXIT_FAILURE);
+        }
+        if (config->num_threads != 0 && config->num_threads != workers) {
+            fprintf(stderr, "--threads=%d conflicts with the %d workers of the pipeline stages\n",
+                    config->num_threads, workers);
+            exit(EXIT_FAILURE);
+        }
+        if (config->numa) {
+            fprintf(stderr, "--stage cannot be combined with --numa\n");
+            exit(EXIT_FAILURE);
+        }
+        config->num_threads = workers;
+    }
+    
+    // Request parts and continuations all go through the first queue
+    if (config->request_fanout > 0 && (config->num_stages > 0 || config->numa)) {
+        fprintf(stderr, "--requests cannot be combined with --stage or --numa\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Keyed tasks are handed on through the first queue and nowhere else
+    if (config->num_keys > 0 && (config->num_stages > 0 || config->numa ||
+                                 config->request_fanout > 0 || config->dag.shape != DAG_NONE)) {
+        fprintf(stderr, "--keys cannot be combined with --stage, --numa, --requests or --dag\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // A DAG run finishes when its last node does
+    if (config->dag.shape != DAG_NONE) {
+        if (config->num_stages > 0 || config->numa || config->request_fanout > 0) {
+            fprintf(stderr, "--dag cannot be combined with --stage, --numa or --requests\n");
+            exit(EXIT_FAILURE);
+        }
+        config->num_tasks = dag_node_count(&config->dag);
+    }
+}
+
+// Run the application once on a fresh or reset context: start every thread,
+// wait for the tasks or the time limit, then report. Returns the figures
+// measured after the warmup in result, or -1 if the run ended during warmup.
+int run_application(AppContext* ctx, const CpuTopology* topology,
+                    const ThreadPlacement* placement, RunResult* result) {
+    const AppConfig* config = ctx->config;
+    pthread_t producer_threads[MAX_PRODUCERS];
+    pthread_t monitor_thread_id, stress_thread, exporter_thread;
+    int num_threads = config->num_threads;
+    int run_duration = DEFAULT_TEST_DURATION;
+    
+    if (config->shm_name[0]) {
+        ctx->shm = shm_stats_create(ctx, config->shm_name);
+        if (!ctx->shm) {
+            exit(EXIT_FAILURE);
+        }
+        printf("Publishing live stats to shared memory %s\n", config->shm_name);
+    }
+    
+    // From here on threads log through per-thread rings, so a slow stdout
+    // never stalls a worker
+    fflush(stdout);
+    ctx->logger = logger_create(STDOUT_FILENO);
+    if (!ctx->logger || logger_start(ctx->logger, placement->monitor_cpu) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    logger_register(ctx->logger);
+    
+    // Create worker threads
+    log_printf("Creating %d worker threads...\n", num_threads);
+    if (start_workers(ctx, topology, placement) != 0) {
+        perror("Failed to create worker thread");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (ctx->dag) {
+        dag_seed(ctx);
+    }
+    
+    // Create task producer threads
+    log_printf("Creating %d task producer thread(s)...\n", ctx->num_producers);
+    for (int i = 0; i < ctx->num_producers; i++) {
+        if (create_thread_on_cpu(&producer_threads[i], placement->producer_cpus[i],
+                                 task_generator_thread, &ctx->producers[i]) != 0) {
+            perror("Failed to create task producer thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Create monitor thread
+    log_printf("Creating monitor thread...\n");
+    if (create_thread_on_cpu(&monitor_thread_id, placement->monitor_cpu,
+                             monitor_thread, ctx) != 0) {
+        perror("Failed to create monitor thread");
         exit(EXIT_FAILURE);
     }
     
+    // The exporter is a monitoring thread too, so it shares the monitor's CPU
+    if (ctx->prometheus_fd >= 0) {
+        log_printf("Creating Prometheus exporter thread...\n");
+        if (create_thread_on_cpu(&exporter_thread, placement->monitor_cpu,
+                                 prometheus_thread, ctx) != 0) {
+            perror("Failed to create Prometheus exporter thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
     // Create stress test thread
-    printf("Creating stress test thread...\n");
-    if (pthread_create(&stress_thread, NULL, stress_test_thread, &ctx) != 0) {
+    log_printf("Creating stress test thread...\n");
+    if (pthread_create(&stress_thread, NULL, stress_test_thread, ctx) != 0) {
         perror("Failed to create stress test thread");
         exit(EXIT_FAILURE);
     }
     
-    printf("\nApplication running. Press Ctrl+C to stop gracefully...\n");
+    log_printf("\nApplication running. Press Ctrl+C to stop gracefully...\n");
+    
+    // Profile only the steady state; run callgrind with --instr-atstart=no
+    CALLGRIND_START_INSTRUMENTATION;
+    
+    // Figures are measured from the end of the warmup window
+    StatsSnapshot snap, warm;
+    int warmed = config->warmup_ms == 0;
+    if (warmed) {
+        memset(&warm, 0, sizeof(warm));
+        warm.taken_at = ctx->start_time;
+    }
     
-    // Main thread waits for completion or shutdown signal
+    // Main thread waits for completion or shutdown signal. It polls often
+    // so the measured duration does not round up to whole seconds.
     while (!shutdown_requested) {
-        sleep(1);
-        
-        // Check if all tasks are completed
-        pthread_mutex_lock(&ctx.stats_lock);
-        if (ctx.total_tasks_completed >= DEFAULT_NUM_TASKS && 
-            queue_is_empty(ctx.task_queue)) {
-            pthread_mutex_unlock(&ctx.stats_lock);
-            printf("\nAll tasks completed. Initiating shutdown...\n");
+        usleep(RUN_POLL_US);
+        
+        stats_snapshot(ctx, &snap);
+        double elapsed = get_time_diff(&ctx->start_time, &snap.taken_at);
+        if (!warmed && elapsed * 1000.0 >= config->warmup_ms) {
+            warm = snap;
+            warmed = 1;
+            log_printf("\nWarmup finished after %.2f seconds; measuring...\n", elapsed);
+        }
+        
+        // Check if all tasks are completed; stress tasks do not finish a DAG
+        int finished;
+        if (ctx->dag) {
+            finished = ctx->dag->remaining.load(std::memory_order_acquire) == 0;
+        } else if (config->request_fanout > 0) {
+            finished = ctx->futures->requests.load(std::memory_order_relaxed) >= config->num_tasks;
+        } else {
+            finished = snap.total_completed >= config->num_tasks;
+        }
+        if (finished && all_queues_empty(ctx)) {
+            log_printf("\nAll tasks completed. Initiating shutdown...\n");
             shutdown_requested = 1;
             break;
         }
-        pthread_mutex_unlock(&ctx.stats_lock);
         
         // Check if we've reached the time limit
-        struct timeval current_time;
-        gettimeofday(&current_time, NULL);
-        double elapsed = get_time_diff(&ctx.start_time, &current_time);
         if (elapsed >= run_duration) {
-            printf("\nTest duration reached. Initiating shutdown...\n");
+            log_printf("\nTest duration reached. Initiating shutdown...\n");
             shutdown_requested = 1;
             break;
         }
     }
     
-    // Wait for all threads to complete
-    printf("\nWaiting for threads to shutdown...\n");
+    CALLGRIND_STOP_INSTRUMENTATION;
     
-    // Join worker threads
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(ctx.worker_threads[i], NULL);
+    // Measure before the joins, which wait out the stress thread's sleep
+    stats_snapshot(ctx, &snap);
+    if (warmed) {
+        run_result_capture(&warm, &snap, result);
     }
     
+    // Wait for all threads to complete
+    log_printf("\nWaiting for threads to shutdown...\n");
+    stop_workers(ctx);
+    
     // Join other threads
-    pthread_join(generator_thread, NULL);
+    for (int i = 0; i < ctx->num_producers; i++) {
+        pthread_join(producer_threads[i], NULL);
+    }
     pthread_join(monitor_thread_id, NULL);
     pthread_join(stress_thread, NULL);
+    if (ctx->prometheus_fd >= 0) {
+        pthread_join(exporter_thread, NULL);
+    }
+    
+    // Everything still queued in the rings goes out before the final report
+    long dropped = logger_stop(ctx->logger);
+    logger_destroy(ctx->logger);
+    ctx->logger = NULL;
+    if (dropped > 0) {
+        printf("Log messages dropped: %ld\n", dropped);
+    }
     
     // Print final statistics
-    print_statistics(&ctx);
+    print_statistics(ctx);
+    if (ctx->trace) {
+        trace_write_json(ctx->trace, config->trace_file);
+    }
+    metrics_write_summary(ctx);
+    if (ctx->shm) {
+        shm_stats_finish(ctx);
+        shm_stats_destroy(ctx->shm, config->shm_name);
+        ctx->shm = NULL;
+    }
+    
+    // Dump the per-interval history for plotting
+    if (config->history_file) {
+        FILE* out = fopen(config->history_file, "w");
+        if (out) {
+            interval_history_dump(ctx->history, out);
+            fclose(out);
+            printf("Interval history written to %s\n", config->history_file);
+        } else {
+            perror("Failed to open history file");
+        }
+    } else {
+        printf("\nInterval History (CSV):\n");
+        interval_history_dump(ctx->history, stdout);
+    }
+    
+    if (!warmed) {
+        printf("Run ended inside the %d ms warmup window; nothing was measured\n",
+               config->warmup_ms);
+        return -1;
+    }
+    return 0;
+}
+
+#ifndef THREADS_NO_MAIN
+// Main function; queue_bench.c includes this file with THREADS_NO_MAIN defined
+int main(int argc, char* argv[]) {
+    AppConfig config;
+    CpuTopology topology;
+    ThreadPlacement placement;
+    ResourceLimits limits;
+    Baseline* baseline = NULL;
+    FILE* metrics = NULL;
+    int prometheus_fd = -1;
+    int exit_code = EXIT_SUCCESS;
+    
+    parse_arguments(argc, argv, &config);
+    
+    // Size the run to the container rather than the host
+    resource_limits_discover(&limits);
+    apply_resource_defaults(&limits, &config);
+    apply_valgrind_defaults(&config);
+    
+    // A comparison reruns the baseline's workload exactly
+    if (config.baseline_in) {
+        baseline = baseline_load(config.baseline_in);
+        if (!baseline) {
+            exit(EXIT_FAILURE);
+        }
+        baseline_apply_config(baseline, &config);
+        if (config.runs == 0) {
+            config.runs = baseline->num_runs;
+        }
+    }
+    if (config.runs == 0) {
+        config.runs = 1;
+    }
+    int num_threads = config.num_threads;
+    
+    // Work out where each thread should run
+    topology_discover(&topology);
+    if (assign_thread_placement(&topology, &config, num_threads, &placement) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    // Every thread polls the flag; a stale read only delays shutdown briefly
+    ANNOTATE_BENIGN_RACE_SIZED(&shutdown_requested, sizeof(shutdown_requested),
+                               "shutdown flag polled by all threads");
+    
+    // Setup signal handlers
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    
+    // Seed random number generator
+    srand(time(NULL));
+    
+    printf("========================================\n");
+    printf("       THREADING TEST APPLICATION\n");
+    printf("========================================\n");
+    printf("System Configuration:\n");
+    printf("- Max Threads: %d\n", MAX_THREADS);
+    print_resource_limits(&limits);
+    printf("- Worker Threads: %d\n", num_threads);
+    printf("- Queue Capacity: %d\n", config.queue_capacity);
+    printf("- Tasks: %d\n", config.num_tasks);
+    if (config.dag.shape != DAG_NONE) {
+        char dag[96];
+        format_dag_spec(&config.dag, dag, sizeof(dag));
+        printf("- DAG: %s\n", dag);
+    } else {
+        printf("- Producers: %d\n", config.num_producers);
+    }
+    if (config.num_producers > 1 && config.dag.shape == DAG_NONE) {
+        for (int i = 0; i < config.num_producers; i++) {
+            char spec[48];
+            int first, end;
+            format_producer_spec(&config.producers[i], spec, sizeof(spec));
+            producer_task_range(&config, i, &first, &end);
+            printf("    producer %-3d %s, tasks %d-%d\n", i, spec, first, end - 1);
+        }
+    }
+    if (config.request_fanout > 0) {
+        printf("- Requests: %d parts each, joined by a continuation\n", config.request_fanout);
+    }
+    if (config.num_keys > 0) {
+        printf("- Keys: %d, tasks of a key run in submission order\n", config.num_keys);
+    }
+    if (config.num_stages > 0) {
+        printf("- Pipeline Stages: %d\n", config.num_stages);
+        for (int s = 0; s < config.num_stages; s++) {
+            char spec[48];
+            format_stage_spec(&config.stages[s], spec, sizeof(spec));
+            printf("    stage %-3d %s\n", s, spec);
+        }
+    }
+    if (config.valgrind) {
+        printf("- Valgrind: detected, %d stress tasks per round, work per task / %d\n",
+               config.stress_tasks, config.work_divisor);
+    }
+    printf("- Test Duration: %d seconds\n", DEFAULT_TEST_DURATION);
+    char burst[96];
+    format_burst_profile(&config.burst, burst, sizeof(burst));
+    printf("- Stress Bursts: %s\n", burst);
+    if (config.runs > 1) {
+        printf("- Runs: %d%s\n", config.runs, config.reuse_context ? ", context reused" : "");
+    }
+    if (config.warmup_ms > 0) {
+        printf("- Warmup: first %d ms of each run discarded\n", config.warmup_ms);
+    }
+    if (baseline) {
+        printf("- Baseline: %s (%d runs)\n", config.baseline_in, baseline->num_runs);
+        if (baseline->effective_cpus != limits.effective_cpus) {
+            printf("  Warning: recorded with %d effective CPUs, this machine has %d\n",
+                   baseline->effective_cpus, limits.effective_cpus);
+        }
+    }
+    print_thread_placement(&topology, &config, &placement, num_threads);
+    printf("========================================\n\n");
+    
+    // Open the metrics stream before any thread can report into it
+    if (config.metrics_format != METRICS_NONE) {
+        metrics = metrics_open(config.metrics_out);
+        if (!metrics) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (config.prometheus) {
+        prometheus_fd = prometheus_listen(config.prometheus);
+        if (prometheus_fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    RunResult* results = (RunResult*)calloc(config.runs, sizeof(RunResult));
+    if (!results) {
+        perror("Failed to allocate run results");
+        exit(EXIT_FAILURE);
+    }
+    
+    // An interrupted run is incomplete, so it is not kept. The metrics stream
+    // and exporter socket outlive any one context.
+    AppContext ctx;
+    int have_context = 0;
+    int completed_runs = 0;
+    for (int run = 0; run < config.runs && !interrupted; run++) {
+        if (config.runs > 1) {
+            printf("\n========================================\n");
+            printf("              RUN %d OF %d\n", run + 1, config.runs);
+            printf("========================================\n");
+        }
+        shutdown_requested = 0;
+        if (have_context) {
+            reset_app_context(&ctx);
+        } else {
+            initialize_app_context(&ctx, num_threads, &config, &topology, &placement);
+            ctx.metrics = metrics;
+            ctx.prometheus_fd = prometheus_fd;
+            have_context = 1;
+        }
+        if (run == 0) {
+            metrics_write_header(&ctx);
+        }
+        
+        int measured = run_application(&ctx, &topology, &placement,
+                                       &results[completed_runs]) == 0;
+        if (measured && !interrupted) {
+            completed_runs++;
+        }
+        if (!config.reuse_context) {
+            cleanup_app_context(&ctx);
+            have_context = 0;
+        }
+    }
+    if (have_context) {
+        cleanup_app_context(&ctx);
+    }
     
-    // Cleanup
-    cleanup_app_context(&ctx);
+    if (completed_runs > 1) {
+        print_trial_summary(&config, results, completed_runs);
+    }
+    
+    metrics_close(metrics);
+    if (prometheus_fd >= 0) {
+        prometheus_close(prometheus_fd, config.prometheus);
+    }
+    
+    if (completed_runs < config.runs && (config.baseline_out || baseline)) {
+        printf("\nOnly %d of %d runs were measured; baseline not saved or compared\n",
+               completed_runs, config.runs);
+        exit_code = EXIT_FAILURE;
+    } else {
+        if (config.baseline_out &&
+            baseline_save(config.baseline_out, &config, &limits, results, completed_runs) != 0) {
+            exit_code = EXIT_FAILURE;
+        }
+        if (baseline && baseline_compare(baseline, config.baseline_in, results, completed_runs,
+                                         config.regression_threshold) > 0) {
+            exit_code = EXIT_REGRESSION;
+        }
+    }
+    free(results);
+    free(baseline);
     
     printf("\n========================================\n");
     printf("        THREADING TEST COMPLETED\n");
     printf("========================================\n");
     
-    return 0;
+    return exit_code;
 }
+#endif
@@ -0,0 +1,86 @@
+#ifndef VALIANT_STATS_H
+#define VALIANT_STATS_H
+
+// Layout of the shared-memory stats segment published by threads.c (--shm)
+// and read by valiant_top. Plain C so both programs can include it.
+
+#include <stdint.h>
+
+#define VALIANT_SHM_MAGIC 0x56414c53u  // "VALS"
+#define VALIANT_SHM_VERSION 1          // Bump whenever the layout below changes
+#define VALIANT_SHM_MAX_WORKERS 32
+#define VALIANT_SHM_PREFIX "/valiant-stats-"  // Default name is the prefix plus the PID
+
+// Run state reported to viewers
+enum {
+    VALIANT_STATE_RUNNING = 1,
+    VALIANT_STATE_FINISHED = 2
+};
+
+// One worker as of the last publish
+typedef struct {
+    int64_t tasks_completed;
+    int64_t tasks_failed;
+    double busy_seconds;  // Cumulative time spent processing tasks
+    double utilization;   // Busy fraction of the last interval, 0-1
+    int32_t node;
+    int32_t reserved;
+} ValiantShmWorker;
+
+// The whole segment. Fields after the header are only consistent when read
+// under the sequence counter: odd while the writer is updating them.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;      // sizeof(ValiantShmStats) of the writer
+    uint32_t sequence;  // Seqlock counter
+    int32_t pid;
+    int32_t state;
+    int32_t num_workers;
+    int32_t num_nodes;
+    int32_t queue_capacity;
+    int32_t queue_depth;
+    int32_t active_workers;
+    int32_t reserved;
+    double elapsed;  // Seconds since the run started
+    int64_t total_completed;
+    int64_t total_failed;
+    double throughput;  // Tasks per second over the last interval
+    double latency_p50;
+    double latency_p90;
+    double latency_p99;
+    double latency_max;
+    ValiantShmWorker workers[VALIANT_SHM_MAX_WORKERS];
+} ValiantShmStats;
+
+// Start an update; there is only ever one writer
+static inline void valiant_shm_write_begin(ValiantShmStats* shm) {
+    uint32_t sequence = __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Finish an update, making it visible to readers
+static inline void valiant_shm_write_end(ValiantShmStats* shm) {
+    uint32_t sequence = __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Copy a consistent view of the segment; returns 0 if the writer kept
+// changing it for too long
+static inline int valiant_shm_read(const ValiantShmStats* shm, ValiantShmStats* out) {
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        uint32_t before = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        __builtin_memcpy(out, (const void*)shm, sizeof(ValiantShmStats));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->sequence, __ATOMIC_RELAXED) == before) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,150 @@
+// Live viewer for the shared-memory stats segment published by threads --shm.
+// Build: gcc -O2 -o valiant_top valiant_top.c
+// Usage: valiant_top [-i seconds] <pid | /segment-name>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "valiant_stats.h"
+
+#define BAR_WIDTH 30
+
+volatile sig_atomic_t stop_requested = 0;
+
+// Stop on Ctrl+C
+void signal_handler(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// Attach read-only to the segment and check that we understand its layout
+const ValiantShmStats* attach_segment(const char* name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror("Failed to open shared-memory segment");
+        return NULL;
+    }
+
+    void* ptr = mmap(NULL, sizeof(ValiantShmStats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        perror("Failed to map shared-memory segment");
+        return NULL;
+    }
+
+    const ValiantShmStats* shm = (const ValiantShmStats*)ptr;
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != VALIANT_SHM_MAGIC) {
+        fprintf(stderr, "%s is not a valiant stats segment\n", name);
+        munmap(ptr, sizeof(ValiantShmStats));
+        return NULL;
+    }
+    if (shm->version != VALIANT_SHM_VERSION || shm->size != sizeof(ValiantShmStats)) {
+        fprintf(stderr, "%s has layout version %u (size %u); this viewer expects %d (size %zu)\n",
+                name, shm->version, shm->size, VALIANT_SHM_VERSION, sizeof(ValiantShmStats));
+        munmap(ptr, sizeof(ValiantShmStats));
+        return NULL;
+    }
+    return shm;
+}
+
+// Draw a utilization bar
+void print_bar(double fraction) {
+    int filled = (int)(fraction * BAR_WIDTH + 0.5);
+    if (filled < 0) filled = 0;
+    if (filled > BAR_WIDTH) filled = BAR_WIDTH;
+
+    putchar('[');
+    for (int i = 0; i < BAR_WIDTH; i++) {
+        putchar(i < filled ? '#' : ' ');
+    }
+    putchar(']');
+}
+
+// Redraw the whole screen from one consistent copy of the segment
+void render(const char* name, const ValiantShmStats* stats) {
+    printf("\033[H\033[2J");
+    printf("valiant_top - %s (pid %d, %s)\n", name, stats->pid,
+           stats->state == VALIANT_STATE_FINISHED ? "finished" : "running");
+    printf("========================================\n");
+    printf("Elapsed: %.1f s   Workers: %d active / %d   Nodes: %d\n",
+           stats->elapsed, stats->active_workers, stats->num_workers, stats->num_nodes);
+    printf("Completed: %lld   Failed: %lld   Throughput: %.2f tasks/second\n",
+           (long long)stats->total_completed, (long long)stats->total_failed,
+           stats->throughput);
+    printf("Latency p50/p90/p99/max: %.6f/%.6f/%.6f/%.6f seconds\n",
+           stats->latency_p50, stats->latency_p90, stats->latency_p99, stats->latency_max);
+    printf("Queue: %d/%d ", stats->queue_depth, stats->queue_capacity);
+    print_bar(stats->queue_capacity > 0 ? (double)stats->queue_depth / stats->queue_capacity : 0.0);
+    printf("\n========================================\n");
+    printf("%-8s %-6s %-12s %-8s %-12s %s\n", "Worker", "Node", "Tasks", "Failed", "Busy (s)",
+           "Utilization");
+
+    for (int i = 0; i < stats->num_workers && i < VALIANT_SHM_MAX_WORKERS; i++) {
+        const ValiantShmWorker* worker = &stats->workers[i];
+        printf("%-8d %-6d %-12lld %-8lld %-12.3f ", i, worker->node,
+               (long long)worker->tasks_completed, (long long)worker->tasks_failed,
+               worker->busy_seconds);
+        print_bar(worker->utilization);
+        printf(" %5.1f%%\n", 100.0 * worker->utilization);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    double interval = 1.0;
+    char name[64];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:h")) != -1) {
+        switch (opt) {
+            case 'i':
+                interval = atof(optarg);
+                if (interval <= 0) {
+                    fprintf(stderr, "Interval must be positive\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i seconds] <pid | /segment-name>\n", argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-i seconds] <pid | /segment-name>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // A bare PID refers to the default segment name of that process
+    if (argv[optind][0] == '/') {
+        snprintf(name, sizeof(name), "%s", argv[optind]);
+    } else {
+        snprintf(name, sizeof(name), "%s%s", VALIANT_SHM_PREFIX, argv[optind]);
+    }
+
+    const ValiantShmStats* shm = attach_segment(name);
+    if (!shm) {
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    ValiantShmStats stats;
+    while (!stop_requested) {
+        if (valiant_shm_read(shm, &stats)) {
+            render(name, &stats);
+            if (stats.state == VALIANT_STATE_FINISHED) {
+                break;
+            }
+        }
+        usleep((useconds_t)(interval * 1000000));
+    }
+
+    munmap((void*)shm, sizeof(ValiantShmStats));
+    return EXIT_SUCCESS;
+}